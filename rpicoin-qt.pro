@@ -74,6 +74,15 @@ contains(USE_UPNP, -) {
     win32:LIBS += -liphlpapi
 }
 
+# use: qmake "USE_SECP256K1=1" (disabled by default)
+# libsecp256k1 (https://github.com/bitcoin-core/secp256k1) must be installed for support
+contains(USE_SECP256K1, 1) {
+    message(Building with libsecp256k1 support)
+    DEFINES += USE_SECP256K1
+    INCLUDEPATH += $$SECP256K1_INCLUDE_PATH
+    LIBS += $$join(SECP256K1_LIB_PATH,,-L,) -lsecp256k1
+}
+
 # use: qmake "USE_DBUS=1" or qmake "USE_DBUS=0"
 linux:count(USE_DBUS, 0) {
     USE_DBUS=1
@@ -155,8 +164,11 @@ HEADERS += src/qt/bitcoingui.h \
     src/addrman.h \
     src/base58.h \
     src/bignum.h \
+    src/blockfile.h \
+    src/blockmap.h \
     src/chainparams.h \
     src/chainparamsseeds.h \
+    src/chainstats.h \
     src/checkpoints.h \
     src/compat.h \
     src/coincontrol.h \
@@ -168,6 +180,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/scrypt.h \
     src/pbkdf2.h \
     src/serialize.h \
+    src/socketevents.h \
+    src/blockencodings.h \
     src/core.h \
     src/main.h \
     src/miner.h \
@@ -241,7 +255,10 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/editaddressdialog.cpp \
     src/qt/bitcoinaddressvalidator.cpp \
     src/alert.cpp \
+    src/blockfile.cpp \
+    src/blockmap.cpp \
     src/chainparams.cpp \
+    src/chainstats.cpp \
     src/version.cpp \
     src/sync.cpp \
     src/txmempool.cpp \
@@ -255,6 +272,8 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/miner.cpp \
     src/init.cpp \
     src/net.cpp \
+    src/socketevents.cpp \
+    src/blockencodings.cpp \
     src/checkpoints.cpp \
     src/addrman.cpp \
     src/db.cpp \
@@ -0,0 +1,149 @@
+// Copyright (c) 2017 The Rpicoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "hash.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <limits>
+
+using namespace std;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block)
+{
+    header = block;
+    header.vtx.clear();
+    header.vMerkleTree.clear();
+    nNonce = GetRand(numeric_limits<uint64_t>::max());
+    FillShortIDKeys();
+
+    // Nobody has the coinbase and the coinstake before the block
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefilled)
+            vPrefilledTxn.push_back(CPrefilledTransaction(i, block.vtx[i]));
+        else
+            vShortTxIDs.push_back(CShortTxID(GetShortID(block.vtx[i].GetHash())));
+    }
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortIDKeys()
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << header << nNonce;
+    uint256 hash = ss.GetHash();
+    nShortIDKey0 = hash.GetLow64();
+    nShortIDKey1 = (hash >> 64).GetLow64();
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txid) const
+{
+    return SipHashUint256(nShortIDKey0, nShortIDKey1, txid) & 0xffffffffffffULL;
+}
+
+CBlockTransactions::CBlockTransactions(const CBlock& block, const CBlockTransactionsRequest& req)
+{
+    blockhash = req.blockhash;
+    vtx.reserve(req.vIndexes.size());
+    BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        vtx.push_back(block.vtx[nIndex]);
+}
+
+CPartialBlock::ReadStatus CPartialBlock::Init(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool)
+{
+    // No transaction is smaller than 60 bytes
+    unsigned int nCount = cmpctblock.BlockTxCount();
+    if (cmpctblock.header.IsNull() || nCount == 0 || nCount > MAX_BLOCK_SIZE / 60)
+        return READ_STATUS_INVALID;
+
+    header = cmpctblock.header;
+    vtx.assign(nCount, CTransaction());
+    vHave.assign(nCount, false);
+    nFromPool = 0;
+
+    int nLast = -1;
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxn)
+    {
+        if ((int)prefilled.nIndex <= nLast || prefilled.nIndex >= nCount || prefilled.tx.IsNull())
+            return READ_STATUS_INVALID;
+        vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+        nLast = prefilled.nIndex;
+    }
+
+    // The short ids are for the positions left, in order
+    map<uint64_t, unsigned int> mapShortIDs;
+    unsigned int nIndex = 0;
+    BOOST_FOREACH(const CShortTxID& shortid, cmpctblock.vShortTxIDs)
+    {
+        while (vHave[nIndex])
+            nIndex++;
+        // Two transactions of the block itself collide
+        if (!mapShortIDs.insert(make_pair(shortid.Get(), nIndex)).second)
+            return READ_STATUS_FAILED;
+        nIndex++;
+    }
+
+    LOCK(pool.cs);
+    for (indexed_transaction_set::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it)
+    {
+        map<uint64_t, unsigned int>::iterator mi = mapShortIDs.find(cmpctblock.GetShortID(it->GetHash()));
+        if (mi == mapShortIDs.end())
+            continue;
+        unsigned int n = mi->second;
+        if (!vHave[n])
+        {
+            vtx[n] = it->GetTx();
+            vHave[n] = true;
+            nFromPool++;
+        }
+        else
+        {
+            // Two pool transactions have the short id, ask for the one of
+            // the block
+            vtx[n] = CTransaction();
+            vHave[n] = false;
+            nFromPool--;
+            mapShortIDs.erase(mi);
+        }
+    }
+    return READ_STATUS_OK;
+}
+
+bool CPartialBlock::IsComplete() const
+{
+    return find(vHave.begin(), vHave.end(), false) == vHave.end();
+}
+
+void CPartialBlock::GetMissing(vector<unsigned int>& vIndexes) const
+{
+    vIndexes.clear();
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vIndexes.push_back(i);
+}
+
+CPartialBlock::ReadStatus CPartialBlock::FillBlock(CBlock& block, const vector<CTransaction>& vMissing) const
+{
+    block = header;
+    block.vtx = vtx;
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nMissing >= vMissing.size())
+            return READ_STATUS_INVALID;
+        block.vtx[i] = vMissing[nMissing++];
+    }
+    if (nMissing != vMissing.size())
+        return READ_STATUS_INVALID;
+
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+        return READ_STATUS_FAILED;
+    return READ_STATUS_OK;
+}
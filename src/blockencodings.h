@@ -0,0 +1,208 @@
+// Copyright (c) 2017 The Rpicoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "main.h"
+
+#include <vector>
+
+class CTxMemPool;
+
+// Blocks of a compact block request answered with the compact block, older
+// ones are sent whole
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+// and the depth up to which the missing transactions are sent
+static const int MAX_BLOCKTXN_DEPTH = 10;
+// Peers that get new blocks pushed to them as compact blocks
+static const unsigned int MAX_HIGH_BANDWIDTH_PEERS = 3;
+// Seconds to wait for the missing transactions of a compact block
+static const int COMPACT_BLOCK_TIMEOUT = 10;
+// Compact blocks waiting for their missing transactions at most
+static const unsigned int MAX_PARTIAL_BLOCKS = 16;
+// of them from one peer
+static const unsigned int MAX_PARTIAL_BLOCKS_PER_PEER = 2;
+
+/** The low 48 bits of the SipHash of a txid, as sent in compact blocks */
+class CShortTxID
+{
+public:
+    unsigned int nLow;
+    unsigned short nHigh;
+
+    CShortTxID()
+    {
+        nLow = 0;
+        nHigh = 0;
+    }
+
+    CShortTxID(uint64_t nShortID)
+    {
+        nLow = nShortID & 0xffffffff;
+        nHigh = (nShortID >> 32) & 0xffff;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nLow);
+        READWRITE(nHigh);
+    )
+
+    uint64_t Get() const
+    {
+        return ((uint64_t)nHigh << 32) | nLow;
+    }
+};
+
+/** A transaction sent whole in a compact block, with its position in the block */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex;
+    CTransaction tx;
+
+    CPrefilledTransaction()
+    {
+        nIndex = 0;
+    }
+
+    CPrefilledTransaction(unsigned int nIndexIn, const CTransaction& txIn) : nIndex(nIndexIn), tx(txIn)
+    {
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(nIndex));
+        READWRITE(tx);
+    )
+};
+
+/**
+ * A block as the header, the block signature and short ids of its
+ * transactions, for a peer that has most of them in its memory pool already.
+ *
+ * The short ids are salted with a key taken from the header and a random
+ * nonce, so nobody can make up transactions that collide with the ones of a
+ * block ahead of time. The coinbase and the coinstake are always sent whole:
+ * nobody has them before the block.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+public:
+    CBlock header;          // no transactions, with the block signature
+    uint64_t nNonce;
+    std::vector<CShortTxID> vShortTxIDs;
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    CBlockHeaderAndShortTxIDs()
+    {
+        nNonce = 0;
+        nShortIDKey0 = nShortIDKey1 = 0;
+    }
+
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nNonce);
+        READWRITE(vShortTxIDs);
+        READWRITE(vPrefilledTxn);
+        if (fRead)
+            const_cast<CBlockHeaderAndShortTxIDs*>(this)->FillShortIDKeys();
+    )
+
+    uint64_t GetShortID(const uint256& txid) const;
+    unsigned int BlockTxCount() const { return vShortTxIDs.size() + vPrefilledTxn.size(); }
+
+private:
+    uint64_t nShortIDKey0, nShortIDKey1;
+
+    void FillShortIDKeys();
+};
+
+/** The positions of the transactions of a compact block its receiver could
+    not find */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        // Varints, most indexes fit in a byte or two
+        unsigned int nSize = vIndexes.size();
+        READWRITE(VARINT(nSize));
+        if (fRead)
+        {
+            if (nSize > MAX_BLOCK_SIZE / 60)
+                throw std::ios_base::failure("CBlockTransactionsRequest : size too large");
+            const_cast<CBlockTransactionsRequest*>(this)->vIndexes.resize(nSize);
+        }
+        for (unsigned int i = 0; i < vIndexes.size(); i++)
+            READWRITE(VARINT(vIndexes[i]));
+    )
+};
+
+/** The transactions asked for with a CBlockTransactionsRequest, in order */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    CBlockTransactions()
+    {
+    }
+
+    CBlockTransactions(const CBlock& block, const CBlockTransactionsRequest& req);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
+/**
+ * A compact block being put back together from the memory pool.
+ *
+ * Init() places the prefilled transactions and whatever the pool has,
+ * GetMissing() tells what to ask the sender for, and FillBlock() makes the
+ * block out of them. A short id matching more than one transaction of the
+ * pool counts as missing. FillBlock() checks the merkle root: a mismatch means
+ * a pool transaction had the short id of another one, and the block has to be
+ * downloaded whole.
+ */
+class CPartialBlock
+{
+public:
+    enum ReadStatus
+    {
+        READ_STATUS_OK,
+        READ_STATUS_INVALID,    // the peer sent something no good
+        READ_STATUS_FAILED,     // short ids collided, get the whole block
+    };
+
+    CPartialBlock()
+    {
+        nFromPool = 0;
+    }
+
+    ReadStatus Init(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool);
+    bool IsComplete() const;
+    void GetMissing(std::vector<unsigned int>& vIndexes) const;
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vMissing) const;
+
+    unsigned int nFromPool;  // transactions found in the pool
+
+private:
+    CBlock header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
@@ -0,0 +1,210 @@
+// Copyright (c) 2017 The Rpicoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+
+#include "util.h"
+
+#include <limits>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+CBlockFileManager blockfiles;
+
+boost::filesystem::path GetBlockFilePath(unsigned int nFile)
+{
+    string strBlockFn = strprintf("rpi%04u.dat", nFile);
+    return GetDataDir() / strBlockFn;
+}
+
+struct CBlockFileManager::CMappedFile
+{
+    const char* pdata;
+    size_t nSize;
+
+    CMappedFile() : pdata(NULL), nSize(0) {}
+
+    ~CMappedFile()
+    {
+#ifndef WIN32
+        if (pdata)
+            munmap((void*)pdata, nSize);
+#endif
+    }
+
+    // fTooBig is set when the file is there but cannot be mapped
+    bool Open(const boost::filesystem::path& path, size_t nMaxSize, bool& fTooBig)
+    {
+        fTooBig = false;
+#ifndef WIN32
+        int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0)
+        {
+            close(fd);
+            return false;
+        }
+        if ((uint64_t)st.st_size > nMaxSize)
+        {
+            close(fd);
+            fTooBig = true;
+            return false;
+        }
+        void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        // The mapping stays valid after the descriptor is closed
+        close(fd);
+        if (p == MAP_FAILED)
+        {
+            LogPrintf("CBlockFileManager : mmap of %s failed, reading it with stdio\n", path.string());
+            fTooBig = true;
+            return false;
+        }
+        pdata = (const char*)p;
+        nSize = (size_t)st.st_size;
+        return true;
+#else
+        return false;
+#endif
+    }
+};
+
+static size_t DefaultMaxMaps()
+{
+    // Address space is scarce on 32-bit boards, block files are up to 2GB each
+    return sizeof(void*) == 4 ? 2 : 8;
+}
+
+static size_t DefaultMaxMapSize()
+{
+    // Only the smaller block files are mapped on 32-bit boards
+    return sizeof(void*) == 4 ? 256 * 1024 * 1024 : std::numeric_limits<size_t>::max();
+}
+
+CBlockFileManager::CBlockFileManager(size_t nMaxMapsIn, const boost::filesystem::path& pathDirIn, size_t nMaxMapSizeIn) :
+    nMaxMaps(nMaxMapsIn ? nMaxMapsIn : DefaultMaxMaps()),
+    nMaxMapSize(nMaxMapSizeIn ? nMaxMapSizeIn : DefaultMaxMapSize()),
+    pathDir(pathDirIn)
+{
+}
+
+CBlockFileManager::~CBlockFileManager()
+{
+    Clear();
+}
+
+boost::filesystem::path CBlockFileManager::GetPath(unsigned int nFile) const
+{
+    if (pathDir.empty())
+        return GetBlockFilePath(nFile);
+    return pathDir / strprintf("rpi%04u.dat", nFile);
+}
+
+const char* CBlockFileManager::Begin(const MappedFilePtr& file)
+{
+    return file->pdata;
+}
+
+const char* CBlockFileManager::End(const MappedFilePtr& file)
+{
+    return file->pdata + file->nSize;
+}
+
+void CBlockFileManager::Touch(unsigned int nFile)
+{
+    lruFiles.remove(nFile);
+    lruFiles.push_front(nFile);
+}
+
+void CBlockFileManager::Insert(unsigned int nFile, const MappedFilePtr& file)
+{
+    mapFiles[nFile] = file;
+    Touch(nFile);
+    while (lruFiles.size() > nMaxMaps)
+    {
+        // Readers still holding the old mapping keep it alive until they finish
+        mapFiles.erase(lruFiles.back());
+        lruFiles.pop_back();
+    }
+}
+
+CBlockFileManager::MappedFilePtr CBlockFileManager::Get(unsigned int nFile, unsigned int nPos)
+{
+    if ((nFile < 1) || (nFile == (unsigned int) -1))
+        return MappedFilePtr();
+
+    LOCK(cs);
+    if (setUnmapped.count(nFile))
+        return MappedFilePtr();
+    map<unsigned int, MappedFilePtr>::iterator mi = mapFiles.find(nFile);
+    if (mi != mapFiles.end() && nPos < mi->second->nSize)
+    {
+        Touch(nFile);
+        return mi->second;
+    }
+
+    // Not mapped yet, or the file was appended to since it was mapped
+    MappedFilePtr file(new CMappedFile());
+    bool fTooBig;
+    if (!file->Open(GetPath(nFile), nMaxMapSize, fTooBig))
+    {
+        if (fTooBig)
+            Unmap(nFile);
+        return MappedFilePtr();
+    }
+    if (nPos >= file->nSize)
+        return MappedFilePtr();
+    Insert(nFile, file);
+    return file;
+}
+
+bool CBlockFileManager::Remap(unsigned int nFile, const MappedFilePtr& fileStale)
+{
+    LOCK(cs);
+    map<unsigned int, MappedFilePtr>::iterator mi = mapFiles.find(nFile);
+    if (mi != mapFiles.end() && mi->second != fileStale && mi->second->nSize > fileStale->nSize)
+        return true; // another thread already remapped it
+
+    MappedFilePtr file(new CMappedFile());
+    bool fTooBig;
+    if (!file->Open(GetPath(nFile), nMaxMapSize, fTooBig))
+    {
+        if (fTooBig)
+            Unmap(nFile);
+        return false;
+    }
+    if (file->nSize <= fileStale->nSize)
+        return false;
+    Insert(nFile, file);
+    return true;
+}
+
+void CBlockFileManager::Unmap(unsigned int nFile)
+{
+    mapFiles.erase(nFile);
+    lruFiles.remove(nFile);
+    setUnmapped.insert(nFile);
+}
+
+void CBlockFileManager::Clear()
+{
+    LOCK(cs);
+    mapFiles.clear();
+    lruFiles.clear();
+    setUnmapped.clear();
+}
+
+size_t CBlockFileManager::MappedFiles() const
+{
+    LOCK(cs);
+    return mapFiles.size();
+}
@@ -0,0 +1,167 @@
+// Copyright (c) 2017 The Rpicoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKFILE_H
+#define BITCOIN_BLOCKFILE_H
+
+#include "serialize.h"
+#include "sync.h"
+#include "util.h"
+#include "version.h"
+
+#include <list>
+#include <map>
+#include <set>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+
+/** Path of the rpiNNNN.dat block file with the given number */
+boost::filesystem::path GetBlockFilePath(unsigned int nFile);
+
+/** Bounds-checked, read-only stream over a range of memory */
+class CSpanReader
+{
+private:
+    const char* pbegin;
+    const char* pcur;
+    const char* pend;
+
+public:
+    int nType;
+    int nVersion;
+
+    CSpanReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pbegin(pbeginIn), pcur(pbeginIn), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    int GetType()                { return nType; }
+    int GetVersion()             { return nVersion; }
+    size_t size() const          { return pend - pcur; }
+    size_t GetPos() const        { return pcur - pbegin; }
+
+    CSpanReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pcur))
+            throw std::ios_base::failure("CSpanReader::read : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CSpanReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+/**
+ * Keeps read-only memory maps of the block files so that transactions and
+ * blocks are deserialized straight from the mapped bytes, instead of paying
+ * an fopen/fseek/fclose for every CTransaction::ReadFromDisk.
+ *
+ * At most nMaxMaps files are mapped at a time; the least recently used one is
+ * unmapped first.  Block files only ever grow, so a read running past the end
+ * of a mapping remaps the file once and retries.  Mappings are reference
+ * counted, so a reader on another thread keeps its view alive while the LRU
+ * drops it.  Files that cannot be mapped, because mmap failed or because they
+ * are larger than a 32-bit address space can spare, are read with
+ * fopen/fseek instead, as they are on platforms without mmap.
+ */
+class CBlockFileManager
+{
+private:
+    struct CMappedFile;
+    typedef boost::shared_ptr<CMappedFile> MappedFilePtr;
+
+    mutable CCriticalSection cs;
+    std::map<unsigned int, MappedFilePtr> mapFiles;
+    std::list<unsigned int> lruFiles; // most recently used at the front
+    std::set<unsigned int> setUnmapped; // files read with stdio
+    size_t nMaxMaps;
+    size_t nMaxMapSize; // bigger files are read with stdio
+    boost::filesystem::path pathDir;
+
+    boost::filesystem::path GetPath(unsigned int nFile) const;
+    void Touch(unsigned int nFile);
+    void Insert(unsigned int nFile, const MappedFilePtr& file);
+    /** Read nFile with stdio from now on */
+    void Unmap(unsigned int nFile);
+
+    /** Return a mapping of nFile that covers offset nPos, (re)mapping as
+        needed; none if the file is to be read with stdio */
+    MappedFilePtr Get(unsigned int nFile, unsigned int nPos);
+    /** Replace a stale mapping if the file grew since; false if it did not */
+    bool Remap(unsigned int nFile, const MappedFilePtr& fileStale);
+
+    /** Deserialize obj from block file nFile at offset nPos with fopen/fseek */
+    template<typename T>
+    bool ReadWithStdio(unsigned int nFile, unsigned int nPos, T& obj, int nType, int nVersion)
+    {
+        if ((nFile < 1) || (nFile == (unsigned int) -1))
+            return error("CBlockFileManager::Read() : no file %u", nFile);
+        CAutoFile filein = CAutoFile(fopen(GetPath(nFile).string().c_str(), "rb"), nType, nVersion);
+        if (!filein)
+            return error("CBlockFileManager::Read() : open failed for file %u", nFile);
+        if (fseek(filein, nPos, SEEK_SET) != 0)
+            return error("CBlockFileManager::Read() : fseek failed for file %u", nFile);
+        try {
+            filein >> obj;
+        }
+        catch (std::exception &e) {
+            return error("CBlockFileManager::Read() : deserialize error in file %u at %u: %s", nFile, nPos, e.what());
+        }
+        return true;
+    }
+
+public:
+    /** pathDirIn overrides the data directory (used by the unit tests) */
+    CBlockFileManager(size_t nMaxMapsIn = 0, const boost::filesystem::path& pathDirIn = boost::filesystem::path(), size_t nMaxMapSizeIn = 0);
+    ~CBlockFileManager();
+
+    /** Deserialize obj from block file nFile at offset nPos */
+    template<typename T>
+    bool Read(unsigned int nFile, unsigned int nPos, T& obj, int nType = SER_DISK, int nVersion = CLIENT_VERSION)
+    {
+#ifdef WIN32
+        return ReadWithStdio(nFile, nPos, obj, nType, nVersion);
+#else
+        for (int nTry = 0; nTry < 2; nTry++)
+        {
+            MappedFilePtr file = Get(nFile, nPos);
+            if (!file)
+                return ReadWithStdio(nFile, nPos, obj, nType, nVersion);
+            try {
+                CSpanReader reader(Begin(file) + nPos, End(file), nType, nVersion);
+                reader >> obj;
+                return true;
+            }
+            catch (std::ios_base::failure &e) {
+                // The object may straddle the end of a stale mapping, remap
+                // once, or the file grew too big to map again
+                if (nTry == 0 && Remap(nFile, file))
+                    continue;
+                return ReadWithStdio(nFile, nPos, obj, nType, nVersion);
+            }
+            catch (std::exception &e) {
+                return error("CBlockFileManager::Read() : deserialize error in file %u at %u: %s", nFile, nPos, e.what());
+            }
+        }
+        return false;
+#endif
+    }
+
+    /** Unmap everything */
+    void Clear();
+
+    size_t MappedFiles() const;
+
+private:
+    static const char* Begin(const MappedFilePtr& file);
+    static const char* End(const MappedFilePtr& file);
+};
+
+extern CBlockFileManager blockfiles;
+
+#endif
@@ -0,0 +1,98 @@
+// Copyright (c) 2017 The Rpicoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockmap.h"
+
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+
+using namespace std;
+
+static const size_t MIN_SLOTS = 16;
+
+size_t CBlockMap::FindSlot(const uint256& hash) const
+{
+    // The table is never more than half full, so an empty slot ends every probe
+    size_t nMask = vSlots.size() - 1;
+    for (size_t i = (size_t)hash.GetCheapHash() & nMask; ; i = (i + 1) & nMask)
+    {
+        const value_type* pnode = vSlots[i];
+        if (pnode == NULL || pnode->first == hash)
+            return i;
+    }
+}
+
+void CBlockMap::Rehash(size_t nSlots)
+{
+    vector<value_type*> vOld(nSlots, (value_type*)NULL);
+    vSlots.swap(vOld);
+
+    size_t nMask = nSlots - 1;
+    for (size_t j = 0; j < vOld.size(); j++)
+    {
+        if (vOld[j] == NULL)
+            continue;
+        size_t i = (size_t)vOld[j]->first.GetCheapHash() & nMask;
+        while (vSlots[i] != NULL)
+            i = (i + 1) & nMask;
+        vSlots[i] = vOld[j];
+    }
+}
+
+CBlockMap::iterator CBlockMap::find(const uint256& hash)
+{
+    if (vSlots.empty())
+        return end();
+    size_t i = FindSlot(hash);
+    if (vSlots[i] == NULL)
+        return end();
+    return iterator(&vSlots[i], SlotsEnd());
+}
+
+CBlockMap::const_iterator CBlockMap::find(const uint256& hash) const
+{
+    if (vSlots.empty())
+        return end();
+    size_t i = FindSlot(hash);
+    if (vSlots[i] == NULL)
+        return end();
+    return const_iterator(&vSlots[i], SlotsEnd());
+}
+
+CBlockIndex* const& CBlockMap::at(const uint256& hash) const
+{
+    const_iterator it = find(hash);
+    if (it == end())
+        throw out_of_range("CBlockMap::at() : block not found");
+    return it->second;
+}
+
+pair<CBlockMap::iterator, bool> CBlockMap::insert(const value_type& value)
+{
+    if ((nSize + 1) * 2 > vSlots.size())
+        Rehash(max(MIN_SLOTS, vSlots.size() * 2));
+
+    size_t i = FindSlot(value.first);
+    if (vSlots[i] != NULL)
+        return make_pair(iterator(&vSlots[i], SlotsEnd()), false);
+
+    vSlots[i] = new (arena.Allocate()) value_type(value);
+    nSize++;
+    return make_pair(iterator(&vSlots[i], SlotsEnd()), true);
+}
+
+void CBlockMap::reserve(size_t nCount)
+{
+    size_t nSlots = MIN_SLOTS;
+    while (nSlots < nCount * 2)
+        nSlots *= 2;
+    if (nSlots > vSlots.size())
+        Rehash(nSlots);
+}
+
+size_t CBlockMap::DynamicMemoryUsage() const
+{
+    return vSlots.capacity() * sizeof(value_type*) + arena.DynamicMemoryUsage();
+}
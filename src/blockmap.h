@@ -0,0 +1,169 @@
+// Copyright (c) 2017 The Rpicoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKMAP_H
+#define BITCOIN_BLOCKMAP_H
+
+#include "uint256.h"
+
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include <stddef.h>
+
+class CBlockIndex;
+
+/**
+ * Hands out objects from large contiguous chunks instead of one heap
+ * allocation each. Objects are never freed one by one; the chunks are
+ * released without running destructors when the arena goes away, so T must
+ * be trivially destructible.
+ */
+template<typename T>
+class CArena
+{
+private:
+    std::vector<char*> vChunks;
+    size_t nChunkObjects;
+    size_t nUsed; // objects handed out from the last chunk
+
+    CArena(const CArena&);
+    CArena& operator=(const CArena&);
+
+public:
+    explicit CArena(size_t nChunkObjectsIn = 4096) : nChunkObjects(nChunkObjectsIn), nUsed(nChunkObjectsIn) {}
+
+    ~CArena()
+    {
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ::operator delete(vChunks[i]);
+    }
+
+    /** Uninitialized storage for one T, to be constructed with placement new */
+    void* Allocate()
+    {
+        if (nUsed == nChunkObjects)
+        {
+            vChunks.push_back(static_cast<char*>(::operator new(sizeof(T) * nChunkObjects)));
+            nUsed = 0;
+        }
+        return vChunks.back() + sizeof(T) * nUsed++;
+    }
+
+    /** Heap bytes held by the arena */
+    size_t DynamicMemoryUsage() const
+    {
+        return vChunks.size() * nChunkObjects * sizeof(T);
+    }
+};
+
+/**
+ * Block hash to block index map, the type of mapBlockIndex.
+ *
+ * An open addressing table with linear probing over a power-of-two array of
+ * node pointers, kept at most half full. Block hashes are already uniformly
+ * distributed, so their low 64 bits are used as the hash directly. The
+ * (hash, CBlockIndex*) nodes are allocated from an arena and never move, so
+ * pointers to a key such as CBlockIndex::phashBlock stay valid while the
+ * table grows. The block index only ever grows, so there is no erase.
+ * Iteration order is unspecified.
+ */
+class CBlockMap
+{
+public:
+    typedef uint256 key_type;
+    typedef CBlockIndex* mapped_type;
+    typedef std::pair<const uint256, CBlockIndex*> value_type;
+
+    template<typename Value>
+    class iterator_base
+    {
+    private:
+        typedef CBlockMap::value_type* const* slot_pointer;
+        slot_pointer pslot;
+        slot_pointer pend;
+
+        void Skip()
+        {
+            while (pslot != pend && *pslot == NULL)
+                ++pslot;
+        }
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Value value_type;
+        typedef ptrdiff_t difference_type;
+        typedef Value* pointer;
+        typedef Value& reference;
+
+        iterator_base() : pslot(NULL), pend(NULL) {}
+        iterator_base(slot_pointer pslotIn, slot_pointer pendIn) : pslot(pslotIn), pend(pendIn) { Skip(); }
+
+        // iterator converts to const_iterator
+        template<typename Value2>
+        iterator_base(const iterator_base<Value2>& it) : pslot(it.GetSlot()), pend(it.GetEnd()) {}
+
+        slot_pointer GetSlot() const { return pslot; }
+        slot_pointer GetEnd() const { return pend; }
+
+        Value& operator*() const { return **pslot; }
+        Value* operator->() const { return *pslot; }
+
+        iterator_base& operator++() { ++pslot; Skip(); return *this; }
+        iterator_base operator++(int) { iterator_base ret = *this; ++(*this); return ret; }
+
+        template<typename Value2>
+        bool operator==(const iterator_base<Value2>& it) const { return pslot == it.GetSlot(); }
+        template<typename Value2>
+        bool operator!=(const iterator_base<Value2>& it) const { return pslot != it.GetSlot(); }
+    };
+
+    typedef iterator_base<value_type> iterator;
+    typedef iterator_base<const value_type> const_iterator;
+
+private:
+    std::vector<value_type*> vSlots;
+    size_t nSize;
+    CArena<value_type> arena;
+
+    CBlockMap(const CBlockMap&);
+    CBlockMap& operator=(const CBlockMap&);
+
+    /** Slot that holds hash, or the empty slot where it belongs */
+    size_t FindSlot(const uint256& hash) const;
+    /** Resize the table to nSlots (a power of two) and rehash */
+    void Rehash(size_t nSlots);
+
+    value_type* const* SlotsBegin() const { return vSlots.empty() ? NULL : &vSlots[0]; }
+    value_type* const* SlotsEnd() const { return vSlots.empty() ? NULL : &vSlots[0] + vSlots.size(); }
+
+public:
+    CBlockMap() : nSize(0) {}
+
+    iterator begin() { return iterator(SlotsBegin(), SlotsEnd()); }
+    iterator end() { return iterator(SlotsEnd(), SlotsEnd()); }
+    const_iterator begin() const { return const_iterator(SlotsBegin(), SlotsEnd()); }
+    const_iterator end() const { return const_iterator(SlotsEnd(), SlotsEnd()); }
+
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const uint256& hash);
+    const_iterator find(const uint256& hash) const;
+    size_t count(const uint256& hash) const { return find(hash) != end() ? 1 : 0; }
+
+    /** Throws std::out_of_range if hash is not in the map */
+    CBlockIndex* const& at(const uint256& hash) const;
+    CBlockIndex*& operator[](const uint256& hash) { return insert(value_type(hash, NULL)).first->second; }
+
+    std::pair<iterator, bool> insert(const value_type& value);
+
+    /** Make room for nCount entries without further rehashing */
+    void reserve(size_t nCount);
+
+    /** Heap bytes held by the table and its nodes */
+    size_t DynamicMemoryUsage() const;
+};
+
+#endif
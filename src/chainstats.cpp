@@ -0,0 +1,197 @@
+// Copyright (c) 2017 The Rpicoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainstats.h"
+
+#include "chainparams.h"
+#include "kernel.h"
+#include "main.h"
+
+using namespace std;
+
+CChainStats chainstats;
+
+// Work records kept for disconnects, deeper reorganisations rebuild
+static const unsigned int MAX_WORK_RECORDS = 1000;
+
+static const int64_t nTargetSpacingWorkMin = 30;
+
+double GetDifficultyFromBits(unsigned int nBits)
+{
+    // Floating point number that is a multiple of the minimum difficulty,
+    // minimum difficulty = 1.0.
+    int nShift = (nBits >> 24) & 0xff;
+
+    double dDiff =
+        (double)0x0000ffff / (double)(nBits & 0x00ffffff);
+
+    while (nShift < 29)
+    {
+        dDiff *= 256.0;
+        nShift++;
+    }
+    while (nShift > 29)
+    {
+        dDiff /= 256.0;
+        nShift--;
+    }
+
+    return dDiff;
+}
+
+CChainStats::CChainStats()
+{
+    pindexStakesTip = NULL;
+    dKernelsTried = 0;
+    nMoneySupplyDelta = 0;
+    nMoneySupplyBlocks = 0;
+}
+
+void CChainStats::UpdateWork(const CBlockIndex* pindexTip)
+{
+    // Disconnect
+    while (!vWork.empty() && !chainActive.Contains(vWork.back().pindex))
+        vWork.pop_back();
+
+    // Connect, starting over from the genesis block if nothing is left
+    CWorkRecord rec;
+    const CBlockIndex* pindex;
+    if (vWork.empty())
+    {
+        pindex = chainActive.Genesis();
+        rec.nTargetSpacingWork = nTargetSpacingWorkMin;
+        rec.nPrevWorkTime = pindex->GetBlockTime();
+        rec.nBitsWork = pindex->nBits;
+    }
+    else
+    {
+        rec = vWork.back();
+        pindex = chainActive.Next(rec.pindex);
+    }
+
+    for (; pindex; pindex = chainActive.Next(pindex))
+    {
+        if (pindex->IsProofOfWork())
+        {
+            int64_t nActualSpacingWork = pindex->GetBlockTime() - rec.nPrevWorkTime;
+            rec.nTargetSpacingWork = ((nPoWInterval - 1) * rec.nTargetSpacingWork + nActualSpacingWork + nActualSpacingWork) / (nPoWInterval + 1);
+            rec.nTargetSpacingWork = max(rec.nTargetSpacingWork, nTargetSpacingWorkMin);
+            rec.nPrevWorkTime = pindex->GetBlockTime();
+            rec.nBitsWork = pindex->nBits;
+        }
+        rec.pindex = pindex;
+        vWork.push_back(rec);
+        if (vWork.size() > MAX_WORK_RECORDS)
+            vWork.pop_front();
+        if (pindex == pindexTip)
+            break;
+    }
+}
+
+CChainStats::CStakeRecord CChainStats::MakeStakeRecord(const CBlockIndex* pindex)
+{
+    CStakeRecord rec;
+    rec.pindex = pindex;
+    rec.dKernelsTried = GetDifficultyFromBits(pindex->nBits) * 4294967296.0;
+    return rec;
+}
+
+void CChainStats::UpdateStakes(const CBlockIndex* pindexTip)
+{
+    // Disconnect
+    bool fShrunk = false;
+    while (!vStakes.empty() && !chainActive.Contains(vStakes.back().pindex))
+    {
+        vStakes.pop_back();
+        fShrunk = true;
+    }
+
+    // Connect whatever follows the last block scanned, or its fork point
+    if (pindexStakesTip)
+    {
+        const CBlockIndex* pindexFork = chainActive.FindFork(pindexStakesTip);
+        for (const CBlockIndex* pindex = pindexFork ? chainActive.Next(pindexFork) : NULL; pindex; pindex = chainActive.Next(pindex))
+        {
+            if (pindex->IsProofOfStake())
+                vStakes.push_back(MakeStakeRecord(pindex));
+            if (pindex == pindexTip)
+                break;
+        }
+        while (vStakes.size() > (size_t)nPoSInterval + 1)
+            vStakes.pop_front();
+    }
+
+    // Fill the window from older blocks on startup or after a disconnect
+    if (!pindexStakesTip || (fShrunk && vStakes.size() < (size_t)nPoSInterval + 1))
+    {
+        const CBlockIndex* pindex = vStakes.empty() ? pindexTip : vStakes.front().pindex->pprev;
+        for (; pindex && vStakes.size() < (size_t)nPoSInterval + 1; pindex = pindex->pprev)
+            if (pindex->IsProofOfStake())
+                vStakes.push_front(MakeStakeRecord(pindex));
+    }
+    pindexStakesTip = pindexTip;
+
+    // The oldest stake only marks the start of the first interval
+    dKernelsTried = 0;
+    for (unsigned int i = 1; i < vStakes.size(); i++)
+        dKernelsTried += vStakes[i].dKernelsTried;
+}
+
+void CChainStats::SetTip(const CBlockIndex* pindexTip)
+{
+    AssertLockHeld(cs_main);
+    LOCK(cs);
+
+    if (!pindexTip || !chainActive.Genesis())
+    {
+        vWork.clear();
+        vStakes.clear();
+        pindexStakesTip = NULL;
+        dKernelsTried = 0;
+        nMoneySupplyDelta = 0;
+        nMoneySupplyBlocks = 0;
+        return;
+    }
+
+    UpdateWork(pindexTip);
+    UpdateStakes(pindexTip);
+
+    const CBlockIndex* pindexStart = chainActive[max(0, pindexTip->nHeight - nPoSInterval)];
+    nMoneySupplyDelta = pindexTip->nMoneySupply - pindexStart->nMoneySupply;
+    nMoneySupplyBlocks = pindexTip->nHeight - pindexStart->nHeight;
+}
+
+double CChainStats::GetPoWMHashPS() const
+{
+    LOCK(cs);
+    if (vWork.empty() || vWork.back().pindex->nHeight >= Params().LastPOWBlock())
+        return 0;
+
+    const CWorkRecord& rec = vWork.back();
+    return GetDifficultyFromBits(rec.nBitsWork) * 4294.967296 / rec.nTargetSpacingWork;
+}
+
+double CChainStats::GetPoSKernelPS() const
+{
+    LOCK(cs);
+    double result = 0;
+
+    if (vStakes.size() > 1)
+    {
+        int64_t nStakesTime = vStakes.back().pindex->nTime - vStakes.front().pindex->nTime;
+        if (nStakesTime)
+            result = dKernelsTried / nStakesTime;
+    }
+    result *= STAKE_TIMESTAMP_MASK + 1;
+
+    return result;
+}
+
+int64_t CChainStats::GetMoneySupplyPerBlock() const
+{
+    LOCK(cs);
+    if (nMoneySupplyBlocks == 0)
+        return 0;
+    return nMoneySupplyDelta / nMoneySupplyBlocks;
+}
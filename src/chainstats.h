@@ -0,0 +1,80 @@
+// Copyright (c) 2017 The Rpicoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_CHAINSTATS_H
+#define BITCOIN_CHAINSTATS_H
+
+#include "sync.h"
+
+#include <deque>
+
+#include <stdint.h>
+
+class CBlockIndex;
+
+/** Difficulty, as a multiple of the minimum, encoded by a compact target */
+double GetDifficultyFromBits(unsigned int nBits);
+
+/**
+ * Rolling network statistics of the best chain, so that getmininginfo and
+ * getstakinginfo do not walk the block index on every call.
+ *
+ * SetTip() is called wherever chainActive moves. Records of blocks that are
+ * no longer on the best chain are popped (disconnect) and the new blocks are
+ * folded in one at a time (connect). A reorganisation deeper than the kept
+ * history, or the first call after startup, rebuilds from the chain.
+ */
+class CChainStats
+{
+private:
+    /** Proof-of-work spacing average after a block */
+    struct CWorkRecord
+    {
+        const CBlockIndex* pindex;
+        int64_t nTargetSpacingWork;
+        int64_t nPrevWorkTime;
+        unsigned int nBitsWork;         // target of the last proof-of-work block
+    };
+
+    /** A proof-of-stake block of the averaging window */
+    struct CStakeRecord
+    {
+        const CBlockIndex* pindex;
+        double dKernelsTried;
+    };
+
+    mutable CCriticalSection cs;
+    std::deque<CWorkRecord> vWork;      // one per block, newest last
+    std::deque<CStakeRecord> vStakes;   // last nPoSInterval+1 stake blocks, newest last
+    const CBlockIndex* pindexStakesTip; // last block scanned for vStakes
+    double dKernelsTried;               // sum over all but the oldest entry of vStakes
+    int64_t nMoneySupplyDelta;
+    int nMoneySupplyBlocks;
+
+    static CStakeRecord MakeStakeRecord(const CBlockIndex* pindex);
+    void UpdateWork(const CBlockIndex* pindexTip);
+    void UpdateStakes(const CBlockIndex* pindexTip);
+
+public:
+    /** Blocks averaged over by the network hash and stake weight estimates */
+    static const int nPoWInterval = 72;
+    static const int nPoSInterval = 72;
+
+    CChainStats();
+
+    /** Bring the statistics in line with chainActive, whose tip is pindexTip */
+    void SetTip(const CBlockIndex* pindexTip);
+
+    /** Estimated network proof-of-work hash rate in MH/s */
+    double GetPoWMHashPS() const;
+
+    /** Estimated network stake weight */
+    double GetPoSKernelPS() const;
+
+    /** Average money supply increase per block over the last nPoSInterval blocks */
+    int64_t GetMoneySupplyPerBlock() const;
+};
+
+extern CChainStats chainstats;
+
+#endif
@@ -9,6 +9,7 @@
 #include "chainparams.h"
 #include "script.h"
 #include "txdb.h"
+#include "kernel.h"
 #include "rpcserver.h"
 #include "net.h"
 #include "util.h"
@@ -106,6 +107,8 @@ void Shutdown()
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
 #endif
+        if (!FlushTxDB())
+            LogPrintf("Shutdown : failed to flush the transaction database\n");
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -117,6 +120,7 @@ void Shutdown()
     delete pwalletMain;
     pwalletMain = NULL;
 #endif
+    ECC_Stop();
     LogPrintf("Shutdown : done\n");
 }
 
@@ -166,7 +170,9 @@ std::string HelpMessage()
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: rpicoind.pid)") + "\n";
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
-    strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
+    strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (default: %u)"), DEFAULT_DB_CACHE) + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
+    strUsage += "  -ecbackend=<name>      " + strprintf(_("Elliptic curve implementation for signing and signature checks, openssl or secp256k1 (default: %s)"), DEFAULT_EC_BACKEND) + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
@@ -189,6 +195,10 @@ std::string HelpMessage()
     strUsage += "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+#ifdef __linux__
+    strUsage += "  -epoll                 " + _("Wait for peer sockets with epoll instead of select (default: 1)") + "\n";
+#endif
+    strUsage += "  -msgthreads=<n>        " + strprintf(_("Process peer messages with <n> threads (1-%d, default: %d)"), MAX_MESSAGE_THREADS, DEFAULT_MESSAGE_THREADS) + "\n";
 #ifdef USE_UPNP
 #if USE_UPNP
     strUsage += "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n";
@@ -245,8 +255,12 @@ std::string HelpMessage()
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external rpi000?.dat file") + "\n";
     strUsage += "  -maxorphanblocksmib=<n> " + strprintf(_("Keep at most <n> MiB of unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -sigcachemb=<n>        " + strprintf(_("Limit the signature cache to <n> megabytes (default: %u)"), DEFAULT_MAX_SIG_CACHE_SIZE) + "\n";
 
     strUsage += "  -datacarriersize       " + strprintf(_("Maximum size of data in data carrier transactions we relay and mine (default: %u)"), MAX_OP_RETURN_RELAY) + "\n";
+    strUsage += "  -scripttemplates       " + _("Verify standard scripts without the script interpreter (default: 1)") + "\n";
+    strUsage += "  -stakethreads=<n>      " + strprintf(_("Set the number of threads searching for stake kernels (1 to %d, 0 = auto, default: %d)"), MAX_STAKE_SEARCH_THREADS, DEFAULT_STAKE_SEARCH_THREADS) + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
     strUsage += "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n";
@@ -383,6 +397,16 @@ bool AppInit2(boost::thread_group& threadGroup)
             LogPrintf("AppInit2 : parameter interaction: -externalip set -> setting -discover=0\n");
     }
 
+    if (mapArgs.count("-maxsigcachesize")) {
+        // -maxsigcachesize counted signature cache entries, of 32 bytes now,
+        // 32768 of them to the megabyte
+        int64_t nEntries = GetArg("-maxsigcachesize", 0);
+        int64_t nMegabytes = nEntries > 0 ? (nEntries + 32767) / 32768 : 0;
+        if (SoftSetArg("-sigcachemb", i64tostr(nMegabytes)))
+            LogPrintf("AppInit2 : parameter interaction: -maxsigcachesize=%d -> setting -sigcachemb=%d\n", nEntries, nMegabytes);
+        InitWarning(_("Warning: Deprecated argument -maxsigcachesize, use -sigcachemb to size the signature cache in megabytes"));
+    }
+
     if (GetBoolArg("-salvagewallet", false)) {
         // Rewrite just private keys: rescan to find transactions
         if (SoftSetBoolArg("-rescan", true))
@@ -446,6 +470,21 @@ bool AppInit2(boost::thread_group& threadGroup)
 #endif
 
     nMaxDatacarrierBytes = GetArg("-datacarriersize", nMaxDatacarrierBytes);
+    fScriptTemplates = GetBoolArg("-scripttemplates", true);
+
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    nStakeSearchThreads = GetArg("-stakethreads", DEFAULT_STAKE_SEARCH_THREADS);
+    if (nStakeSearchThreads <= 0)
+        nStakeSearchThreads = boost::thread::hardware_concurrency();
+    nStakeSearchThreads = max(1, min(nStakeSearchThreads, MAX_STAKE_SEARCH_THREADS));
 
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
@@ -453,6 +492,11 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (!InitSanityCheck())
         return InitError(_("Initialization sanity check failed. Rpicoin is shutting down."));
 
+    std::string strECBackend = GetArg("-ecbackend", DEFAULT_EC_BACKEND);
+    if (!ECC_Start(strECBackend))
+        return InitError(strprintf(_("Unsupported -ecbackend=%s"), strECBackend));
+    LogPrintf("Using %s for elliptic curve operations\n", ECC_GetBackend());
+
     std::string strDataDir = GetDataDir().string();
 #ifdef ENABLE_WALLET
     std::string strWalletFileName = GetArg("-wallet", "wallet.dat");
@@ -483,6 +527,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fDaemon)
         fprintf(stdout, "Rpicoin server starting\n");
 
+    if (nScriptCheckThreads) {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify database integrity
@@ -669,7 +719,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (CBlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -5,12 +5,15 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/thread.hpp>
 
 #include "kernel.h"
 #include "txdb.h"
 
 using namespace std;
 
+int nStakeSearchThreads = DEFAULT_STAKE_SEARCH_THREADS;
+
 // Get time weight
 int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd)
 {
@@ -21,17 +24,130 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd)
     return nIntervalEnd - nIntervalBeginning - nStakeMinAge;
 }
 
+// Stake modifier bookkeeping for recent blocks. Entries are keyed by block
+// hash, which commits to everything they are computed from, so they never
+// go stale; blocks leaving the best chain are forgotten on reorganization
+// and old entries are pruned by height.
+static const int STAKE_MODIFIER_CACHE_DEPTH = 1000;
+
+class CStakeModifierCache
+{
+private:
+    struct CEntry
+    {
+        int nHeight;
+        bool fLast;                 // last modifier generated at or before the block
+        uint64_t nLastModifier;
+        int64_t nLastModifierTime;
+        bool fNext;                 // modifier of the block's children
+        uint64_t nNextModifier;
+        bool fNextGenerated;
+
+        CEntry() : nHeight(0), fLast(false), nLastModifier(0), nLastModifierTime(0), fNext(false), nNextModifier(0), fNextGenerated(false) {}
+    };
+
+    CCriticalSection cs;
+    map<uint256, CEntry> mapEntries;
+
+    CEntry& Entry(const CBlockIndex* pindex)
+    {
+        CEntry& entry = mapEntries[pindex->GetBlockHash()];
+        entry.nHeight = pindex->nHeight;
+
+        // Entries well behind the newest block are only needed on deep forks
+        if (mapEntries.size() > 2 * STAKE_MODIFIER_CACHE_DEPTH)
+        {
+            int nMinHeight = pindex->nHeight - STAKE_MODIFIER_CACHE_DEPTH;
+            for (map<uint256, CEntry>::iterator it = mapEntries.begin(); it != mapEntries.end();)
+            {
+                if (it->second.nHeight < nMinHeight && &it->second != &entry)
+                    mapEntries.erase(it++);
+                else
+                    ++it;
+            }
+        }
+        return entry;
+    }
+
+public:
+    bool GetLast(const CBlockIndex* pindex, uint64_t& nStakeModifier, int64_t& nModifierTime)
+    {
+        LOCK(cs);
+        map<uint256, CEntry>::const_iterator it = mapEntries.find(pindex->GetBlockHash());
+        if (it == mapEntries.end() || !it->second.fLast)
+            return false;
+        nStakeModifier = it->second.nLastModifier;
+        nModifierTime = it->second.nLastModifierTime;
+        return true;
+    }
+
+    void SetLast(const CBlockIndex* pindex, uint64_t nStakeModifier, int64_t nModifierTime)
+    {
+        LOCK(cs);
+        CEntry& entry = Entry(pindex);
+        entry.fLast = true;
+        entry.nLastModifier = nStakeModifier;
+        entry.nLastModifierTime = nModifierTime;
+    }
+
+    bool GetNext(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier)
+    {
+        LOCK(cs);
+        map<uint256, CEntry>::const_iterator it = mapEntries.find(pindexPrev->GetBlockHash());
+        if (it == mapEntries.end() || !it->second.fNext)
+            return false;
+        nStakeModifier = it->second.nNextModifier;
+        fGeneratedStakeModifier = it->second.fNextGenerated;
+        return true;
+    }
+
+    void SetNext(const CBlockIndex* pindexPrev, uint64_t nStakeModifier, bool fGeneratedStakeModifier)
+    {
+        LOCK(cs);
+        CEntry& entry = Entry(pindexPrev);
+        entry.fNext = true;
+        entry.nNextModifier = nStakeModifier;
+        entry.fNextGenerated = fGeneratedStakeModifier;
+    }
+
+    void Forget(const CBlockIndex* pindex)
+    {
+        LOCK(cs);
+        mapEntries.erase(pindex->GetBlockHash());
+    }
+
+};
+
+static CStakeModifierCache stakeModifierCache;
+
+void ForgetStakeModifier(const CBlockIndex* pindex)
+{
+    stakeModifierCache.Forget(pindex);
+}
+
 // Get the last stake modifier and its generation time from a given block
 static bool GetLastStakeModifier(const CBlockIndex* pindex, uint64_t& nStakeModifier, int64_t& nModifierTime)
 {
     if (!pindex)
         return error("GetLastStakeModifier: null pindex");
+    const CBlockIndex* pindexFrom = pindex;
     while (pindex && pindex->pprev && !pindex->GeneratedStakeModifier())
+    {
+        // Stop early at a block whose answer is already known
+        if (stakeModifierCache.GetLast(pindex, nStakeModifier, nModifierTime))
+        {
+            if (pindex != pindexFrom)
+                stakeModifierCache.SetLast(pindexFrom, nStakeModifier, nModifierTime);
+            return true;
+        }
         pindex = pindex->pprev;
+    }
     if (!pindex->GeneratedStakeModifier())
         return error("GetLastStakeModifier: no generation at genesis block");
     nStakeModifier = pindex->nStakeModifier;
     nModifierTime = pindex->GetBlockTime();
+    if (pindex != pindexFrom)
+        stakeModifierCache.SetLast(pindexFrom, nStakeModifier, nModifierTime);
     return true;
 }
 
@@ -51,46 +167,53 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
+// A block that may be selected for the next stake modifier. Its selection
+// hash does not change from round to round, so it is computed once.
+struct CModifierCandidate
+{
+    int64_t nTime;
+    uint256 hashBlock;
+    const CBlockIndex* pindex;
+    uint256 hashSelection;
+    bool fSelected;
+
+    bool operator<(const CModifierCandidate& b) const
+    {
+        return nTime < b.nTime || (nTime == b.nTime && hashBlock < b.hashBlock);
+    }
+};
+
 // select a block from the candidate blocks in vSortedByTimestamp, excluding
-// already selected blocks in vSelectedBlocks, and with timestamp up to
-// nSelectionIntervalStop.
-static bool SelectBlockFromCandidates(vector<pair<int64_t, uint256> >& vSortedByTimestamp, map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-    int64_t nSelectionIntervalStop, uint64_t nStakeModifierPrev, const CBlockIndex** pindexSelected)
+// already selected blocks, and with timestamp up to nSelectionIntervalStop.
+static bool SelectBlockFromCandidates(vector<CModifierCandidate>& vSortedByTimestamp, int64_t nSelectionIntervalStop, const CBlockIndex** pindexSelected)
 {
     bool fSelected = false;
     uint256 hashBest = 0;
+    CModifierCandidate* pcandidateBest = NULL;
     *pindexSelected = (const CBlockIndex*) 0;
-    BOOST_FOREACH(const PAIRTYPE(int64_t, uint256)& item, vSortedByTimestamp)
+    BOOST_FOREACH(CModifierCandidate& candidate, vSortedByTimestamp)
     {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
-        if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
+        if (fSelected && candidate.nTime > nSelectionIntervalStop)
             break;
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
+        if (candidate.fSelected)
             continue;
-        // compute the selection hash by hashing its proof-hash and the
-        // previous proof-of-stake modifier
-        CDataStream ss(SER_GETHASH, 0);
-        ss << pindex->hashProof << nStakeModifierPrev;
-        uint256 hashSelection = Hash(ss.begin(), ss.end());
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection >>= 32;
-        if (fSelected && hashSelection < hashBest)
+        if (fSelected && candidate.hashSelection < hashBest)
         {
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
+            hashBest = candidate.hashSelection;
+            pcandidateBest = &candidate;
         }
         else if (!fSelected)
         {
             fSelected = true;
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*) pindex;
+            hashBest = candidate.hashSelection;
+            pcandidateBest = &candidate;
         }
     }
+    if (fSelected)
+    {
+        pcandidateBest->fSelected = true;
+        *pindexSelected = pcandidateBest->pindex;
+    }
     LogPrint("stakemodifier", "SelectBlockFromCandidates: selection hash=%s\n", hashBest.ToString());
     return fSelected;
 }
@@ -117,6 +240,9 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
         fGeneratedStakeModifier = true;
         return true;  // genesis block's modifier is 0
     }
+    // Competing blocks on the same parent get the same modifier
+    if (stakeModifierCache.GetNext(pindexPrev, nStakeModifier, fGeneratedStakeModifier))
+        return true;
     // First find current stake modifier and its generation block time
     // if it's not old enough, return the same stake modifier
     int64_t nModifierTime = 0;
@@ -127,35 +253,46 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
         return true;
 
     // Sort candidate blocks by timestamp
-    vector<pair<int64_t, uint256> > vSortedByTimestamp;
+    vector<CModifierCandidate> vSortedByTimestamp;
     vSortedByTimestamp.reserve(64 * nModifierInterval / GetTargetSpacing());
     int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
     int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
     const CBlockIndex* pindex = pindexPrev;
     while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
     {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        // compute the selection hash by hashing its proof-hash and the
+        // previous proof-of-stake modifier
+        CModifierCandidate candidate;
+        candidate.nTime = pindex->GetBlockTime();
+        candidate.hashBlock = pindex->GetBlockHash();
+        candidate.pindex = pindex;
+        candidate.fSelected = false;
+        CDataStream ss(SER_GETHASH, 0);
+        ss << pindex->hashProof << nStakeModifier;
+        candidate.hashSelection = Hash(ss.begin(), ss.end());
+        // the selection hash is divided by 2**32 so that proof-of-stake block
+        // is always favored over proof-of-work block. this is to preserve
+        // the energy efficiency property
+        if (pindex->IsProofOfStake())
+            candidate.hashSelection >>= 32;
+        vSortedByTimestamp.push_back(candidate);
         pindex = pindex->pprev;
     }
     int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
-    reverse(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
     sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
 
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint64_t nStakeModifierNew = 0;
     int64_t nSelectionIntervalStop = nSelectionIntervalStart;
-    map<uint256, const CBlockIndex*> mapSelectedBlocks;
     for (int nRound=0; nRound<min(64, (int)vSortedByTimestamp.size()); nRound++)
     {
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        if (!SelectBlockFromCandidates(vSortedByTimestamp, nSelectionIntervalStop, &pindex))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint64_t)pindex->GetStakeEntropyBit()) << nRound);
-        // add the selected block from candidates to selected list
-        mapSelectedBlocks.insert(make_pair(pindex->GetBlockHash(), pindex));
         LogPrint("stakemodifier", "ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n", nRound, DateTimeStrFormat(nSelectionIntervalStop), pindex->nHeight, pindex->GetStakeEntropyBit());
     }
 
@@ -173,11 +310,12 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
                 strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
             pindex = pindex->pprev;
         }
-        BOOST_FOREACH(const PAIRTYPE(uint256, const CBlockIndex*)& item, mapSelectedBlocks)
+        BOOST_FOREACH(const CModifierCandidate& candidate, vSortedByTimestamp)
         {
             // 'S' indicates selected proof-of-stake blocks
             // 'W' indicates selected proof-of-work blocks
-            strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, item.second->IsProofOfStake()? "S" : "W");
+            if (candidate.fSelected)
+                strSelectionMap.replace(candidate.pindex->nHeight - nHeightFirstCandidate, 1, candidate.pindex->IsProofOfStake()? "S" : "W");
         }
         LogPrintf("ComputeNextStakeModifier: selection height [%d, %d] map %s\n", nHeightFirstCandidate, pindexPrev->nHeight, strSelectionMap);
     }
@@ -185,6 +323,7 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 
     nStakeModifier = nStakeModifierNew;
     fGeneratedStakeModifier = true;
+    stakeModifierCache.SetNext(pindexPrev, nStakeModifier, fGeneratedStakeModifier);
     return true;
 }
 
@@ -288,6 +427,247 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBl
     return CheckStakeKernelHashV2(pindexPrev, nBits, blockFrom.GetBlockTime(), txPrev, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake); 
 }
 
+CStakeKernelSearch::CStakeKernelSearch(const CBlockIndex* pindexPrev, unsigned int nBitsIn)
+{
+    bnStakeModifierV2 = pindexPrev->bnStakeModifierV2;
+    nBits = nBitsIn;
+}
+
+void CStakeKernelSearch::Add(const COutPoint& prevout, unsigned int nTimeTxPrev, int64_t nValue)
+{
+    CEntry entry;
+
+    // Weighted target, as in CheckStakeKernelHashV2
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    bnTarget *= CBigNum(nValue);
+    entry.fNeverMeets = bnTarget < 0;
+    entry.fAlwaysMeets = bnTarget > CBigNum(~uint256(0));
+    entry.targetProofOfStake = (entry.fNeverMeets || entry.fAlwaysMeets) ? 0 : bnTarget.getuint256();
+    entry.nTimeTxPrev = nTimeTxPrev;
+
+    // Same serialization as the kernel hash, minus the coinstake time
+    SHA256_Init(&entry.ctx);
+    SHA256_Update(&entry.ctx, (const unsigned char*)&bnStakeModifierV2, sizeof(bnStakeModifierV2));
+    SHA256_Update(&entry.ctx, (const unsigned char*)&nTimeTxPrev, sizeof(nTimeTxPrev));
+    SHA256_Update(&entry.ctx, (const unsigned char*)&prevout.hash, sizeof(prevout.hash));
+    SHA256_Update(&entry.ctx, (const unsigned char*)&prevout.n, sizeof(prevout.n));
+
+    vEntries.push_back(entry);
+}
+
+// Best kernel found so far by the threads sharing a search
+class CStakeKernelSearch::CFound
+{
+private:
+    CCriticalSection cs;
+    bool fFound;
+    size_t nIndex;
+    unsigned int nTime;
+    uint256 hashProofOfStake;
+    uint64_t nHashes;
+
+public:
+    CFound() : fFound(false), nIndex(0), nTime(0), hashProofOfStake(0), nHashes(0) {}
+
+    // Whether a kernel of output nIndexTry at nTimeTry would still win
+    bool Wanted(size_t nIndexTry, unsigned int nTimeTry)
+    {
+        LOCK(cs);
+        return !fFound || nTimeTry > nTime || (nTimeTry == nTime && nIndexTry < nIndex);
+    }
+
+    void Offer(size_t nIndexIn, unsigned int nTimeIn, const uint256& hashIn)
+    {
+        LOCK(cs);
+        if (fFound && (nTimeIn < nTime || (nTimeIn == nTime && nIndexIn > nIndex)))
+            return;
+        fFound = true;
+        nIndex = nIndexIn;
+        nTime = nTimeIn;
+        hashProofOfStake = hashIn;
+    }
+
+    void AddHashes(uint64_t n)
+    {
+        LOCK(cs);
+        nHashes += n;
+    }
+
+    bool Get(size_t& nIndexRet, unsigned int& nTimeRet, uint256& hashRet, uint64_t& nHashesRet)
+    {
+        LOCK(cs);
+        nHashesRet = nHashes;
+        if (!fFound)
+            return false;
+        nIndexRet = nIndex;
+        nTimeRet = nTime;
+        hashRet = hashProofOfStake;
+        return true;
+    }
+};
+
+// Outputs tried between looks at what the other threads found
+static const size_t STAKE_SEARCH_PREEMPT_STEP = 64;
+
+void CStakeKernelSearch::SearchPart(int64_t nTimeBegin, int64_t nTimeEnd, size_t nFirst, size_t nLast, CFound* pfound) const
+{
+    uint64_t nHashes = 0;
+    for (int64_t nTime = nTimeEnd & ~(int64_t)STAKE_TIMESTAMP_MASK; nTime >= nTimeBegin; nTime -= STAKE_TIMESTAMP_MASK + 1)
+    {
+        unsigned int nTimeTx = (unsigned int)nTime;
+        for (size_t i = nFirst; i < nLast; i++)
+        {
+            // Give up once nothing left here can beat a kernel found elsewhere
+            if ((i - nFirst) % STAKE_SEARCH_PREEMPT_STEP == 0 && !pfound->Wanted(i, nTimeTx))
+            {
+                pfound->AddHashes(nHashes);
+                return;
+            }
+
+            const CEntry& entry = vEntries[i];
+            if (nTimeTx < entry.nTimeTxPrev || entry.fNeverMeets)
+                continue;
+
+            SHA256_CTX ctx = entry.ctx;
+            uint256 hash1, hash2;
+            SHA256_Update(&ctx, (const unsigned char*)&nTimeTx, sizeof(nTimeTx));
+            SHA256_Final((unsigned char*)&hash1, &ctx);
+            SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+            nHashes++;
+
+            if (entry.fAlwaysMeets || hash2 <= entry.targetProofOfStake)
+            {
+                // Later outputs and earlier timestamps of this part lose
+                pfound->Offer(i, nTimeTx, hash2);
+                pfound->AddHashes(nHashes);
+                return;
+            }
+        }
+    }
+    pfound->AddHashes(nHashes);
+}
+
+bool CStakeKernelSearch::Search(int64_t nTimeBegin, int64_t nTimeEnd, size_t& nIndexRet, unsigned int& nTimeRet, uint256& hashProofOfStake,
+                                int nThreads, uint64_t* pnHashes) const
+{
+    nTimeBegin = max(nTimeBegin, (int64_t)0);
+    nTimeEnd = min(nTimeEnd, (int64_t)numeric_limits<unsigned int>::max());
+
+    // Parts too small to be worth a thread are not split further
+    size_t nParts = min((size_t)max(nThreads, 1), vEntries.size() / STAKE_SEARCH_PREEMPT_STEP);
+    nParts = max(nParts, (size_t)1);
+
+    CFound found;
+    boost::thread_group threadGroup;
+    for (size_t nPart = 1; nPart < nParts; nPart++)
+        threadGroup.create_thread(boost::bind(&CStakeKernelSearch::SearchPart, this, nTimeBegin, nTimeEnd,
+                                              vEntries.size() * nPart / nParts, vEntries.size() * (nPart + 1) / nParts, &found));
+    SearchPart(nTimeBegin, nTimeEnd, 0, vEntries.size() / nParts, &found);
+    threadGroup.join_all();
+
+    uint64_t nHashes;
+    bool fFound = found.Get(nIndexRet, nTimeRet, hashProofOfStake, nHashes);
+    if (pnHashes)
+        *pnHashes = nHashes;
+    return fFound;
+}
+
+CStakeSearchStats stakeSearchStats;
+
+CStakeSearchStats::CStakeSearchStats()
+{
+    nSearches = 0;
+    nHashes = 0;
+    nSearchMicros = 0;
+    nMissedSlots = 0;
+    nLastSlot = 0;
+    nKernels = 0;
+    nFoundMicros = 0;
+    nBroadcasts = 0;
+    nBroadcastMicros = 0;
+    nLastBroadcastMicros = 0;
+}
+
+void CStakeSearchStats::AddSearch(int64_t nTimeBegin, int64_t nTimeEnd, uint64_t nHashesIn, int64_t nMicros, bool fFound)
+{
+    LOCK(cs);
+    int64_t nFirstSlot = (nTimeBegin + STAKE_TIMESTAMP_MASK) & ~(int64_t)STAKE_TIMESTAMP_MASK;
+    int64_t nEndSlot = nTimeEnd & ~(int64_t)STAKE_TIMESTAMP_MASK;
+    if (nLastSlot && nFirstSlot > nLastSlot)
+        nMissedSlots += (nFirstSlot - nLastSlot) / (STAKE_TIMESTAMP_MASK + 1) - 1;
+    nLastSlot = max(nLastSlot, nEndSlot);
+
+    nSearches++;
+    nHashes += nHashesIn;
+    nSearchMicros += nMicros;
+    if (fFound)
+    {
+        nKernels++;
+        nFoundMicros = GetTimeMicros();
+    }
+}
+
+void CStakeSearchStats::AddBroadcast()
+{
+    LOCK(cs);
+    if (!nFoundMicros)
+        return;
+    nLastBroadcastMicros = GetTimeMicros() - nFoundMicros;
+    nBroadcastMicros += nLastBroadcastMicros;
+    nBroadcasts++;
+    nFoundMicros = 0;
+}
+
+void CStakeSearchStats::Pause()
+{
+    LOCK(cs);
+    nLastSlot = 0;
+    nFoundMicros = 0;
+}
+
+uint64_t CStakeSearchStats::GetSearches() const
+{
+    LOCK(cs);
+    return nSearches;
+}
+
+double CStakeSearchStats::GetHashesPerSecond() const
+{
+    LOCK(cs);
+    return nSearchMicros > 0 ? nHashes * 1000000.0 / nSearchMicros : 0;
+}
+
+uint64_t CStakeSearchStats::GetMissedSlots() const
+{
+    LOCK(cs);
+    return nMissedSlots;
+}
+
+uint64_t CStakeSearchStats::GetKernelsFound() const
+{
+    LOCK(cs);
+    return nKernels;
+}
+
+uint64_t CStakeSearchStats::GetBroadcasts() const
+{
+    LOCK(cs);
+    return nBroadcasts;
+}
+
+double CStakeSearchStats::GetBroadcastLatency() const
+{
+    LOCK(cs);
+    return nBroadcasts ? nBroadcastMicros / (1000.0 * nBroadcasts) : 0;
+}
+
+double CStakeSearchStats::GetLastBroadcastLatency() const
+{
+    LOCK(cs);
+    return nLastBroadcastMicros / 1000.0;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake)
 {
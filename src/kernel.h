@@ -6,10 +6,17 @@
 
 #include "main.h"
 
+#include <openssl/sha.h>
+
 // To decrease granularity of timestamp
 // Supposed to be 2^n-1
 static const int STAKE_TIMESTAMP_MASK = 15;
 
+// Threads searching for a kernel, each takes a part of the outputs
+static const int MAX_STAKE_SEARCH_THREADS = 16;
+static const int DEFAULT_STAKE_SEARCH_THREADS = 1;
+extern int nStakeSearchThreads;
+
 // MODIFIER_INTERVAL: time to elapse before new modifier is computed
 extern unsigned int nModifierInterval;
 
@@ -21,6 +28,10 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 uint256 ComputeStakeModifier(const CBlockIndex* pindexPrev, const uint256& kernel);
 
+// Drop what is remembered about the stake modifiers of a block leaving the
+// best chain
+void ForgetStakeModifier(const CBlockIndex* pindex);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
@@ -40,4 +51,88 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+// Searches coinstake timestamps for a kernel among many outputs at once.
+// Only the coinstake time changes between attempts, so each output's kernel
+// hash is computed up to that field when the output is added, and trying a
+// timestamp costs one SHA-256 block and the outer hash, with no disk access.
+class CStakeKernelSearch
+{
+public:
+    CStakeKernelSearch(const CBlockIndex* pindexPrev, unsigned int nBits);
+
+    // nTimeTxPrev is the time of the transaction that created prevout
+    void Add(const COutPoint& prevout, unsigned int nTimeTxPrev, int64_t nValue);
+    size_t size() const { return vEntries.size(); }
+    bool empty() const { return vEntries.empty(); }
+
+    // Tries the timestamps on the STAKE_TIMESTAMP_MASK grid from nTimeEnd
+    // back to nTimeBegin, all outputs at each. The latest timestamp wins,
+    // then the output added first; nIndexRet is its position in Add order.
+    // With nThreads > 1 the outputs are split between that many threads,
+    // which stop as soon as one of them finds a kernel they cannot beat;
+    // the result is the same. pnHashes returns the kernel hashes tried
+    bool Search(int64_t nTimeBegin, int64_t nTimeEnd, size_t& nIndexRet, unsigned int& nTimeRet, uint256& hashProofOfStake,
+                int nThreads = 1, uint64_t* pnHashes = NULL) const;
+
+private:
+    class CFound;
+
+    void SearchPart(int64_t nTimeBegin, int64_t nTimeEnd, size_t nFirst, size_t nLast, CFound* pfound) const;
+
+    struct CEntry
+    {
+        SHA256_CTX ctx;             // kernel hashed up to the coinstake time
+        unsigned int nTimeTxPrev;
+        uint256 targetProofOfStake;
+        bool fAlwaysMeets;          // weighted target beyond 256 bits
+        bool fNeverMeets;           // negative target
+    };
+
+    uint256 bnStakeModifierV2;
+    unsigned int nBits;
+    std::vector<CEntry> vEntries;
+};
+
+// Counters of the stake miner's kernel searches, reported by getstakinginfo
+class CStakeSearchStats
+{
+private:
+    mutable CCriticalSection cs;
+    uint64_t nSearches;
+    uint64_t nHashes;
+    int64_t nSearchMicros;
+    uint64_t nMissedSlots;
+    int64_t nLastSlot;              // latest timestamp tried, 0 while paused
+    uint64_t nKernels;
+    int64_t nFoundMicros;           // when the last kernel was found, 0 once relayed
+    uint64_t nBroadcasts;
+    int64_t nBroadcastMicros;       // sum of the latencies from kernel found to relay
+    int64_t nLastBroadcastMicros;
+
+public:
+    CStakeSearchStats();
+
+    // A search of the timestamps from nTimeBegin to nTimeEnd which took
+    // nMicros. Grid timestamps after the previous search that it does not
+    // reach count as missed
+    void AddSearch(int64_t nTimeBegin, int64_t nTimeEnd, uint64_t nHashesIn, int64_t nMicros, bool fFound);
+
+    // The block of the last kernel found was accepted and relayed
+    void AddBroadcast();
+
+    // Staking stopped, the timestamps until it resumes are not missed
+    void Pause();
+
+    uint64_t GetSearches() const;
+    double GetHashesPerSecond() const;
+    uint64_t GetMissedSlots() const;
+    uint64_t GetKernelsFound() const;
+    uint64_t GetBroadcasts() const;
+    // Average and last latency from kernel found to relay, in milliseconds
+    double GetBroadcastLatency() const;
+    double GetLastBroadcastLatency() const;
+};
+
+extern CStakeSearchStats stakeSearchStats;
+
 #endif // PPCOIN_KERNEL_H
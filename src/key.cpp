@@ -2,11 +2,17 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <algorithm>
+
 #include <openssl/bn.h>
 #include <openssl/ecdsa.h>
 #include <openssl/rand.h>
 #include <openssl/obj_mac.h>
 
+#ifdef USE_SECP256K1
+#include <secp256k1.h>
+#endif
+
 #include "key.h"
 
 
@@ -376,6 +382,153 @@ const unsigned char vchMaxModHalfOrder[32] = {
 
 const unsigned char vchZero[0] = {};
 
+#ifdef USE_SECP256K1
+// Context with the signing and verification tables, set by ECC_Start
+secp256k1_context* secp256k1_context_main = NULL;
+
+// Parse a DER signature as leniently as OpenSSL does: lengths and padding
+// are not checked for strictness, only R and S are extracted. Signatures
+// whose R or S do not fit are replaced by one that never verifies.
+bool ecdsa_signature_parse_der_lax(const secp256k1_context* ctx, secp256k1_ecdsa_signature* sig, const unsigned char *input, size_t inputlen)
+{
+    size_t rpos, rlen, spos, slen;
+    size_t pos = 0;
+    size_t lenbyte;
+    unsigned char tmpsig[64] = {0};
+    bool fOverflow = false;
+
+    // Start from a correctly parsed but invalid signature
+    secp256k1_ecdsa_signature_parse_compact(ctx, sig, tmpsig);
+
+    // Sequence tag and length
+    if (pos == inputlen || input[pos] != 0x30)
+        return false;
+    pos++;
+    if (pos == inputlen)
+        return false;
+    lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (lenbyte > inputlen - pos)
+            return false;
+        pos += lenbyte;
+    }
+
+    // Integer tag and length for R
+    if (pos == inputlen || input[pos] != 0x02)
+        return false;
+    pos++;
+    if (pos == inputlen)
+        return false;
+    lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (lenbyte > inputlen - pos)
+            return false;
+        while (lenbyte > 0 && input[pos] == 0) {
+            pos++;
+            lenbyte--;
+        }
+        if (lenbyte >= sizeof(size_t))
+            return false;
+        rlen = 0;
+        while (lenbyte > 0) {
+            rlen = (rlen << 8) + input[pos];
+            pos++;
+            lenbyte--;
+        }
+    } else {
+        rlen = lenbyte;
+    }
+    if (rlen > inputlen - pos)
+        return false;
+    rpos = pos;
+    pos += rlen;
+
+    // Integer tag and length for S
+    if (pos == inputlen || input[pos] != 0x02)
+        return false;
+    pos++;
+    if (pos == inputlen)
+        return false;
+    lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (lenbyte > inputlen - pos)
+            return false;
+        while (lenbyte > 0 && input[pos] == 0) {
+            pos++;
+            lenbyte--;
+        }
+        if (lenbyte >= sizeof(size_t))
+            return false;
+        slen = 0;
+        while (lenbyte > 0) {
+            slen = (slen << 8) + input[pos];
+            pos++;
+            lenbyte--;
+        }
+    } else {
+        slen = lenbyte;
+    }
+    if (slen > inputlen - pos)
+        return false;
+    spos = pos;
+
+    // Copy R and S without their leading zeroes
+    while (rlen > 0 && input[rpos] == 0) {
+        rlen--;
+        rpos++;
+    }
+    if (rlen > 32)
+        fOverflow = true;
+    else
+        memcpy(tmpsig + 32 - rlen, input + rpos, rlen);
+
+    while (slen > 0 && input[spos] == 0) {
+        slen--;
+        spos++;
+    }
+    if (slen > 32)
+        fOverflow = true;
+    else
+        memcpy(tmpsig + 64 - slen, input + spos, slen);
+
+    if (!fOverflow)
+        fOverflow = !secp256k1_ecdsa_signature_parse_compact(ctx, sig, tmpsig);
+    if (fOverflow) {
+        memset(tmpsig, 0, 64);
+        secp256k1_ecdsa_signature_parse_compact(ctx, sig, tmpsig);
+    }
+    return true;
+}
+
+bool secp256k1_verify_der(const secp256k1_pubkey* pubkey, const uint256 &hash, const std::vector<unsigned char>& vchSig)
+{
+    secp256k1_ecdsa_signature sig;
+    if (vchSig.empty() || !ecdsa_signature_parse_der_lax(secp256k1_context_main, &sig, &vchSig[0], vchSig.size()))
+        return false;
+    // OpenSSL accepts high S values, libsecp256k1 only verifies low ones
+    secp256k1_ecdsa_signature_normalize(secp256k1_context_main, &sig, &sig);
+    return secp256k1_ecdsa_verify(secp256k1_context_main, &sig, (const unsigned char*)&hash, pubkey);
+}
+#endif
+
+// Orders batch entries by public key, keeping their order within a key
+struct CompareBatchPubKey
+{
+    const CSignatureBatch& batch;
+    CompareBatchPubKey(const CSignatureBatch& batchIn) : batch(batchIn) {}
+    bool operator()(size_t a, size_t b) const
+    {
+        if (batch[a].pubkey < batch[b].pubkey)
+            return true;
+        if (batch[b].pubkey < batch[a].pubkey)
+            return false;
+        return a < b;
+    }
+};
+
 }; // end of anonymous namespace
 
 bool CKey::Check(const unsigned char *vch) {
@@ -473,6 +626,19 @@ CPrivKey CKey::GetPrivKey() const {
 
 CPubKey CKey::GetPubKey() const {
     assert(fValid);
+#ifdef USE_SECP256K1
+    if (secp256k1_context_main) {
+        secp256k1_pubkey pubkey;
+        int ret = secp256k1_ec_pubkey_create(secp256k1_context_main, &pubkey, vch);
+        assert(ret);
+        unsigned char c[65];
+        size_t nSize = sizeof(c);
+        secp256k1_ec_pubkey_serialize(secp256k1_context_main, c, &nSize, &pubkey, fCompressed ? SECP256K1_EC_COMPRESSED : SECP256K1_EC_UNCOMPRESSED);
+        CPubKey result(&c[0], &c[nSize]);
+        assert(result.IsValid());
+        return result;
+    }
+#endif
     CECKey key;
     key.SetSecretBytes(vch);
     CPubKey pubkey;
@@ -483,6 +649,19 @@ CPubKey CKey::GetPubKey() const {
 bool CKey::Sign(const uint256 &hash, std::vector<unsigned char>& vchSig) const {
     if (!fValid)
         return false;
+#ifdef USE_SECP256K1
+    if (secp256k1_context_main) {
+        // RFC6979 nonces, and the signature always comes out with a low S
+        secp256k1_ecdsa_signature sig;
+        if (!secp256k1_ecdsa_sign(secp256k1_context_main, &sig, (const unsigned char*)&hash, vch, secp256k1_nonce_function_rfc6979, NULL))
+            return false;
+        vchSig.resize(72);
+        size_t nSigLen = vchSig.size();
+        secp256k1_ecdsa_signature_serialize_der(secp256k1_context_main, &vchSig[0], &nSigLen, &sig);
+        vchSig.resize(nSigLen);
+        return true;
+    }
+#endif
     CECKey key;
     key.SetSecretBytes(vch);
     return key.Sign(hash, vchSig);
@@ -523,6 +702,14 @@ bool CKey::Load(CPrivKey &privkey, CPubKey &vchPubKey, bool fSkipCheck=false) {
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
+#ifdef USE_SECP256K1
+    if (secp256k1_context_main) {
+        secp256k1_pubkey pubkey;
+        if (!secp256k1_ec_pubkey_parse(secp256k1_context_main, &pubkey, vch, size()))
+            return false;
+        return secp256k1_verify_der(&pubkey, hash, vchSig);
+    }
+#endif
     CECKey key;
     if (!key.SetPubKey(*this))
         return false;
@@ -531,6 +718,63 @@ bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchS
     return true;
 }
 
+void CSignatureBatch::Add(const CPubKey &pubkey, const std::vector<unsigned char> &vchSig, const uint256 &hash) {
+    vEntries.push_back(CEntry());
+    CEntry &entry = vEntries.back();
+    entry.pubkey = pubkey;
+    entry.vchSig = vchSig;
+    entry.hash = hash;
+}
+
+bool CSignatureBatch::Verify(size_t *pnFailed) const {
+    std::vector<size_t> vOrder(vEntries.size());
+    for (size_t i = 0; i < vOrder.size(); i++)
+        vOrder[i] = i;
+    std::sort(vOrder.begin(), vOrder.end(), CompareBatchPubKey(*this));
+
+    // Only the first invalid entry is reported, so nothing after it is checked
+    size_t nFailed = vEntries.size();
+    const CPubKey *pkeyLast = NULL;
+    bool fKeyValid = false;
+#ifdef USE_SECP256K1
+    if (secp256k1_context_main) {
+        secp256k1_pubkey pubkey;
+        for (size_t i = 0; i < vOrder.size(); i++) {
+            const CEntry &entry = vEntries[vOrder[i]];
+            if (vOrder[i] > nFailed)
+                continue;
+            if (pkeyLast == NULL || *pkeyLast != entry.pubkey) {
+                fKeyValid = entry.pubkey.IsValid() &&
+                    secp256k1_ec_pubkey_parse(secp256k1_context_main, &pubkey, entry.pubkey.begin(), entry.pubkey.size());
+                pkeyLast = &entry.pubkey;
+            }
+            if (!fKeyValid || !secp256k1_verify_der(&pubkey, entry.hash, entry.vchSig))
+                nFailed = vOrder[i];
+        }
+    } else
+#endif
+    {
+        CECKey key;
+        for (size_t i = 0; i < vOrder.size(); i++) {
+            const CEntry &entry = vEntries[vOrder[i]];
+            if (vOrder[i] > nFailed)
+                continue;
+            if (pkeyLast == NULL || *pkeyLast != entry.pubkey) {
+                fKeyValid = entry.pubkey.IsValid() && key.SetPubKey(entry.pubkey);
+                pkeyLast = &entry.pubkey;
+            }
+            if (!fKeyValid || entry.vchSig.empty() || !key.Verify(entry.hash, entry.vchSig))
+                nFailed = vOrder[i];
+        }
+    }
+
+    if (nFailed == vEntries.size())
+        return true;
+    if (pnFailed)
+        *pnFailed = nFailed;
+    return false;
+}
+
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
     if (vchSig.size() != 65)
         return false;
@@ -559,6 +803,12 @@ bool CPubKey::VerifyCompact(const uint256 &hash, const std::vector<unsigned char
 bool CPubKey::IsFullyValid() const {
     if (!IsValid())
         return false;
+#ifdef USE_SECP256K1
+    if (secp256k1_context_main) {
+        secp256k1_pubkey pubkey;
+        return secp256k1_ec_pubkey_parse(secp256k1_context_main, &pubkey, vch, size());
+    }
+#endif
     CECKey key;
     if (!key.SetPubKey(*this))
         return false;
@@ -712,3 +962,51 @@ bool ECC_InitSanityCheck() {
     // TODO Is there more EC functionality that could be missing?
     return true;
 }
+
+bool ECC_Start(const std::string& strBackend) {
+    if (strBackend == "openssl") {
+        ECC_Stop();
+        return true;
+    }
+#ifdef USE_SECP256K1
+    if (strBackend == "secp256k1") {
+        if (secp256k1_context_main)
+            return true;
+        // Building the multiplication tables is the expensive part, so the
+        // context lives until ECC_Stop
+        secp256k1_context* ctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN | SECP256K1_CONTEXT_VERIFY);
+        if (ctx == NULL)
+            return false;
+
+        // Blind the signing tables against side channels
+        unsigned char vseed[32];
+        RAND_bytes(vseed, sizeof(vseed));
+        bool ret = secp256k1_context_randomize(ctx, vseed);
+        memset(vseed, 0, sizeof(vseed));
+        if (!ret) {
+            secp256k1_context_destroy(ctx);
+            return false;
+        }
+        secp256k1_context_main = ctx;
+        return true;
+    }
+#endif
+    return false;
+}
+
+void ECC_Stop() {
+#ifdef USE_SECP256K1
+    secp256k1_context* ctx = secp256k1_context_main;
+    secp256k1_context_main = NULL;
+    if (ctx)
+        secp256k1_context_destroy(ctx);
+#endif
+}
+
+std::string ECC_GetBackend() {
+#ifdef USE_SECP256K1
+    if (secp256k1_context_main)
+        return "secp256k1";
+#endif
+    return "openssl";
+}
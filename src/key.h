@@ -5,6 +5,7 @@
 #ifndef BITCOIN_KEY_H
 #define BITCOIN_KEY_H
 
+#include <string>
 #include <vector>
 
 #include "allocators.h"
@@ -168,6 +169,39 @@ public:
     bool Derive(CPubKey& pubkeyChild, unsigned char ccChild[32], unsigned int nChild, const unsigned char cc[32]) const;
 };
 
+/**
+ * DER signature checks collected to be verified together.
+ *
+ * ECDSA has no batch equation, so every signature still costs one
+ * verification. What a batch shares is the key setup: checks are grouped by
+ * public key, every distinct key is parsed once and the OpenSSL backend
+ * reuses one EC_KEY for the whole batch.
+ */
+class CSignatureBatch {
+public:
+    struct CEntry {
+        CPubKey pubkey;
+        std::vector<unsigned char> vchSig;
+        uint256 hash;
+    };
+
+private:
+    std::vector<CEntry> vEntries;
+
+public:
+    void Add(const CPubKey &pubkey, const std::vector<unsigned char> &vchSig, const uint256 &hash);
+
+    size_t size() const { return vEntries.size(); }
+    bool empty() const { return vEntries.empty(); }
+    void clear() { vEntries.clear(); }
+    const CEntry &operator[](size_t pos) const { return vEntries[pos]; }
+
+    // Check every signature, with the same result as CPubKey::Verify on each.
+    // If one is invalid and pnFailed is given, it receives the lowest index
+    // of an invalid entry.
+    bool Verify(size_t *pnFailed = NULL) const;
+};
+
 
 // secure_allocator is defined in allocators.h
 // CPrivKey is a serialized private key, with all parameters included (279 bytes)
@@ -311,6 +345,27 @@ struct CExtKey {
 /** Check that required EC support is available at runtime */
 bool ECC_InitSanityCheck(void);
 
+#ifdef USE_SECP256K1
+static const char* const DEFAULT_EC_BACKEND = "secp256k1";
+#else
+static const char* const DEFAULT_EC_BACKEND = "openssl";
+#endif
+
+/**
+ * Select the implementation behind CKey::Sign, CKey::GetPubKey,
+ * CPubKey::Verify and CPubKey::IsFullyValid: "openssl", or "secp256k1" when
+ * built with USE_SECP256K1. The libsecp256k1 context and its precomputed
+ * tables are created here, once. Returns false for an unknown or unavailable
+ * backend. Not thread safe; call before other threads use keys.
+ */
+bool ECC_Start(const std::string& strBackend);
+
+/** Release the backend selected by ECC_Start and go back to OpenSSL */
+void ECC_Stop();
+
+/** Name of the active backend */
+std::string ECC_GetBackend();
+
 bool EnsureLowS(std::vector<unsigned char>& vchSig);
 
 #endif
@@ -9,8 +9,11 @@
 #include <boost/filesystem/fstream.hpp>
 
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "chainstats.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
@@ -37,7 +40,8 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+CBlockMap mapBlockIndex;
+CArena<CBlockIndex> arenaBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
 CBigNum bnProofOfStakeLimit(~uint256(0) >> 48);
@@ -55,10 +59,13 @@ uint256 nBestInvalidTrust = 0;
 
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
+CBlockPosIndex blockposindex;
 int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fHaveGUI = false;
+int nScriptCheckThreads = 0;
 
 struct COrphanBlock {
     uint256 hashBlock;
@@ -148,12 +155,14 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
+    nodeSignals.FinalizeNode.connect(&FinalizeNode);
 }
 
 void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
     nodeSignals.SendMessages.disconnect(&SendMessages);
+    nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
 }
 
 
@@ -512,7 +521,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     vMerkleBranch = pblock->GetMerkleBranch(nIndex);
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -601,29 +610,24 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBlockSize, enum GetMinFe
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs)
+// The checks of AcceptToMemoryPool that come before the signatures, for
+// PreVerifySignatures as well. On success mapInputs has the inputs of tx
+// and nFees and nSize its fee and size. On failure strReason says why,
+// unless it is not worth a log line (we have it, a conflict, missing inputs)
+static bool CheckTxForMemoryPool(CTxMemPool& pool, const CTransaction& tx, CTxDB& txdb, bool fLimitFree,
+                                 MapPrevTx& mapInputs, int64_t& nFees, unsigned int& nSize,
+                                 bool* pfMissingInputs, string& strReason)
 {
     AssertLockHeld(cs_main);
-    if (pfMissingInputs)
-        *pfMissingInputs = false;
-
-    if (!tx.CheckTransaction())
-        return error("AcceptToMemoryPool : CheckTransaction failed");
-
-    // Coinbase is only valid in a block, not as a loose transaction
-    if (tx.IsCoinBase())
-        return tx.DoS(100, error("AcceptToMemoryPool : coinbase as individual tx"));
-
-    // ppcoin: coinstake is also only valid in a block, not as a loose transaction
-    if (tx.IsCoinStake())
-        return tx.DoS(100, error("AcceptToMemoryPool : coinstake as individual tx"));
+    strReason = "";
 
     // Rather not work on nonstandard transactions (unless -testnet)
     string reason;
     if (!TestNet() && !IsStandardTx(tx, reason))
-        return error("AcceptToMemoryPool : nonstandard transaction: %s",
-                     reason);
+    {
+        strReason = "nonstandard transaction: " + reason;
+        return false;
+    }
 
     // is it already in the memory pool?
     uint256 hash = tx.GetHash();
@@ -644,50 +648,94 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
     }
     }
 
+    // do we already have it?
+    if (txdb.ContainsTx(hash))
+        return false;
+
+    map<uint256, CTxIndex> mapUnused;
+    bool fInvalid = false;
+    if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
     {
-        CTxDB txdb("r");
+        if (fInvalid)
+            strReason = strprintf("FetchInputs found invalid tx %s", hash.ToString());
+        else if (pfMissingInputs)
+            *pfMissingInputs = true;
+        return false;
+    }
 
-        // do we already have it?
-        if (txdb.ContainsTx(hash))
-            return false;
+    // Check for non-standard pay-to-script-hash in inputs
+    if (!TestNet() && !AreInputsStandard(tx, mapInputs))
+    {
+        strReason = "nonstandard transaction input";
+        return false;
+    }
 
-        MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
-        bool fInvalid = false;
-        if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+    // Inputs spent in the chain already, before their signatures are checked
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const CTxIndex& txindex = mapInputs[txin.prevout.hash].first;
+        if (txin.prevout.n >= txindex.vSpent.size() || !txindex.vSpent[txin.prevout.n].IsNull())
         {
-            if (fInvalid)
-                return error("AcceptToMemoryPool : FetchInputs found invalid tx %s", hash.ToString());
-            if (pfMissingInputs)
-                *pfMissingInputs = true;
+            strReason = strprintf("input %s already spent", txin.prevout.ToString());
             return false;
         }
+    }
+
+    // Check that the transaction doesn't have an excessive number of
+    // sigops, making it impossible to mine. Since the coinbase transaction
+    // itself can contain sigops MAX_TX_SIGOPS is less than
+    // MAX_BLOCK_SIGOPS; we still consider this an invalid rather than
+    // merely non-standard transaction.
+    unsigned int nSigOps = GetLegacySigOpCount(tx);
+    nSigOps += GetP2SHSigOpCount(tx, mapInputs);
+    if (nSigOps > MAX_TX_SIGOPS)
+    {
+        strReason = strprintf("too many sigops %s, %d > %d", hash.ToString(), nSigOps, MAX_TX_SIGOPS);
+        return false;
+    }
+
+    nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+    nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    // Don't accept it if it can't get into a block
+    int64_t txMinFee = GetMinFee(tx, 1000, GMF_RELAY, nSize);
+    if ((fLimitFree && nFees < txMinFee) || (!fLimitFree && nFees < MIN_TX_FEE))
+    {
+        strReason = strprintf("not enough fees %s, %d < %d", hash.ToString(), nFees, txMinFee);
+        return false;
+    }
+    return true;
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs)
+{
+    AssertLockHeld(cs_main);
+    if (pfMissingInputs)
+        *pfMissingInputs = false;
+
+    if (!tx.CheckTransaction())
+        return error("AcceptToMemoryPool : CheckTransaction failed");
+
+    // Coinbase is only valid in a block, not as a loose transaction
+    if (tx.IsCoinBase())
+        return tx.DoS(100, error("AcceptToMemoryPool : coinbase as individual tx"));
 
-        // Check for non-standard pay-to-script-hash in inputs
-        if (!TestNet() && !AreInputsStandard(tx, mapInputs))
-            return error("AcceptToMemoryPool : nonstandard transaction input");
-
-        // Check that the transaction doesn't have an excessive number of
-        // sigops, making it impossible to mine. Since the coinbase transaction
-        // itself can contain sigops MAX_TX_SIGOPS is less than
-        // MAX_BLOCK_SIGOPS; we still consider this an invalid rather than
-        // merely non-standard transaction.
-        unsigned int nSigOps = GetLegacySigOpCount(tx);
-        nSigOps += GetP2SHSigOpCount(tx, mapInputs);
-        if (nSigOps > MAX_TX_SIGOPS)
-            return tx.DoS(0,
-                          error("AcceptToMemoryPool : too many sigops %s, %d > %d",
-                                hash.ToString(), nSigOps, MAX_TX_SIGOPS));
-
-        int64_t nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-
-        // Don't accept it if it can't get into a block
-        int64_t txMinFee = GetMinFee(tx, 1000, GMF_RELAY, nSize);
-        if ((fLimitFree && nFees < txMinFee) || (!fLimitFree && nFees < MIN_TX_FEE))
-            return error("AcceptToMemoryPool : not enough fees %s, %d < %d",
-                         hash.ToString(),
-                         nFees, txMinFee);
+    // ppcoin: coinstake is also only valid in a block, not as a loose transaction
+    if (tx.IsCoinStake())
+        return tx.DoS(100, error("AcceptToMemoryPool : coinstake as individual tx"));
+
+    uint256 hash = tx.GetHash();
+    int64_t nFees = 0;
+    unsigned int nSize = 0;
+    {
+        CTxDB txdb("r");
+
+        MapPrevTx mapInputs;
+        map<uint256, CTxIndex> mapUnused;
+        string strReason;
+        if (!CheckTxForMemoryPool(pool, tx, txdb, fLimitFree, mapInputs, nFees, nSize, pfMissingInputs, strReason))
+            return strReason.empty() ? false : error("AcceptToMemoryPool : %s", strReason);
 
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
@@ -735,7 +783,12 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
     }
 
     // Store transaction in memory
-    pool.addUnchecked(hash, tx);
+    pool.addUnchecked(hash, CTxMemPoolEntry(tx, nFees, nSize, GetTime(), nBestHeight));
+
+    // Keep the pool within -maxmempool, the cheapest transactions go first
+    pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+    if (!pool.exists(hash))
+        return error("AcceptToMemoryPool : mempool full, fee rate of %s too low", hash.ToString());
 
     SyncWithWallets(tx, NULL);
 
@@ -755,7 +808,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -826,15 +879,8 @@ bool CWalletTx::AcceptWalletTransaction()
 
 int CTxIndex::GetDepthInMainChain() const
 {
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
-        return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
-    if (mi == mapBlockIndex.end())
-        return 0;
-    CBlockIndex* pindex = (*mi).second;
+    CBlockIndex* pindex = blockposindex.Find(pos.nFile, pos.nBlockPos);
     if (!pindex || !pindex->IsInMainChain())
         return 0;
     return 1 + nBestHeight - pindex->nHeight;
@@ -855,9 +901,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
         CTxIndex txindex;
         if (tx.ReadFromDisk(txdb, COutPoint(hash, 0), txindex))
         {
-            CBlock block;
-            if (block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                hashBlock = block.GetHash();
+            CBlockIndex* pindex = blockposindex.Find(txindex.pos.nFile, txindex.pos.nBlockPos);
+            if (pindex)
+                hashBlock = pindex->GetBlockHash();
             return true;
         }
     }
@@ -876,22 +922,80 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
-CBlockIndex* FindBlockByHeight(int nHeight)
+void CChain::SetTip(CBlockIndex* pindex)
+{
+    if (pindex == NULL)
+    {
+        vChain.clear();
+        return;
+    }
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex)
+    {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+}
+
+CBlockIndex* CChain::FindFork(const CBlockIndex* pindex) const
+{
+    // Drop to the chain's height first, every step above it is off the chain
+    while (pindex && pindex->nHeight > Height())
+        pindex = pindex->pprev;
+    while (pindex && !Contains(pindex))
+        pindex = pindex->pprev;
+    return pindex ? (*this)[pindex->nHeight] : NULL;
+}
+
+struct CompareBlockPos
+{
+    bool operator()(const CBlockIndex* pa, const CBlockIndex* pb) const { return pa->nBlockPos < pb->nBlockPos; }
+    bool operator()(const CBlockIndex* pa, unsigned int nBlockPos) const { return pa->nBlockPos < nBlockPos; }
+};
+
+void CBlockPosIndex::Add(CBlockIndex* pindex)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
+    if (pindex->nFile == (unsigned int) -1)
+        return;
+    if (pindex->nFile >= vFiles.size())
+        vFiles.resize(pindex->nFile + 1);
+    vector<CBlockIndex*>& vBlocks = vFiles[pindex->nFile];
+    if (vBlocks.empty() || vBlocks.back()->nBlockPos < pindex->nBlockPos)
+        vBlocks.push_back(pindex);
     else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+        vBlocks.insert(lower_bound(vBlocks.begin(), vBlocks.end(), pindex, CompareBlockPos()), pindex);
+}
+
+CBlockIndex* CBlockPosIndex::Find(unsigned int nFile, unsigned int nBlockPos) const
+{
+    if (nFile >= vFiles.size())
+        return NULL;
+    const vector<CBlockIndex*>& vBlocks = vFiles[nFile];
+    vector<CBlockIndex*>::const_iterator it = lower_bound(vBlocks.begin(), vBlocks.end(), nBlockPos, CompareBlockPos());
+    if (it == vBlocks.end() || (*it)->nBlockPos != nBlockPos)
+        return NULL;
+    return *it;
+}
+
+void CBlockPosIndex::Rebuild()
+{
+    vFiles.clear();
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+        CBlockIndex* pindex = item.second;
+        if (pindex->nFile == (unsigned int) -1)
+            continue;
+        if (pindex->nFile >= vFiles.size())
+            vFiles.resize(pindex->nFile + 1);
+        vFiles[pindex->nFile].push_back(pindex);
+    }
+    BOOST_FOREACH(vector<CBlockIndex*>& vBlocks, vFiles)
+        sort(vBlocks.begin(), vBlocks.end(), CompareBlockPos());
+}
+
+CBlockIndex* FindBlockByHeight(int nHeight)
+{
+    return chainActive[nHeight];
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1054,14 +1158,8 @@ bool IsInitialBlockDownload()
     LOCK(cs_main);
     if (pindexBest == NULL || nBestHeight < Checkpoints::GetTotalBlocksEstimate())
         return true;
-    static int64_t nLastUpdate;
-    static CBlockIndex* pindexLastBest;
-    if (pindexBest != pindexLastBest)
-    {
-        pindexLastBest = pindexBest;
-        nLastUpdate = GetTime();
-    }
-    return (GetTime() - nLastUpdate < 15 &&
+    // nTimeBestReceived is set with pindexBest, under cs_main as well
+    return (GetTime() - nTimeBestReceived < 15 &&
             pindexBest->GetBlockTime() < GetTime() - 8 * 60 * 60);
 }
 
@@ -1151,7 +1249,7 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 
 
 bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
-                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
+                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid) const
 {
     // FetchInputs can return false either because we just haven't seen some inputs
     // (in which case the transaction should be stored as an orphan)
@@ -1248,8 +1346,37 @@ int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
 
 }
 
+bool CScriptCheck::operator()(CSignatureBatch* pbatch) const {
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    return VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, psighash.get(), pbatch);
+}
+
+// Report input nIn of tx, whose scripts failed under flags
+static bool InvalidInputScript(const CTransaction& tx, const CTransaction& txPrev, unsigned int nIn, unsigned int flags,
+                               const CPrecomputedSighash* psighash)
+{
+    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
+        // Check whether the failure was caused by a
+        // non-mandatory script verification check, such as
+        // non-null dummy arguments;
+        // if so, don't trigger DoS protection to
+        // avoid splitting the network between upgraded and
+        // non-upgraded nodes.
+        if (VerifySignature(txPrev, tx, nIn, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0, psighash))
+            return error("ConnectInputs() : %s non-mandatory VerifySignature failed", tx.GetHash().ToString());
+    }
+    // Failures of other flags indicate a transaction that is
+    // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
+    // such nodes as they are not following the protocol. That
+    // said during an upgrade careful thought should be taken
+    // as to the correct behavior - we may want to continue
+    // peering with non-upgraded nodes even after a soft-fork
+    // super-majority vote has passed.
+    return tx.DoS(100,error("ConnectInputs() : %s VerifySignature failed", tx.GetHash().ToString()));
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, std::vector<CScriptCheck> *pvChecks) const
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1259,6 +1386,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
     {
         int64_t nValueIn = 0;
         int64_t nFees = 0;
+        boost::shared_ptr<const CPrecomputedSighash> psighash;
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
@@ -1293,6 +1421,8 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
+        CSignatureBatch batch;
+        vector<unsigned int> vBatchInputs; // input of each batch entry
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
@@ -1311,27 +1441,20 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
-                // Verify signature
-                if (!VerifySignature(txPrev, *this, i, flags, 0))
-                {
-                    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
-                        // Check whether the failure was caused by a
-                        // non-mandatory script verification check, such as
-                        // non-null dummy arguments;
-                        // if so, don't trigger DoS protection to
-                        // avoid splitting the network between upgraded and
-                        // non-upgraded nodes.
-                        if (VerifySignature(txPrev, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
-                            return error("ConnectInputs() : %s non-mandatory VerifySignature failed", GetHash().ToString());
-                    }
-                    // Failures of other flags indicate a transaction that is
-                    // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
-                    // such nodes as they are not following the protocol. That
-                    // said during an upgrade careful thought should be taken
-                    // as to the correct behavior - we may want to continue
-                    // peering with non-upgraded nodes even after a soft-fork
-                    // super-majority vote has passed.
-                    return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString()));
+                // Verify signature, hashing the shared parts of the
+                // transaction once for all inputs
+                if (!psighash)
+                    psighash.reset(new CPrecomputedSighash(*this));
+                CScriptCheck check(txPrev, *this, i, flags, 0, psighash);
+                if (pvChecks) {
+                    pvChecks->push_back(CScriptCheck());
+                    check.swap(pvChecks->back());
+                } else {
+                    // Signature checks are collected and verified together
+                    // once every input's scripts have run
+                    if (!check(&batch))
+                        return InvalidInputScript(*this, txPrev, i, flags, psighash.get());
+                    vBatchInputs.resize(batch.size(), i);
                 }
             }
 
@@ -1345,6 +1468,15 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             }
         }
 
+        // A bad signature in the batch is traced back to its input, whose
+        // scripts are run again on their own to report the failure
+        size_t nFailed;
+        if (!batch.empty() && !VerifySignatureBatch(batch, flags, &nFailed))
+        {
+            unsigned int nIn = vBatchInputs[nFailed];
+            return InvalidInputScript(*this, inputs[vin[nIn].prevout.hash].second, nIn, flags, psighash.get());
+        }
+
         if (!IsCoinStake())
         {
             if (nValueIn < GetValueOut())
@@ -1393,6 +1525,13 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck() {
+    RenameThread("rpicoin-scriptch");
+    scriptcheckqueue.Thread();
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
@@ -1416,11 +1555,14 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
     map<uint256, CTxIndex> mapQueuedChanges;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
     int64_t nStakeReward = 0;
+    uint64_t nCoinAge = 0;
     unsigned int nSigOps = 0;
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
@@ -1478,8 +1620,26 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
+
+            if (tx.IsCoinStake())
+            {
+                // ppcoin: coin age from the inputs just fetched, once
+                // ConnectInputs has checked their timestamps. Outputs of
+                // this block are not in the tx index yet and earn no age
+                MapPrevTx mapIndexedInputs;
+                for (MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
+                {
+                    const CDiskTxPos& posPrev = mi->second.first.pos;
+                    if (posPrev.nFile != pindex->nFile || posPrev.nBlockPos != pindex->nBlockPos)
+                        mapIndexedInputs.insert(*mi);
+                }
+                if (!tx.GetCoinAge(mapIndexedInputs, pindex->pprev, nCoinAge))
+                    return error("ConnectBlock() : %s unable to get coin age for coinstake", tx.GetHash().ToString());
+            }
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
@@ -1497,16 +1657,16 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     if (IsProofOfStake())
     {
         // ppcoin: coin stake tx earns reward instead of paying fee
-        uint64_t nCoinAge;
-        if (!vtx[1].GetCoinAge(txdb, pindex->pprev, nCoinAge))
-            return error("ConnectBlock() : %s unable to get coin age for coinstake", vtx[1].GetHash().ToString());
-
         int64_t nCalculatedStakeReward = GetProofOfStakeReward(pindex->pprev, nCoinAge, nFees);
 
         if (nStakeReward > nCalculatedStakeReward)
             return DoS(100, error("ConnectBlock() : coinstake pays too much(actual=%d vs calculated=%d)", nStakeReward, nCalculatedStakeReward));
     }
 
+    // Wait for the queued script checks before touching the index
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : one of the input signatures is invalid"));
+
     // ppcoin: track money supply and mint amount info
     pindex->nMint = nValueOut - nValueIn + nFees;
     pindex->nMoneySupply = (pindex->pprev? pindex->pprev->nMoneySupply : 0) + nValueOut - nValueIn;
@@ -1545,18 +1705,9 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     LogPrintf("REORGANIZE\n");
 
     // Find the fork
-    CBlockIndex* pfork = pindexBest;
-    CBlockIndex* plonger = pindexNew;
-    while (pfork != plonger)
-    {
-        while (plonger->nHeight > pfork->nHeight)
-            if (!(plonger = plonger->pprev))
-                return error("Reorganize() : plonger->pprev is null");
-        if (pfork == plonger)
-            break;
-        if (!(pfork = pfork->pprev))
-            return error("Reorganize() : pfork->pprev is null");
-    }
+    CBlockIndex* pfork = chainActive.FindFork(pindexNew);
+    if (!pfork)
+        return error("Reorganize() : no fork with the best chain");
 
     // List of what to disconnect
     vector<CBlockIndex*> vDisconnect;
@@ -1624,6 +1775,10 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    chainActive.SetTip(pindexNew);
+    chainstats.SetTip(pindexNew);
+    BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
+        ForgetStakeModifier(pindex);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
@@ -1658,6 +1813,8 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    chainActive.SetTip(pindexNew);
+    chainstats.SetTip(pindexNew);
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
@@ -1679,6 +1836,8 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        chainActive.SetTip(pindexNew);
+        chainstats.SetTip(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -1739,10 +1898,15 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         g_signals.SetBestChain(locator);
     }
 
+    // Once in sync every new best block goes through to LevelDB, so a crash
+    // does not take the block index back behind the block files. During the
+    // initial download the write-back cache flushes on its own thresholds
+    if (!fIsInitialDownload && !FlushTxDB())
+        LogPrintf("SetBestChain() : FlushTxDB failed\n");
+
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
@@ -1794,19 +1958,44 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 // age (trust score) of competing branches.
 bool CTransaction::GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const
 {
-    CBigNum bnCentSecond = 0;  // coin age in the unit of cent-seconds
     nCoinAge = 0;
-
     if (IsCoinBase())
         return true;
 
+    MapPrevTx inputs;
     BOOST_FOREACH(const CTxIn& txin, vin)
     {
+        if (inputs.count(txin.prevout.hash))
+            continue;
+
         // First try finding the previous transaction in database
         CTransaction txPrev;
         CTxIndex txindex;
         if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
             continue;  // previous transaction not in main chain
+        inputs[txin.prevout.hash] = make_pair(txindex, txPrev);
+    }
+
+    return GetCoinAge(inputs, pindexPrev, nCoinAge);
+}
+
+bool CTransaction::GetCoinAge(const MapPrevTx& inputs, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const
+{
+    CBigNum bnCentSecond = 0;  // coin age in the unit of cent-seconds
+    nCoinAge = 0;
+
+    if (IsCoinBase())
+        return true;
+
+    BOOST_FOREACH(const CTxIn& txin, vin)
+    {
+        MapPrevTx::const_iterator mi = inputs.find(txin.prevout.hash);
+        if (mi == inputs.end())
+            continue;  // previous transaction not in main chain
+        const CTxIndex& txindex = mi->second.first;
+        const CTransaction& txPrev = mi->second.second;
+        if (txin.prevout.n >= txPrev.vout.size())
+            continue;
         if (nTime < txPrev.nTime)
             return false;  // Transaction timestamp violation
 
@@ -1839,11 +2028,9 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : %s already exists", hash.ToString());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new (arenaBlockIndex.Allocate()) CBlockIndex(nFile, nBlockPos, *this);
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    CBlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -1869,10 +2056,11 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     pindexNew->bnStakeModifierV2 = ComputeStakeModifier(pindexNew->pprev, IsProofOfWork() ? hash : vtx[1].vin[0].prevout.hash);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    CBlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
+    blockposindex.Add(pindexNew);
 
     // Write to disk block index
     CTxDB txdb;
@@ -1993,7 +2181,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    CBlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2037,77 +2225,632 @@ bool CBlock::AcceptBlock()
             return error("AcceptBlock() : check proof-of-stake failed for block %s", hash.ToString());
         }
     }
-    // PoW is checked in CheckBlock()
-    if (IsProofOfWork())
+    // PoW is checked in CheckBlock()
+    if (IsProofOfWork())
+    {
+        hashProof = GetPoWHash();
+    }
+
+    // Check that the block satisfies synchronized checkpoint
+    if (!Checkpoints::CheckSync(nHeight))
+        return error("AcceptBlock() : rejected by synchronized checkpoint");
+
+    // Enforce rule that the coinbase starts with serialized block height
+    CScript expect = CScript() << nHeight;
+    if (vtx[0].vin[0].scriptSig.size() < expect.size() ||
+        !std::equal(expect.begin(), expect.end(), vtx[0].vin[0].scriptSig.begin()))
+        return DoS(100, error("AcceptBlock() : block height mismatch in coinbase"));
+
+    // Write block to history file
+    if (!CheckDiskSpace(::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION)))
+        return error("AcceptBlock() : out of disk space");
+    unsigned int nFile = -1;
+    unsigned int nBlockPos = 0;
+    if (!WriteToDisk(nFile, nBlockPos))
+        return error("AcceptBlock() : WriteToDisk failed");
+    if (!AddToBlockIndex(nFile, nBlockPos, hashProof))
+        return error("AcceptBlock() : AddToBlockIndex failed");
+
+    // Relay inventory, but don't relay old inventory during initial block download
+    int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
+    if (hashBestChain == hash)
+    {
+        CInv inv(MSG_BLOCK, hash);
+        // Made once the first node takes it
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        bool fCompactMade = false;
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            if (pnode->fCompactHighBandwidth)
+            {
+                // Pushed as a compact block instead of announced, unless
+                // it came from there
+                bool fKnown;
+                {
+                    LOCK(pnode->cs_inventory);
+                    fKnown = !pnode->setInventoryKnown.insert(inv).second;
+                }
+                if (!fKnown)
+                {
+                    if (!fCompactMade)
+                    {
+                        cmpctblock = CBlockHeaderAndShortTxIDs(*this);
+                        fCompactMade = true;
+                    }
+                    pnode->PushMessage("cmpctblock", cmpctblock);
+                }
+            }
+            else
+                pnode->PushInventory(inv);
+        }
+    }
+
+    return true;
+}
+
+uint256 CBlockIndex::GetBlockTrust() const
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+
+    if (bnTarget <= 0)
+        return 0;
+
+    return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+}
+
+bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
+{
+    unsigned int nFound = 0;
+    for (unsigned int i = 0; i < nToCheck && nFound < nRequired && pstart != NULL; i++)
+    {
+        if (pstart->nVersion >= minVersion)
+            ++nFound;
+        pstart = pstart->pprev;
+    }
+    return (nFound >= nRequired);
+}
+
+void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
+{
+    // Filter out duplicate requests
+    if (pindexBegin == pnode->pindexLastGetBlocksBegin && hashEnd == pnode->hashLastGetBlocksEnd)
+        return;
+    pnode->pindexLastGetBlocksBegin = pindexBegin;
+    pnode->hashLastGetBlocksEnd = hashEnd;
+
+    pnode->PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
+}
+
+CHeaderChain headerChain;
+
+// The checks of AcceptBlock that a header alone is enough for
+static bool CheckBlockHeader(const CBlock& header, const uint256& hash, int nHeight, int64_t nTimePrev, int& nDoS)
+{
+    if (header.nVersion > CBlock::CURRENT_VERSION)
+    {
+        nDoS = 100;
+        return error("CheckBlockHeader() : reject unknown block version %d", header.nVersion);
+    }
+
+    if (!Checkpoints::CheckHardened(nHeight, hash))
+    {
+        nDoS = 100;
+        return error("CheckBlockHeader() : rejected by hardened checkpoint lock-in at %d", nHeight);
+    }
+
+    if (header.GetBlockTime() <= nTimePrev)
+        return error("CheckBlockHeader() : block's timestamp is too early");
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime(), nHeight))
+        return error("CheckBlockHeader() : block timestamp too far in the future");
+
+    // Past the last proof-of-work block the timestamp is the coinstake's,
+    // the target a proof-of-stake one
+    CBigNum bnTarget;
+    bnTarget.SetCompact(header.nBits);
+    CBigNum bnTargetLimit = GetProofOfStakeLimit(nHeight);
+    if (nHeight > Params().LastPOWBlock())
+    {
+        if ((header.GetBlockTime() & STAKE_TIMESTAMP_MASK) != 0)
+        {
+            nDoS = 50;
+            return error("CheckBlockHeader() : coinstake timestamp violation nTimeBlock=%d", header.GetBlockTime());
+        }
+    }
+    else if (bnTargetLimit < Params().ProofOfWorkLimit())
+        bnTargetLimit = Params().ProofOfWorkLimit();
+    if (bnTarget <= 0 || bnTarget > bnTargetLimit)
+    {
+        nDoS = 100;
+        return error("CheckBlockHeader() : nBits below minimum work");
+    }
+    return true;
+}
+
+bool CHeaderChain::AddHeaders(const vector<CBlock>& vBlocks, CNode* pfrom, int& nDoS)
+{
+    AssertLockHeld(cs_main);
+    nDoS = 0;
+
+    // Skip the blocks and the headers we have
+    unsigned int nFirst = 0;
+    while (nFirst < vBlocks.size())
+    {
+        uint256 hash = vBlocks[nFirst].GetHash();
+        if (!mapBlockIndex.count(hash) && Find(hash) < 0)
+            break;
+        nFirst++;
+    }
+    if (nFirst == vBlocks.size())
+        return true;
+
+    // Find what they follow, a block of ours or one of our headers
+    const uint256& hashFork = vBlocks[nFirst].hashPrevBlock;
+    CBlockIndex* pindexNewBase = NULL;
+    int nForkPos = Find(hashFork);
+    int nHeight;
+    int64_t nTimePrev;
+    if (nForkPos >= 0)
+    {
+        nHeight = vHeaders[nForkPos].nHeight;
+        nTimePrev = vHeaders[nForkPos].nTime;
+    }
+    else
+    {
+        CBlockMap::iterator mi = mapBlockIndex.find(hashFork);
+        if (mi == mapBlockIndex.end())
+        {
+            LogPrint("net", "CHeaderChain::AddHeaders() : headers do not follow ours, prev=%s\n", hashFork.ToString());
+            return true;
+        }
+        pindexNewBase = mi->second;
+        nHeight = pindexNewBase->nHeight;
+        nTimePrev = pindexNewBase->GetBlockTime();
+    }
+
+    vector<CHeader> vNew;
+    vNew.reserve(vBlocks.size() - nFirst);
+    uint256 hashPrev = hashFork;
+    for (unsigned int i = nFirst; i < vBlocks.size(); i++)
+    {
+        const CBlock& header = vBlocks[i];
+        if (header.hashPrevBlock != hashPrev)
+        {
+            nDoS = 20;
+            return error("CHeaderChain::AddHeaders() : non-continuous headers sequence");
+        }
+        CHeader entry;
+        entry.hash = header.GetHash();
+        entry.nHeight = ++nHeight;
+        entry.nTime = header.nTime;
+        entry.pfrom = pfrom;
+        if (!CheckBlockHeader(header, entry.hash, entry.nHeight, nTimePrev, nDoS))
+            return error("CHeaderChain::AddHeaders() : header %s at %d is no good", entry.hash.ToString(), entry.nHeight);
+        vNew.push_back(entry);
+        hashPrev = entry.hash;
+        nTimePrev = entry.nTime;
+    }
+
+    // Another branch replaces ours if it gets further and comes from the
+    // peer that sent the headers it replaces. Ours is dropped otherwise only
+    // once its blocks are no good or do not come
+    if (!vHeaders.empty() && nForkPos != (int)vHeaders.size() - 1)
+    {
+        if (nHeight <= Height())
+            return true;
+        if (vHeaders[nForkPos + 1].pfrom != pfrom)
+        {
+            LogPrint("net", "CHeaderChain::AddHeaders() : keeping our headers over another branch up to %d\n", nHeight);
+            return true;
+        }
+    }
+    if (nForkPos >= 0)
+    {
+        for (unsigned int i = nForkPos + 1; i < vHeaders.size(); i++)
+            mapHeight.erase(vHeaders[i].hash);
+        vHeaders.resize(nForkPos + 1);
+    }
+    else
+    {
+        vHeaders.clear();
+        mapHeight.clear();
+        pindexBase = pindexNewBase;
+    }
+    BOOST_FOREACH(const CHeader& entry, vNew)
+    {
+        vHeaders.push_back(entry);
+        mapHeight[entry.hash] = entry.nHeight;
+    }
+    return true;
+}
+
+void CHeaderChain::Advance()
+{
+    AssertLockHeld(cs_main);
+    unsigned int nHave = 0;
+    while (nHave < vHeaders.size())
+    {
+        CBlockMap::iterator mi = mapBlockIndex.find(vHeaders[nHave].hash);
+        if (mi == mapBlockIndex.end())
+            break;
+        pindexBase = mi->second;
+        mapHeight.erase(vHeaders[nHave].hash);
+        nHave++;
+    }
+    vHeaders.erase(vHeaders.begin(), vHeaders.begin() + nHave);
+}
+
+void CHeaderChain::Truncate(const uint256& hash)
+{
+    int nPos = Find(hash);
+    if (nPos < 0)
+        return;
+    for (unsigned int i = nPos; i < vHeaders.size(); i++)
+        mapHeight.erase(vHeaders[i].hash);
+    vHeaders.resize(nPos);
+}
+
+void CHeaderChain::ForgetSource(CNode* pfrom)
+{
+    BOOST_FOREACH(CHeader& entry, vHeaders)
+        if (entry.pfrom == pfrom)
+            entry.pfrom = NULL;
+}
+
+CBlockLocator CHeaderChain::GetLocator() const
+{
+    if (vHeaders.empty())
+        return CBlockLocator(pindexBest);
+
+    vector<uint256> vHaveAhead;
+    int nStep = 1;
+    for (int i = vHeaders.size() - 1; i >= 0; i -= nStep)
+    {
+        vHaveAhead.push_back(vHeaders[i].hash);
+        if (vHaveAhead.size() > 10)
+            nStep *= 2;
+    }
+    return CBlockLocator(vHaveAhead, pindexBase);
+}
+
+void PushGetHeaders(CNode* pnode)
+{
+    // Filter out duplicate requests
+    uint256 hashTip = headerChain.IsEmpty() ? hashBestChain : headerChain[headerChain.size() - 1].hash;
+    if (hashTip == pnode->hashLastGetHeaders)
+        return;
+    pnode->hashLastGetHeaders = hashTip;
+
+    pnode->PushMessage("getheaders", headerChain.GetLocator(), uint256(0));
+}
+
+// Headers first sync is on while the headers get further than our blocks
+static bool IsHeadersSyncing()
+{
+    return !headerChain.IsEmpty() && headerChain.Height() > nBestHeight;
+}
+
+// Blocks asked for during headers first sync, from whom and when. A node's
+// requests go with it in FinalizeNode, so the nodes here are still there
+static map<uint256, pair<CNode*, int64_t> > mapBlocksInFlight;
+
+// Blocks downloaded ahead of their parent and who sent them, connected once
+// the parent is. The sender is cleared if it goes away first
+static map<uint256, pair<CBlock, CNode*> > mapBlocksDownloaded;
+
+// Compact blocks waiting for the transactions missing from our pool, with
+// the node asked for them (only compared) and when
+struct CPartialBlockEntry
+{
+    CNode* pfrom;
+    CPartialBlock partial;
+    int64_t nTime;
+};
+static map<uint256, CPartialBlockEntry> mapPartialBlocks;
+
+// Nodes we asked to push us new blocks as compact blocks, the one that
+// delivered a new best block first the longest ago in front
+static list<CNode*> lNodesHighBandwidth;
+
+static void MarkBlockInFlight(const uint256& hash, CNode* pnode)
+{
+    mapBlocksInFlight[hash] = make_pair(pnode, GetTime());
+    pnode->nBlocksInFlight++;
+}
+
+static void MarkBlockReceived(map<uint256, pair<CNode*, int64_t> >::iterator mi)
+{
+    mi->second.first->nBlocksInFlight--;
+    mapBlocksInFlight.erase(mi);
+}
+
+static void MarkBlockReceived(const uint256& hash)
+{
+    map<uint256, pair<CNode*, int64_t> >::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi != mapBlocksInFlight.end())
+        MarkBlockReceived(mi);
+}
+
+// Ask pto for the next blocks of the download window nobody is sending us
+static void FindBlocksToDownload(CNode* pto, vector<CInv>& vGetData)
+{
+    if (!IsHeadersSyncing() || pto->fClient || pto->fDisconnect)
+        return;
+
+    int64_t nNow = GetTime();
+    int nPeerHeight = max(pto->nStartingHeight, pto->nSyncHeight);
+    int nWindow = min(headerChain.size(), BLOCK_DOWNLOAD_WINDOW);
+    for (int i = 0; i < nWindow && pto->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER; i++)
+    {
+        const CHeaderChain::CHeader& header = headerChain[i];
+        if (header.nHeight > nPeerHeight)
+            break;
+        if (mapBlocksDownloaded.count(header.hash) || mapBlockIndex.count(header.hash))
+            continue;
+        map<uint256, pair<CNode*, int64_t> >::iterator mi = mapBlocksInFlight.find(header.hash);
+        if (mi != mapBlocksInFlight.end())
+        {
+            if (mi->second.second + BLOCK_DOWNLOAD_TIMEOUT > nNow)
+                continue;
+            MarkBlockReceived(mi);
+        }
+
+        MarkBlockInFlight(header.hash, pto);
+        vGetData.push_back(CInv(MSG_BLOCK, header.hash));
+    }
+}
+
+// Drop a header and those after it, as its block was no good or did not
+// come. The peer that sent the header is punished by nDoS, and the sync goes
+// on the old way unless other headers still get further than our blocks;
+// another peer's branch can take the place of the dropped one from now on
+static void DropHeaders(const uint256& hash, int nDoS)
+{
+    int nPos = headerChain.Find(hash);
+    if (nPos < 0)
+        return;
+    CNode* pnodeSource = headerChain[nPos].pfrom;
+    LogPrintf("DropHeaders() : dropping the headers from %s at %d\n", hash.ToString(), headerChain[nPos].nHeight);
+    headerChain.Truncate(hash);
+
+    for (map<uint256, pair<CBlock, CNode*> >::iterator mi = mapBlocksDownloaded.begin(); mi != mapBlocksDownloaded.end(); )
+    {
+        if (headerChain.Find(mi->first) < 0)
+            mapBlocksDownloaded.erase(mi++);
+        else
+            ++mi;
+    }
+    for (map<uint256, pair<CNode*, int64_t> >::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end(); )
     {
-        hashProof = GetPoWHash();
+        if (headerChain.Find(mi->first) < 0)
+            MarkBlockReceived(mi++);
+        else
+            ++mi;
     }
 
-    // Check that the block satisfies synchronized checkpoint
-    if (!Checkpoints::CheckSync(nHeight))
-        return error("AcceptBlock() : rejected by synchronized checkpoint");
-
-    // Enforce rule that the coinbase starts with serialized block height
-    CScript expect = CScript() << nHeight;
-    if (vtx[0].vin[0].scriptSig.size() < expect.size() ||
-        !std::equal(expect.begin(), expect.end(), vtx[0].vin[0].scriptSig.begin()))
-        return DoS(100, error("AcceptBlock() : block height mismatch in coinbase"));
+    LOCK(cs_vNodes);
+    CNode* pnodeSync = NULL;
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        // Their headers may be asked for again
+        pnode->hashLastGetHeaders = 0;
+        if (pnode == pnodeSource && nDoS > 0)
+            pnode->Misbehaving(nDoS);
+        else if (!pnodeSync && !pnode->fClient && !pnode->fDisconnect && pnode->nStartingHeight > nBestHeight)
+            pnodeSync = pnode;
+    }
+    if (!IsHeadersSyncing() && pnodeSync)
+        PushGetBlocks(pnodeSync, pindexBest, uint256(0));
+}
 
-    // Write block to history file
-    if (!CheckDiskSpace(::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION)))
-        return error("AcceptBlock() : out of disk space");
-    unsigned int nFile = -1;
-    unsigned int nBlockPos = 0;
-    if (!WriteToDisk(nFile, nBlockPos))
-        return error("AcceptBlock() : WriteToDisk failed");
-    if (!AddToBlockIndex(nFile, nBlockPos, hashProof))
-        return error("AcceptBlock() : AddToBlockIndex failed");
+// Drop the headers whose next block nobody sent us for BLOCK_STALL_TIMEOUT,
+// it may not exist. Nobody is punished: the block was asked of other peers
+// than the one that sent the header, and they may just be slow
+static void CheckHeadersStalled()
+{
+    static int nHeightProgress = -1;
+    static int64_t nTimeProgress = 0;
+    int64_t nNow = GetTime();
+    if (!IsHeadersSyncing() || nBestHeight != nHeightProgress)
+    {
+        nHeightProgress = nBestHeight;
+        nTimeProgress = nNow;
+        return;
+    }
+    if (nTimeProgress + BLOCK_STALL_TIMEOUT > nNow)
+        return;
+    LogPrintf("CheckHeadersStalled() : no block for %d seconds\n", nNow - nTimeProgress);
+    DropHeaders(headerChain[0].hash, 0);
+    nTimeProgress = nNow;
+}
 
-    // Relay inventory, but don't relay old inventory during initial block download
-    int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
-    if (hashBestChain == hash)
+// Connect the downloaded blocks whose turn it is, in order
+static void ProcessDownloadedBlocks()
+{
+    headerChain.Advance();
+    while (!headerChain.IsEmpty())
     {
-        LOCK(cs_vNodes);
-        BOOST_FOREACH(CNode* pnode, vNodes)
-            if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        uint256 hash = headerChain[0].hash;
+        map<uint256, pair<CBlock, CNode*> >::iterator mi = mapBlocksDownloaded.find(hash);
+        if (mi == mapBlocksDownloaded.end())
+            break;
+        CBlock block = mi->second.first;
+        CNode* pfrom = mi->second.second;
+        mapBlocksDownloaded.erase(mi);
+
+        ProcessBlock(NULL, &block);
+        if (block.nDoS && pfrom)
+            pfrom->Misbehaving(block.nDoS);
+        if (!mapBlockIndex.count(hash))
+        {
+            // The block is no good, nor are the headers after it
+            LogPrintf("ProcessDownloadedBlocks() : block %s rejected\n", hash.ToString());
+            DropHeaders(hash, 100);
+            break;
+        }
+        headerChain.Advance();
     }
+}
 
-    return true;
+// Have a block we could not put together from a compact block sent whole
+static void RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    CInv inv(MSG_BLOCK, hash);
+    vector<CInv> vGetData(1, inv);
+    pfrom->PushMessage("getdata", vGetData);
+    mapAlreadyAskedFor[inv] = GetTime() * 1000000;
 }
 
-uint256 CBlockIndex::GetBlockTrust() const
+// Have a block we could not put together from a compact block sent whole by
+// another node than pnodeNot that announced it, if there is one
+static bool RequestFullBlockElsewhere(const uint256& hash, CNode* pnodeNot)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    CInv inv(MSG_BLOCK, hash);
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (pnode == pnodeNot || pnode->fDisconnect || pnode->nVersion == 0)
+            continue;
+        bool fKnown;
+        {
+            LOCK(pnode->cs_inventory);
+            fKnown = pnode->setInventoryKnown.count(inv);
+        }
+        if (fKnown)
+        {
+            RequestFullBlock(pnode, hash);
+            return true;
+        }
+    }
+    return false;
+}
 
-    if (bnTarget <= 0)
-        return 0;
+// Download whole the blocks of compact blocks whose missing transactions did
+// not come in time, from another node if one has them
+static void ExpirePartialBlocks()
+{
+    int64_t nNow = GetTime();
+    map<uint256, CPartialBlockEntry>::iterator mi = mapPartialBlocks.begin();
+    while (mi != mapPartialBlocks.end())
+    {
+        if (mi->second.nTime + COMPACT_BLOCK_TIMEOUT > nNow)
+        {
+            ++mi;
+            continue;
+        }
+        LogPrint("net", "compact block %s timed out\n", mi->first.ToString());
+        if (!RequestFullBlockElsewhere(mi->first, mi->second.pfrom))
+            RequestFullBlock(mi->second.pfrom, mi->first);
+        mapPartialBlocks.erase(mi++);
+    }
+}
 
-    return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+// The nodes that deliver new best blocks first have them pushed to us as
+// compact blocks, without an inv and getdata round trip. A node doing so
+// takes the place of the one in front once there are MAX_HIGH_BANDWIDTH_PEERS
+static void UpdateHighBandwidthPeers(CNode* pfrom)
+{
+    if (!pfrom->fCompactBlocks || IsInitialBlockDownload())
+        return;
+
+    LOCK(cs_vNodes);
+    bool fListed = false;
+    list<CNode*>::iterator it = lNodesHighBandwidth.begin();
+    while (it != lNodesHighBandwidth.end())
+    {
+        // Drop the nodes that went away as well
+        if (*it == pfrom)
+            fListed = true;
+        if (*it == pfrom || find(vNodes.begin(), vNodes.end(), *it) == vNodes.end())
+            it = lNodesHighBandwidth.erase(it);
+        else
+            ++it;
+    }
+    if (!fListed)
+    {
+        if (lNodesHighBandwidth.size() >= MAX_HIGH_BANDWIDTH_PEERS)
+        {
+            lNodesHighBandwidth.front()->PushMessage("sendcmpct", false, (uint64_t)1);
+            lNodesHighBandwidth.pop_front();
+        }
+        pfrom->PushMessage("sendcmpct", true, (uint64_t)1);
+    }
+    lNodesHighBandwidth.push_back(pfrom);
 }
 
-bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
+// The checks of AcceptBlock that the header and the coinbase and coinstake
+// of a compact block are enough for, the kernel among them, so that making
+// one up costs a stake before we go through the pool for it
+static bool CheckCompactBlockHeader(const CBlockHeaderAndShortTxIDs& cmpctblock, CBlockIndex* pindexPrev, int& nDoS)
 {
-    unsigned int nFound = 0;
-    for (unsigned int i = 0; i < nToCheck && nFound < nRequired && pstart != NULL; i++)
+    CBlock block = cmpctblock.header;
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxn)
     {
-        if (pstart->nVersion >= minVersion)
-            ++nFound;
-        pstart = pstart->pprev;
+        if (prefilled.nIndex != block.vtx.size())
+            break;
+        block.vtx.push_back(prefilled.tx);
     }
-    return (nFound >= nRequired);
+    uint256 hash = block.GetHash();
+    int nHeight = pindexPrev->nHeight + 1;
+
+    nDoS = 0;
+    if (!CheckBlockHeader(block, hash, nHeight, pindexPrev->GetPastTimeLimit(), nDoS))
+        return false;
+    if (!block.IsProofOfStake())
+        return error("CheckCompactBlockHeader() : only proof-of-stake blocks are taken as compact blocks");
+    if (!block.vtx[0].IsCoinBase())
+    {
+        nDoS = 100;
+        return error("CheckCompactBlockHeader() : first transaction is not coinbase");
+    }
+    if (block.nBits != GetNextTargetRequired(pindexPrev, true))
+    {
+        nDoS = 100;
+        return error("CheckCompactBlockHeader() : incorrect proof-of-stake target");
+    }
+    if (!CheckCoinStakeTimestamp(nHeight, block.GetBlockTime(), (int64_t)block.vtx[1].nTime))
+    {
+        nDoS = 50;
+        return error("CheckCompactBlockHeader() : coinstake timestamp violation");
+    }
+    if (!block.CheckBlockSignature())
+    {
+        nDoS = 100;
+        return error("CheckCompactBlockHeader() : bad proof-of-stake block signature");
+    }
+    uint256 hashProof, targetProofOfStake;
+    if (!CheckProofOfStake(pindexPrev, block.vtx[1], block.nBits, hashProof, targetProofOfStake))
+        return error("CheckCompactBlockHeader() : check proof-of-stake failed for block %s", hash.ToString());
+    return true;
 }
 
-void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
+// Connect the block of a compact block, with the transactions that were
+// missing from our pool
+static void ProcessPartialBlock(CNode* pfrom, const uint256& hash, const CPartialBlock& partial, const vector<CTransaction>& vMissing)
 {
-    // Filter out duplicate requests
-    if (pindexBegin == pnode->pindexLastGetBlocksBegin && hashEnd == pnode->hashLastGetBlocksEnd)
+    CBlock block;
+    CPartialBlock::ReadStatus status = partial.FillBlock(block, vMissing);
+    if (status == CPartialBlock::READ_STATUS_INVALID)
+    {
+        pfrom->Misbehaving(100);
+        LogPrintf("ProcessPartialBlock() : transactions for compact block %s do not fit\n", hash.ToString());
         return;
-    pnode->pindexLastGetBlocksBegin = pindexBegin;
-    pnode->hashLastGetBlocksEnd = hashEnd;
+    }
+    if (status == CPartialBlock::READ_STATUS_FAILED)
+    {
+        LogPrint("net", "compact block %s does not match its merkle root, asking for it whole\n", hash.ToString());
+        RequestFullBlock(pfrom, hash);
+        return;
+    }
 
-    pnode->PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
+    if (ProcessBlock(pfrom, &block))
+        mapAlreadyAskedFor.erase(CInv(MSG_BLOCK, hash));
+    if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+    if (hashBestChain == hash)
+        UpdateHighBandwidthPeers(pfrom);
 }
 
 bool static IsCanonicalBlockSignature(CBlock* pblock, bool checkLowS)
@@ -2308,6 +3051,16 @@ bool CBlock::CheckBlockSignature() const
     if (vchBlockSig.empty())
         return false;
 
+    // The backends parse and check signatures differently beyond strict DER
+    // with a low S, so only that reaches Verify. ProcessBlock has made new
+    // blocks low S already, blocks from before that are verified as their
+    // low S twin, which is valid exactly when they are
+    if (!IsDERSignature(vchBlockSig, false))
+        return false;
+    valtype vchSig = vchBlockSig;
+    if (!IsLowDERSignature(vchSig, false) && (!EnsureLowS(vchSig) || !IsLowDERSignature(vchSig, false)))
+        return false;
+
     vector<valtype> vSolutions;
     txnouttype whichType;
 
@@ -2319,7 +3072,7 @@ bool CBlock::CheckBlockSignature() const
     if (whichType == TX_PUBKEY)
     {
         valtype& vchPubKey = vSolutions[0];
-        return CPubKey(vchPubKey).Verify(GetHash(), vchBlockSig);
+        return CPubKey(vchPubKey).Verify(GetHash(), vchSig);
     }
     
     // Block signing key also can be encoded in the nonspendable output
@@ -2339,7 +3092,7 @@ bool CBlock::CheckBlockSignature() const
     if (!IsCompressedOrUncompressedPubKey(vchPushValue))
         return false;
     
-    return CPubKey(vchPushValue).Verify(GetHash(), vchBlockSig);
+    return CPubKey(vchPushValue).Verify(GetHash(), vchSig);
 }
 
 bool CheckDiskSpace(uint64_t nAdditionalBytes)
@@ -2359,17 +3112,11 @@ bool CheckDiskSpace(uint64_t nAdditionalBytes)
     return true;
 }
 
-static filesystem::path BlockFilePath(unsigned int nFile)
-{
-    string strBlockFn = strprintf("rpi%04u.dat", nFile);
-    return GetDataDir() / strBlockFn;
-}
-
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
 {
     if ((nFile < 1) || (nFile == (unsigned int) -1))
         return NULL;
-    FILE* file = fopen(BlockFilePath(nFile).string().c_str(), pszMode);
+    FILE* file = fopen(GetBlockFilePath(nFile).string().c_str(), pszMode);
     if (!file)
         return NULL;
     if (nBlockPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
@@ -2451,7 +3198,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (CBlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2732,10 +3479,10 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                CBlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
                     CBlock block;
@@ -2747,7 +3494,13 @@ void static ProcessGetData(CNode* pfrom)
                         assert(ret);
                     }
 
-                    pfrom->PushMessage("block", block);
+                    // Recent blocks as compact blocks if asked, the peer
+                    // should have most of their transactions
+                    CBlockIndex* pindex = (*mi).second;
+                    if (inv.type == MSG_CMPCT_BLOCK && pindex->IsInMainChain() && nBestHeight - pindex->nHeight < MAX_CMPCTBLOCK_DEPTH)
+                        pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                    else
+                        pfrom->PushMessage("block", block);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -2792,7 +3545,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             g_signals.Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK /* || inv.type == MSG_FILTERED_BLOCK */)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK /* || inv.type == MSG_FILTERED_BLOCK */)
                 break;
         }
     }
@@ -2811,6 +3564,34 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Check the signatures of a relayed transaction while holding cs_main only
+// to look up its inputs. The signature cache remembers the good ones, so
+// AcceptToMemoryPool finds them there instead of verifying them under
+// cs_main, where it holds up the other peers' messages. Only transactions
+// that pass the cheap checks of AcceptToMemoryPool get here, so junk is
+// not verified twice
+void static PreVerifySignatures(const CTransaction& tx)
+{
+    MapPrevTx mapInputs;
+    {
+        LOCK(cs_main);
+        CTxDB txdb("r");
+        int64_t nFees;
+        unsigned int nSize;
+        string strReason;
+        if (!CheckTxForMemoryPool(mempool, tx, txdb, true, mapInputs, nFees, nSize, NULL, strReason))
+            return;
+        // Free transactions may yet be turned away by the rate limiter
+        if (nFees < MIN_RELAY_TX_FEE)
+            return;
+    }
+
+    CPrecomputedSighash sighash(tx);
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+        if (!VerifySignature(mapInputs[tx.vin[i].prevout.hash].second, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS, 0, &sighash))
+            return;
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -2935,6 +3716,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     else if (strCommand == "verack")
     {
         pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+        // We take compact blocks, announced for now
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+            pfrom->PushMessage("sendcmpct", false, (uint64_t)1);
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fHighBandwidth;
+        uint64_t nCmpctVersion;
+        vRecv >> fHighBandwidth >> nCmpctVersion;
+
+        LOCK(cs_main);
+        if (nCmpctVersion == 1)
+        {
+            pfrom->fCompactBlocks = true;
+            pfrom->fCompactHighBandwidth = fHighBandwidth;
+        }
     }
 
 
@@ -3037,7 +3837,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave) {
-                if (!fImporting)
+                if (inv.type == MSG_BLOCK && IsHeadersSyncing())
+                {
+                    // Downloaded in order with the others once we have its header
+                    if (headerChain.Find(inv.hash) < 0)
+                        PushGetHeaders(pfrom);
+                }
+                else if (!fImporting)
                     pfrom->AskFor(inv);
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
                 PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(inv.hash));
@@ -3124,7 +3930,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            CBlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3138,7 +3944,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3150,6 +3956,49 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "headers" && !fImporting && !fReindex)
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %u", vHeaders.size());
+        }
+
+        LOCK(cs_main);
+
+        int nDoS = 0;
+        if (!headerChain.AddHeaders(vHeaders, pfrom, nDoS))
+        {
+            if (nDoS > 0)
+                pfrom->Misbehaving(nDoS);
+            return error("message headers : invalid headers");
+        }
+        if (!vHeaders.empty())
+        {
+            int nPos = headerChain.Find(vHeaders.back().GetHash());
+            if (nPos >= 0)
+                pfrom->nSyncHeight = max(pfrom->nSyncHeight, headerChain[nPos].nHeight);
+        }
+        LogPrint("net", "received %u headers, headers up to %d, blocks up to %d\n", vHeaders.size(), headerChain.Height(), nBestHeight);
+
+        if (vHeaders.size() == MAX_HEADERS_RESULTS)
+        {
+            // There are more, ask for them now or once the blocks caught up
+            if (headerChain.Height() < nBestHeight + MAX_HEADERS_AHEAD)
+                PushGetHeaders(pfrom);
+            else
+                pfrom->fHeadersPending = true;
+        }
+        else if (vHeaders.empty() && pfrom->nStartingHeight > nBestHeight && !IsHeadersSyncing())
+        {
+            // Nothing to go on, sync the old way
+            PushGetBlocks(pfrom, pindexBest, uint256(0));
+        }
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3160,6 +4009,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // Context free checks and the signatures, before waiting for cs_main
+        if (tx.CheckTransaction() && !tx.IsCoinBase() && !tx.IsCoinStake() && !mempool.exists(inv.hash))
+            PreVerifySignatures(tx);
+
         LOCK(cs_main);
 
         bool fMissingInputs = false;
@@ -3231,9 +4084,168 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         LOCK(cs_main);
 
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+        MarkBlockReceived(hashBlock);
+        mapPartialBlocks.erase(hashBlock);
+        int nPos = headerChain.Find(hashBlock);
+        if (nPos >= 0 && !mapBlockIndex.count(block.hashPrevBlock))
+        {
+            // Ahead of its parent, keep it until that is connected rather
+            // than leave it with the orphans
+            if (nPos < BLOCK_DOWNLOAD_WINDOW)
+            {
+                if (block.CheckBlock())
+                    mapBlocksDownloaded[hashBlock] = make_pair(block, pfrom);
+                else if (block.nDoS)
+                    pfrom->Misbehaving(block.nDoS);
+            }
+        }
+        else
+        {
+            if (ProcessBlock(pfrom, &block))
+                mapAlreadyAskedFor.erase(inv);
+            if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+            if (hashBestChain == hashBlock)
+                UpdateHighBandwidthPeers(pfrom);
+        }
+        ProcessDownloadedBlocks();
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+
+        LogPrint("net", "received compact block %s\n", hashBlock.ToString());
+
+        CInv inv(MSG_BLOCK, hashBlock);
+        pfrom->AddInventoryKnown(inv);
+
+        LOCK(cs_main);
+
+        if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock))
+            return true;
+        // Another node's compact block of it may still come together from
+        // our pool, the missing transactions are asked of one node only
+        map<uint256, CPartialBlockEntry>::iterator mp = mapPartialBlocks.find(hashBlock);
+        if (mp != mapPartialBlocks.end() && mp->second.pfrom == pfrom)
+            return true;
+
+        // Only new blocks on our chain are put together from the pool
+        CBlockMap::iterator mi = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+        if (mi == mapBlockIndex.end() || IsHeadersSyncing())
+        {
+            RequestFullBlock(pfrom, hashBlock);
+            return true;
+        }
+
+        int nDoS = 0;
+        if (!CheckCompactBlockHeader(cmpctblock, mi->second, nDoS))
+        {
+            if (nDoS > 0)
+                pfrom->Misbehaving(nDoS);
+            return error("message cmpctblock : compact block %s is no good", hashBlock.ToString());
+        }
+
+        // One peer does not get to hold up all the others
+        unsigned int nFromPeer = 0;
+        for (map<uint256, CPartialBlockEntry>::iterator it = mapPartialBlocks.begin(); it != mapPartialBlocks.end(); ++it)
+            if (it->second.pfrom == pfrom)
+                nFromPeer++;
+        if (mp == mapPartialBlocks.end() && (nFromPeer >= MAX_PARTIAL_BLOCKS_PER_PEER || mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS))
+        {
+            RequestFullBlock(pfrom, hashBlock);
+            return true;
+        }
+
+        CPartialBlock partial;
+        CPartialBlock::ReadStatus status = partial.Init(cmpctblock, mempool);
+        if (status == CPartialBlock::READ_STATUS_INVALID)
+        {
+            pfrom->Misbehaving(100);
+            return error("message cmpctblock : invalid compact block %s", hashBlock.ToString());
+        }
+        if (status == CPartialBlock::READ_STATUS_FAILED)
+        {
+            LogPrint("net", "compact block %s has colliding short ids, asking for it whole\n", hashBlock.ToString());
+            RequestFullBlock(pfrom, hashBlock);
+            return true;
+        }
+
+        if (partial.IsComplete())
+        {
+            if (mp != mapPartialBlocks.end())
+                mapPartialBlocks.erase(mp);
+            ProcessPartialBlock(pfrom, hashBlock, partial, vector<CTransaction>());
+            return true;
+        }
+        if (mp != mapPartialBlocks.end())
+            return true;
+
+        CBlockTransactionsRequest req;
+        req.blockhash = hashBlock;
+        partial.GetMissing(req.vIndexes);
+        LogPrint("net", "compact block %s: %u of %u transactions from the pool, asking for %u\n",
+            hashBlock.ToString(), partial.nFromPool, cmpctblock.BlockTxCount(), req.vIndexes.size());
+
+        CPartialBlockEntry& entry = mapPartialBlocks[hashBlock];
+        entry.pfrom = pfrom;
+        entry.partial = partial;
+        entry.nTime = GetTime();
+        pfrom->PushMessage("getblocktxn", req);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        CBlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end())
+            return true;
+        if (nBestHeight - mi->second->nHeight >= MAX_BLOCKTXN_DEPTH)
+        {
+            // Too old to be asked for in bits, send all of it
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!block.ReadFromDisk(mi->second))
+            return error("message getblocktxn : failed to read block %s", req.blockhash.ToString());
+        BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("message getblocktxn : index %u out of range for block %s", nIndex, req.blockhash.ToString());
+            }
+        }
+        pfrom->PushMessage("blocktxn", CBlockTransactions(block, req));
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        LOCK(cs_main);
+
+        map<uint256, CPartialBlockEntry>::iterator mi = mapPartialBlocks.find(resp.blockhash);
+        if (mi == mapPartialBlocks.end() || mi->second.pfrom != pfrom)
+        {
+            LogPrint("net", "received blocktxn for %s that we did not ask %s for\n", resp.blockhash.ToString(), pfrom->addr.ToString());
+            return true;
+        }
+        CPartialBlock partial = mi->second.partial;
+        mapPartialBlocks.erase(mi);
+        ProcessPartialBlock(pfrom, resp.blockhash, partial, resp.vtx);
     }
 
 
@@ -3246,7 +4258,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     {
         // Don't return addresses older than nCutOff timestamp
         int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             if(addr.nTime > nCutOff)
@@ -3356,6 +4371,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CAlert alert;
         vRecv >> alert;
 
+        // Alerts are relayed to every node, guard their setKnown
+        LOCK(cs_mapAlerts);
+
         uint256 alertHash = alert.GetHash();
         if (pfrom->setKnown.count(alertHash) == 0)
         {
@@ -3558,7 +4576,13 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Start block sync
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            PushGetBlocks(pto, pindexBest, uint256(0));
+            PushGetHeaders(pto);
+        }
+
+        // Ask for the headers that were put off until the blocks caught up
+        if (pto->fHeadersPending && headerChain.Height() < nBestHeight + MAX_HEADERS_AHEAD) {
+            pto->fHeadersPending = false;
+            PushGetHeaders(pto);
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -3578,7 +4602,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 // Periodically clear setAddrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
+                {
+                    LOCK(pnode->cs_vAddrToSend);
                     pnode->setAddrKnown.clear();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -3592,6 +4619,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            LOCK(pto->cs_vAddrToSend);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -3667,6 +4695,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata
         //
         vector<CInv> vGetData;
+        if (!fImporting && !fReindex)
+        {
+            CheckHeadersStalled();
+            ExpirePartialBlocks();
+            FindBlocksToDownload(pto, vGetData);
+        }
         int64_t nNow = GetTime() * 1000000;
         CTxDB txdb("r");
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
@@ -3676,7 +4710,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 if (fDebug)
                     LogPrint("net", "sending getdata: %s\n", inv.ToString());
-                vGetData.push_back(inv);
+                // New blocks from peers that take compact blocks come as
+                // those, the transactions should be in our pool
+                if (inv.type == MSG_BLOCK && pto->fCompactBlocks && !IsInitialBlockDownload() && !IsHeadersSyncing())
+                    vGetData.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                else
+                    vGetData.push_back(inv);
                 if (vGetData.size() >= 1000)
                 {
                     pto->PushMessage("getdata", vGetData);
@@ -3692,3 +4731,41 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
     }
     return true;
 }
+
+void FinalizeNode(CNode* pnode)
+{
+    LOCK(cs_main);
+
+    lNodesHighBandwidth.remove(pnode);
+
+    // Its blocks are asked of the others from now on
+    map<uint256, pair<CNode*, int64_t> >::iterator mf = mapBlocksInFlight.begin();
+    while (mf != mapBlocksInFlight.end())
+    {
+        if (mf->second.first == pnode)
+            MarkBlockReceived(mf++);
+        else
+            ++mf;
+    }
+    for (map<uint256, pair<CBlock, CNode*> >::iterator md = mapBlocksDownloaded.begin(); md != mapBlocksDownloaded.end(); ++md)
+        if (md->second.second == pnode)
+            md->second.second = NULL;
+
+    // A node that gets its address later did not send our headers
+    headerChain.ForgetSource(pnode);
+
+    // The missing transactions will not come, have another node that
+    // announced the block send it whole or ask for it once one does
+    map<uint256, CPartialBlockEntry>::iterator mi = mapPartialBlocks.begin();
+    while (mi != mapPartialBlocks.end())
+    {
+        if (mi->second.pfrom != pnode)
+        {
+            ++mi;
+            continue;
+        }
+        if (!RequestFullBlockElsewhere(mi->first, pnode))
+            mapAlreadyAskedFor.erase(CInv(MSG_BLOCK, mi->first));
+        mapPartialBlocks.erase(mi++);
+    }
+}
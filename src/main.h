@@ -8,6 +8,8 @@
 
 #include "core.h"
 #include "bignum.h"
+#include "blockfile.h"
+#include "blockmap.h"
 #include "sync.h"
 #include "txmempool.h"
 #include "net.h"
@@ -41,6 +43,8 @@ static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 /** Default for -maxorphanblocksmib, maximum number of memory to keep orphan blocks */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 40;
+/** Default for -maxmempool, maximum megabytes of serialized transactions in the memory pool */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 100;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -52,6 +56,22 @@ static const int64_t MAX_MONEY = 5999991337 * COIN;
 inline bool MoneyRange(int64_t nValue) { return (nValue >= 0 && nValue <= MAX_MONEY); }
 /** Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp. */
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** -par default (number of script-checking threads, 0 = auto) */
+static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** The maximum number of headers in a 'headers' message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Headers ahead of the best block that are kept during headers first sync */
+static const int MAX_HEADERS_AHEAD = 50000;
+/** Blocks past the last connected one that are downloaded during headers first sync */
+static const int BLOCK_DOWNLOAD_WINDOW = 256;
+/** Blocks asked from one peer at a time during headers first sync */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Seconds before a block that was asked for is asked from another peer */
+static const int BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Seconds without a block connected before the headers being synced are dropped */
+static const int BLOCK_STALL_TIMEOUT = 300;
 
 static const int64_t COIN_YEAR_REWARD = 45 * CENT; // 45% per year
 
@@ -62,7 +82,8 @@ inline unsigned int GetTargetSpacing() { return 64; }
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern CBlockMap mapBlockIndex;
+extern CArena<CBlockIndex> arenaBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nStakeMinConfirmations;
@@ -84,6 +105,7 @@ extern bool fReindex;
 struct COrphanBlock;
 extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
 extern bool fHaveGUI;
+extern int nScriptCheckThreads;
 
 // Settings
 extern bool fUseFastIndex;
@@ -96,6 +118,7 @@ class CReserveKey;
 class CTxDB;
 class CTxIndex;
 class CWalletInterface;
+class CScriptCheck;
 
 /** Register a wallet to receive updates from core */
 void RegisterWallet(CWalletInterface* pwalletIn);
@@ -114,6 +137,7 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals);
 void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
+void PushGetHeaders(CNode* pnode);
 
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
@@ -124,6 +148,8 @@ void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
+/** Forget what we wait for from a node that is about to be deleted */
+void FinalizeNode(CNode* pnode);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
@@ -137,6 +163,8 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
 uint256 WantedByOrphan(const COrphanBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void ThreadStakeMiner(CWallet *pwallet);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
 
 
 /** (try to) add transaction to memory pool **/
@@ -304,6 +332,10 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        // Plain reads are served from the memory-mapped block files
+        if (!pfileRet)
+            return blockfiles.Read(pos.nFile, pos.nTxPos, *this);
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -378,7 +410,7 @@ public:
      @return	Returns true if all inputs are in txdb or mapTestPool
      */
     bool FetchInputs(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool,
-                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
+                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid) const;
 
     /** Sanity check previous transactions, then, if all checks succeed,
         mark them as spent by this transaction.
@@ -389,13 +421,18 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	if non-NULL, script checks are appended here instead of being executed
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS,
+                       std::vector<CScriptCheck> *pvChecks = NULL) const;
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const;
+    /** Same as above from previous transactions already fetched; inputs
+        missing from inputs are taken as not in the main chain */
+    bool GetCoinAge(const MapPrevTx& inputs, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const;
 
     const CTxOut& GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const;
 };
@@ -443,6 +480,39 @@ bool IsStandardTx(const CTransaction& tx, std::string& reason);
 
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight = 0, int64_t nBlockTime = 0);
 
+/** Closure representing one script verification
+ *  Note that this stores references to the spending transaction */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+    int nHashType;
+    // Shared by the checks of all inputs of ptxTo
+    boost::shared_ptr<const CPrecomputedSighash> psighash;
+
+public:
+    CScriptCheck(): ptxTo(0), nIn(0), nFlags(0), nHashType(0) {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CPrecomputedSighash>& psighashIn = boost::shared_ptr<const CPrecomputedSighash>()) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), psighash(psighashIn) { }
+
+    /** With pbatch, signature checks may be deferred to it (see VerifyScript) */
+    bool operator()(CSignatureBatch* pbatch = NULL) const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nHashType, check.nHashType);
+        psighash.swap(check.psighash);
+    }
+};
+
 
 
 /** A transaction with a merkle branch linking it to the block chain. */
@@ -778,20 +848,12 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
         // Read block
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
-        }
+        int nType = SER_DISK;
+        if (!fReadTransactions)
+            nType |= SER_BLOCKHEADERONLY;
+        if (!blockfiles.Read(nFile, nBlockPos, *this, nType, CLIENT_VERSION))
+            return error("CBlock::ReadFromDisk() : read failed");
 
         // Check the header
         if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetPoWHash(), nBits))
@@ -854,17 +916,15 @@ private:
 class CBlockIndex
 {
 public:
+    // Fields used when walking the chain come first, so that they share a
+    // cache line, and the 4-byte fields are paired up to avoid padding
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
     unsigned int nFile;
     unsigned int nBlockPos;
-    uint256 nChainTrust; // ppcoin: trust score of block chain
     int nHeight;
 
-    int64_t nMint;
-    int64_t nMoneySupply;
-
     unsigned int nFlags;  // ppcoin: block index flags
     enum  
     {
@@ -873,21 +933,25 @@ public:
         BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
     };
 
+    // block header
+    unsigned int nTime;
+    unsigned int nBits;
+    int nVersion;
+    unsigned int nNonce;
+
     uint64_t nStakeModifier; // hash modifier for proof-of-stake
-    uint256 bnStakeModifierV2;
+    uint256 nChainTrust; // ppcoin: trust score of block chain
+
+    int64_t nMint;
+    int64_t nMoneySupply;
 
     // proof-of-stake specific fields
-    COutPoint prevoutStake;
     unsigned int nStakeTime;
+    COutPoint prevoutStake;
 
+    uint256 bnStakeModifierV2;
     uint256 hashProof;
-
-    // block header
-    int nVersion;
     uint256 hashMerkleRoot;
-    unsigned int nTime;
-    unsigned int nBits;
-    unsigned int nNonce;
 
     CBlockIndex()
     {
@@ -1068,6 +1132,85 @@ public:
 
 
 
+/** The blocks of the best chain, indexed by height. Kept in step with the
+ *  pnext links so lookups by height do not have to walk the chain. */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    /** Genesis block of the chain, or NULL if empty */
+    CBlockIndex* Genesis() const
+    {
+        return vChain.size() > 0 ? vChain[0] : NULL;
+    }
+
+    /** Last block of the chain, or NULL if empty */
+    CBlockIndex* Tip() const
+    {
+        return vChain.size() > 0 ? vChain[vChain.size() - 1] : NULL;
+    }
+
+    /** Block at nHeight, or NULL if out of range */
+    CBlockIndex* operator[](int nHeight) const
+    {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** Successor of pindex in the chain, or NULL */
+    CBlockIndex* Next(const CBlockIndex* pindex) const
+    {
+        if (Contains(pindex))
+            return (*this)[pindex->nHeight + 1];
+        return NULL;
+    }
+
+    /** Height of the tip, -1 if empty */
+    int Height() const
+    {
+        return vChain.size() - 1;
+    }
+
+    /** Make pindex the tip, only the entries above the fork are rewritten */
+    void SetTip(CBlockIndex* pindex);
+
+    /** Last common block of the chain and the branch ending in pindex */
+    CBlockIndex* FindFork(const CBlockIndex* pindex) const;
+};
+
+extern CChain chainActive;
+
+
+/** Block index entries of each block file ordered by position, so a
+ *  CDiskTxPos resolves to its block without reading the header from disk */
+class CBlockPosIndex
+{
+private:
+    std::vector<std::vector<CBlockIndex*> > vFiles; // indexed by nFile
+
+public:
+    /** Register a block, appending is cheap since block files only grow */
+    void Add(CBlockIndex* pindex);
+
+    /** Block stored at nBlockPos of file nFile, or NULL */
+    CBlockIndex* Find(unsigned int nFile, unsigned int nBlockPos) const;
+
+    /** Repopulate from mapBlockIndex */
+    void Rebuild();
+};
+
+extern CBlockPosIndex blockposindex;
+
+
+
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
 {
@@ -1185,7 +1328,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        CBlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1195,6 +1338,13 @@ public:
         vHave = vHaveIn;
     }
 
+    /** Headers after pindex, newest first, followed by pindex's locator */
+    CBlockLocator(const std::vector<uint256>& vHaveAhead, const CBlockIndex* pindex)
+    {
+        Set(pindex);
+        vHave.insert(vHave.begin(), vHaveAhead.begin(), vHaveAhead.end());
+    }
+
     IMPLEMENT_SERIALIZE
     (
         if (!(nType & SER_GETHASH))
@@ -1220,9 +1370,12 @@ public:
         {
             vHave.push_back(pindex->GetBlockHash());
 
-            // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            // Exponentially larger steps back, jumping along the best chain once on it
+            if (chainActive.Contains(pindex))
+                pindex = chainActive[pindex->nHeight - nStep];
+            else
+                for (int i = 0; pindex && i < nStep; i++)
+                    pindex = pindex->pprev;
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1236,7 +1389,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1255,7 +1408,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1271,7 +1424,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1293,6 +1446,84 @@ public:
 
 
 
+/** Headers first sync: the headers of blocks we do not have yet, following
+ * a block we do have. They are checked as far as a header can be without
+ * its block, a proof-of-stake most of all can not, so they only say what
+ * to download. The blocks are validated and the best chain chosen as ever
+ * once they are here.
+ */
+class CHeaderChain
+{
+public:
+    struct CHeader
+    {
+        uint256 hash;
+        int nHeight;
+        unsigned int nTime;
+        CNode* pfrom;       // who sent it, only compared, NULL once it is gone
+    };
+
+private:
+    CBlockIndex* pindexBase;            // the block the headers follow
+    std::vector<CHeader> vHeaders;      // oldest first
+    std::map<uint256, int> mapHeight;
+
+public:
+    CHeaderChain()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        pindexBase = NULL;
+        vHeaders.clear();
+        mapHeight.clear();
+    }
+
+    bool IsEmpty() const { return vHeaders.empty(); }
+    int size() const { return vHeaders.size(); }
+    const CHeader& operator[](int nPos) const { return vHeaders[nPos]; }
+
+    /** Height of the last header, -1 without headers */
+    int Height() const
+    {
+        return vHeaders.empty() ? -1 : vHeaders.back().nHeight;
+    }
+
+    /** Position of the header, -1 if it is not one of ours */
+    int Find(const uint256& hash) const
+    {
+        std::map<uint256, int>::const_iterator mi = mapHeight.find(hash);
+        if (mi == mapHeight.end())
+            return -1;
+        return mi->second - pindexBase->nHeight - 1;
+    }
+
+    /** Check and take the headers of a 'headers' message from pfrom. They
+        extend ours, or replace ours from where they branch off if they get
+        further and pfrom sent the headers they replace: proof-of-stake
+        headers cost nothing to make up, so height alone says little. Headers
+        that do not follow a block or header of ours are left. Returns false
+        with the DoS score of the peer on headers that are no good */
+    bool AddHeaders(const std::vector<CBlock>& vBlocks, CNode* pfrom, int& nDoS);
+
+    /** Drop the headers from the front whose blocks we have now */
+    void Advance();
+
+    /** Drop the header, and those after it, as its block was no good */
+    void Truncate(const uint256& hash);
+
+    /** Forget pfrom as the sender of our headers, it is going away */
+    void ForgetSource(CNode* pfrom);
+
+    CBlockLocator GetLocator() const;
+};
+
+extern CHeaderChain headerChain;
+
+
+
 
 
 
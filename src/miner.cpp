@@ -58,11 +58,11 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 class COrphan
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     set<uint256> setDependsOn;
     double dFeePerKb;
 
-    COrphan(CTransaction* ptxIn)
+    COrphan(const CTransaction* ptxIn)
     {
         ptx = ptxIn;
         dFeePerKb = 0;
@@ -75,7 +75,7 @@ uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
  
 // We want to sort transactions by fee, so:
-typedef boost::tuple<double, CTransaction*> TxPriority;
+typedef boost::tuple<double, const CTransaction*> TxPriority;
 class TxPriorityCompare
 {
 public:
@@ -85,41 +85,36 @@ public:
     }
 };
 
-// CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
-CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFees)
+// Transactions already assembled into a block, with the running totals
+// needed to keep adding to it
+class CBlockAssembly
 {
-    // Create new block
-    auto_ptr<CBlock> pblock(new CBlock());
-    if (!pblock.get())
-        return NULL;
-
-    CBlockIndex* pindexPrev = pindexBest;
-    int nHeight = pindexPrev->nHeight + 1;
-
-    // Create coinbase tx
-    CTransaction txNew;
-    txNew.vin.resize(1);
-    txNew.vin[0].prevout.SetNull();
-    txNew.vout.resize(1);
-
-    if (!fProofOfStake)
+public:
+    map<uint256, CTxIndex> mapTestPool;
+    set<uint256> setTxIds;
+    // Transactions that went in or will not go in, whatever joins the pool
+    set<uint256> setConsidered;
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    int nBlockSigOps;
+    int64_t nFees;
+
+    CBlockAssembly()
     {
-        CPubKey pubkey;
-        if (!reservekey.GetReservedKey(pubkey))
-            return NULL;
-        txNew.vout[0].scriptPubKey.SetDestination(pubkey.GetID());
+        nBlockSize = 1000;
+        nBlockTx = 0;
+        nBlockSigOps = 100;
+        nFees = 0;
     }
-    else
-    {
-        // Height first in coinbase required for block.version=2
-        txNew.vin[0].scriptSig = (CScript() << nHeight) + COINBASE_FLAGS;
-        assert(txNew.vin[0].scriptSig.size() <= 100);
+};
 
-        txNew.vout[0].SetEmpty();
-    }
+// Add mempool transactions not yet in the block, best fee rate first
+static void AddMempoolTransactions(CBlock* pblock, CBlockAssembly& assembly, CTxDB& txdb, CBlockIndex* pindexPrev, bool fProofOfStake)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
 
-    // Add our coinbase tx as first transaction
-    pblock->vtx.push_back(txNew);
+    int nHeight = pindexPrev->nHeight + 1;
 
     // Largest block you're willing to create:
     unsigned int nBlockMaxSize = GetArg("-blockmaxsize", MAX_BLOCK_SIZE_GEN/2);
@@ -140,189 +135,211 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
     if (mapArgs.count("-mintxfee"))
         ParseMoney(mapArgs["-mintxfee"], nMinTxFee);
 
-    pblock->nBits = GetNextTargetRequired(pindexPrev, fProofOfStake);
+    // Priority order to process transactions
+    list<COrphan> vOrphan; // list memory doesn't move
+    map<uint256, vector<COrphan*> > mapDependers;
 
-    // Collect memory pool transactions into the block
-    int64_t nFees = 0;
-    {
-        LOCK2(cs_main, mempool.cs);
-        CTxDB txdb("r");
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
+    // This vector will be sorted into a priority queue:
+    vector<TxPriority> vecPriority;
+    vecPriority.reserve(mempool.mapTx.size());
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+    // The pool already knows every entry's fee rate, walk it best first
+    // so no previous transaction has to be read from disk here
+    const indexed_transaction_set::index<feerate>::type& byFeeRate = mempool.mapTx.get<feerate>();
+    for (indexed_transaction_set::index<feerate>::type::const_iterator mi = byFeeRate.begin(); mi != byFeeRate.end(); ++mi)
+    {
+        const CTransaction& tx = mi->GetTx();
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            continue;
+        if (assembly.setConsidered.count(mi->GetHash()))
+            continue;
+
+        COrphan* porphan = NULL;
+        bool fDependsOnRejected = false;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            // Inputs spending other pool transactions have to wait for them,
+            // unless those are already in the block
+            if (!mempool.mapTx.count(txin.prevout.hash) || assembly.setTxIds.count(txin.prevout.hash))
                 continue;
-
-            COrphan* porphan = NULL;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (assembly.setConsidered.count(txin.prevout.hash))
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+                fDependsOnRejected = true;
+                break;
             }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
+            if (!porphan)
             {
-                porphan->dFeePerKb = dFeePerKb;
+                // Use list for automatic deletion
+                vOrphan.push_back(COrphan(&tx));
+                porphan = &vOrphan.back();
             }
-            else
-                vecPriority.push_back(TxPriority(dFeePerKb, &(*mi).second));
+            mapDependers[txin.prevout.hash].push_back(porphan);
+            porphan->setDependsOn.insert(txin.prevout.hash);
         }
-
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-
-        TxPriorityCompare comparer;
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
+        if (fDependsOnRejected)
         {
-            // Take highest priority transaction off the priority queue:
-            double dFeePerKb = vecPriority.front().get<0>();
-            CTransaction& tx = *(vecPriority.front().get<1>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Timestamp limit
-            if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
-                continue;
-
-            // Transaction fee
-            int64_t nMinFee = GetMinFee(tx, nBlockSize, GMF_BLOCK);
-
-            // Skip free transactions if we're past the minimum block size:
-            if ((dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
+            assembly.setConsidered.insert(mi->GetHash());
+            continue;
+        }
 
-            int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-            if (nTxFees < nMinFee)
-                continue;
+        // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+        // client code rounds up the size to the nearest 1K. That's good, because it gives an
+        // incentive to create smaller transactions.
+        double dFeePerKb = mi->GetFeePerK();
 
-            nTxSigOps += GetP2SHSigOpCount(tx, mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+        if (porphan)
+            porphan->dFeePerKb = dFeePerKb;
+        else
+            vecPriority.push_back(TxPriority(dFeePerKb, &tx));
+    }
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
-                continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
+    // Collect transactions into block
+    TxPriorityCompare comparer;
+    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
 
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+    while (!vecPriority.empty())
+    {
+        // Take highest priority transaction off the priority queue:
+        double dFeePerKb = vecPriority.front().get<0>();
+        const CTransaction& tx = *(vecPriority.front().get<1>());
+
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        vecPriority.pop_back();
+
+        // Timestamp limit, the only one a later try of the same block may pass
+        if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
+            continue;
+        uint256 hash = tx.GetHash();
+        assembly.setConsidered.insert(hash);
+
+        // Size limits
+        unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        if (assembly.nBlockSize + nTxSize >= nBlockMaxSize)
+            continue;
+
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+        if (assembly.nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            continue;
+
+        // Transaction fee
+        int64_t nMinFee = GetMinFee(tx, assembly.nBlockSize, GMF_BLOCK);
+
+        // Skip free transactions if we're past the minimum block size:
+        if ((dFeePerKb < nMinTxFee) && (assembly.nBlockSize + nTxSize >= nBlockMinSize))
+            continue;
+
+        // Connecting shouldn't fail due to dependency on other memory pool transactions
+        // because we're already processing them in order of dependency
+        map<uint256, CTxIndex> mapTestPoolTmp(assembly.mapTestPool);
+        MapPrevTx mapInputs;
+        bool fInvalid;
+        if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+            continue;
+
+        int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+        if (nTxFees < nMinFee)
+            continue;
+
+        nTxSigOps += GetP2SHSigOpCount(tx, mapInputs);
+        if (assembly.nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            continue;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
+            continue;
+        mapTestPoolTmp[hash] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+        swap(assembly.mapTestPool, mapTestPoolTmp);
+
+        // Added
+        pblock->vtx.push_back(tx);
+        assembly.setTxIds.insert(hash);
+        assembly.nBlockSize += nTxSize;
+        ++assembly.nBlockTx;
+        assembly.nBlockSigOps += nTxSigOps;
+        assembly.nFees += nTxFees;
 
-            if (fDebug && GetBoolArg("-printpriority", false))
-            {
-                LogPrintf("feeperkb %.1f txid %s\n",
-                       dFeePerKb, tx.GetHash().ToString());
-            }
+        if (fDebug && GetBoolArg("-printpriority", false))
+        {
+            LogPrintf("feeperkb %.1f txid %s\n",
+                   dFeePerKb, hash.ToString());
+        }
 
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
+        // Add transactions that depend on this one to the priority queue
+        if (mapDependers.count(hash))
+        {
+            BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                if (!porphan->setDependsOn.empty())
                 {
-                    if (!porphan->setDependsOn.empty())
+                    porphan->setDependsOn.erase(hash);
+                    if (porphan->setDependsOn.empty())
                     {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
+                        vecPriority.push_back(TxPriority(porphan->dFeePerKb, porphan->ptx));
+                        std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
                     }
                 }
             }
         }
+    }
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
+    nLastBlockTx = assembly.nBlockTx;
+    nLastBlockSize = assembly.nBlockSize;
 
-        if (fDebug && GetBoolArg("-printpriority", false))
-            LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+    if (fDebug && GetBoolArg("-printpriority", false))
+        LogPrintf("CreateNewBlock(): total size %u\n", assembly.nBlockSize);
+}
+
+static CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFees, CBlockAssembly& assembly)
+{
+    // Create new block
+    auto_ptr<CBlock> pblock(new CBlock());
+    if (!pblock.get())
+        return NULL;
+
+    CBlockIndex* pindexPrev = pindexBest;
+    int nHeight = pindexPrev->nHeight + 1;
+
+    // Create coinbase tx
+    CTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
+
+    if (!fProofOfStake)
+    {
+        CPubKey pubkey;
+        if (!reservekey.GetReservedKey(pubkey))
+            return NULL;
+        txNew.vout[0].scriptPubKey.SetDestination(pubkey.GetID());
+    }
+    else
+    {
+        // Height first in coinbase required for block.version=2
+        txNew.vin[0].scriptSig = (CScript() << nHeight) + COINBASE_FLAGS;
+        assert(txNew.vin[0].scriptSig.size() <= 100);
+
+        txNew.vout[0].SetEmpty();
+    }
+
+    // Add our coinbase tx as first transaction
+    pblock->vtx.push_back(txNew);
+
+    pblock->nBits = GetNextTargetRequired(pindexPrev, fProofOfStake);
+
+    // Collect memory pool transactions into the block
+    {
+        LOCK2(cs_main, mempool.cs);
+        CTxDB txdb("r");
+        AddMempoolTransactions(pblock.get(), assembly, txdb, pindexPrev, fProofOfStake);
 
         if (!fProofOfStake)
-            pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(nFees);
+            pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(assembly.nFees);
 
         if (pFees)
-            *pFees = nFees;
+            *pFees = assembly.nFees;
 
         // Fill in header
         pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
@@ -335,6 +352,63 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
     return pblock.release();
 }
 
+// CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
+CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFees)
+{
+    CBlockAssembly assembly;
+    return CreateNewBlock(reservekey, fProofOfStake, pFees, assembly);
+}
+
+void CStakeTemplateCache::SetNull()
+{
+    pblock.reset();
+    passembly.reset();
+    nTransactionsUpdatedLast = 0;
+}
+
+CBlock* CStakeTemplateCache::Get(CReserveKey& reservekey, int64_t* pFees)
+{
+    LOCK2(cs_main, mempool.cs);
+
+    if (!pblock.get() || pblock->hashPrevBlock != hashBestChain)
+    {
+        // New tip, start over
+        SetNull();
+        passembly.reset(new CBlockAssembly());
+        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+        pblock.reset(::CreateNewBlock(reservekey, true, NULL, *passembly));
+        if (!pblock.get())
+            return NULL;
+    }
+    else if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast)
+    {
+        // A template transaction that left the pool (conflict, eviction)
+        // may have had dependents in the block, so rebuild from scratch
+        BOOST_FOREACH(const uint256& hash, passembly->setTxIds)
+        {
+            if (!mempool.exists(hash))
+            {
+                LogPrint("creation", "CStakeTemplateCache : %s left the mempool, rebuilding\n", hash.ToString());
+                pblock.reset();
+                return Get(reservekey, pFees);
+            }
+        }
+
+        // Otherwise only the new arrivals need to be checked
+        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+        pblock->vtx[0].nTime = GetAdjustedTime();
+        CTxDB txdb("r");
+        AddMempoolTransactions(pblock.get(), *passembly, txdb, pindexBest, true);
+        pblock->nTime = max(pindexBest->GetPastTimeLimit()+1, pblock->GetMaxTransactionTime());
+    }
+
+    if (pFees)
+        *pFees = passembly->nFees;
+
+    // SignBlock adds the coinstake to the copy it gets, the template stays clean
+    return new CBlock(*pblock);
+}
+
 
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
@@ -474,6 +548,7 @@ bool CheckStake(CBlock* pblock, CWallet& wallet)
         if (!ProcessBlock(NULL, pblock))
             return error("CheckStake() : ProcessBlock, block not accepted");
     }
+    stakeSearchStats.AddBroadcast();
 
     return true;
 }
@@ -486,6 +561,7 @@ void ThreadStakeMiner(CWallet *pwallet)
     RenameThread("rpicoin-miner");
 
     CReserveKey reservekey(pwallet);
+    CStakeTemplateCache stakeTemplate;
 
     bool fTryToSync = true;
 
@@ -494,12 +570,14 @@ void ThreadStakeMiner(CWallet *pwallet)
         while (pwallet->IsLocked())
         {
             nLastCoinStakeSearchInterval = 0;
+            stakeSearchStats.Pause();
             MilliSleep(1000);
         }
 
         while (vNodes.empty() || IsInitialBlockDownload())
         {
             nLastCoinStakeSearchInterval = 0;
+            stakeSearchStats.Pause();
             fTryToSync = true;
             MilliSleep(1000);
         }
@@ -509,20 +587,22 @@ void ThreadStakeMiner(CWallet *pwallet)
             fTryToSync = false;
             if (vNodes.size() < 3 || pindexBest->GetBlockTime() < GetTime() - 10 * 60)
             {
+                stakeSearchStats.Pause();
                 MilliSleep(60000);
                 continue;
             }
         }
 
         //
-        // Create new block
+        // Create new block, reusing the template while the tip is unchanged
         //
         int64_t nFees;
-        auto_ptr<CBlock> pblock(CreateNewBlock(reservekey, true, &nFees));
+        auto_ptr<CBlock> pblock(stakeTemplate.Get(reservekey, &nFees));
         if (!pblock.get())
             return;
 
-        // Trying to sign a block
+        // Trying to sign a block; the kernel search is spread over
+        // nStakeSearchThreads workers while this thread keeps the template
         if (pblock->SignBlock(*pwallet, nFees))
         {
             SetThreadPriority(THREAD_PRIORITY_NORMAL);
@@ -9,9 +9,31 @@
 #include "main.h"
 #include "wallet.h"
 
+class CBlockAssembly;
+
 /* Generate a new block, without valid proof-of-work */
 CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake=false, int64_t* pFees = 0);
 
+/** Proof-of-stake block template kept by the stake miner between attempts.
+ *  Transactions entering the mempool are appended to it, those already
+ *  looked at are not evaluated again. It is only rebuilt when the tip
+ *  changes or one of its transactions leaves the pool. */
+class CStakeTemplateCache
+{
+private:
+    boost::shared_ptr<CBlock> pblock;
+    boost::shared_ptr<CBlockAssembly> passembly;
+    unsigned int nTransactionsUpdatedLast;
+
+public:
+    CStakeTemplateCache() { SetNull(); }
+
+    void SetNull();
+
+    /** Return a fresh copy of the template for the current tip, caller owns it */
+    CBlock* Get(CReserveKey& reservekey, int64_t* pFees);
+};
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 
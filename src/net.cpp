@@ -10,6 +10,7 @@
 #include "main.h"
 #include "addrman.h"
 #include "ui_interface.h"
+#include "socketevents.h"
 
 #ifdef WIN32
 #include <string.h>
@@ -51,6 +52,8 @@ static CNode* pnodeLocalHost = NULL;
 static CNode* pnodeSync = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
+// epoll based socket readiness, NULL where it is unavailable or with -epoll=0
+static CSocketEvents* psocketEvents = NULL;
 CAddrMan addrman;
 
 vector<CNode*> vNodes;
@@ -394,6 +397,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        WakeSocketHandler();
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -412,6 +416,9 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting node %s\n", addrName);
+        // the socket may stay open in a child process, so also stop watching it
+        if (psocketEvents)
+            psocketEvents->Remove(hSocket);
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
     }
@@ -533,6 +540,7 @@ void CNode::copyStats(CNodeStats &stats)
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
+    bool fComplete = false;
     while (nBytes > 0) {
 
         // get current incomplete message, or create a new one
@@ -556,9 +564,14 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         nBytes -= handled;
 
         if (msg.complete())
+        {
             msg.nTime = GetTimeMicros();
+            fComplete = true;
+        }
     }
 
+    if (fComplete)
+        WakeMessageHandler();
     return true;
 }
 
@@ -663,9 +676,22 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
+// Longest wait for socket events; disconnects and timeouts are handled in
+// between, everything else wakes the socket handler
+static const int SOCKET_EVENTS_TIMEOUT = 250;
+
+void WakeSocketHandler()
+{
+    if (psocketEvents)
+        psocketEvents->Wake();
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    // Nodes whose socket was added to psocketEvents, events of any other
+    // are stale
+    set<CNode*> setWatched;
 
     while (true)
     {
@@ -721,7 +747,9 @@ void ThreadSocketHandler()
                     }
                     if (fDelete)
                     {
+                        g_signals.FinalizeNode(pnode);
                         vNodesDisconnected.remove(pnode);
+                        setWatched.erase(pnode);
                         delete pnode;
                     }
                 }
@@ -736,70 +764,125 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
         fd_set fdsetRecv;
         fd_set fdsetSend;
         fd_set fdsetError;
         FD_ZERO(&fdsetRecv);
         FD_ZERO(&fdsetSend);
         FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+        vector<SOCKET> vListenReady;
 
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+        if (psocketEvents)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            // Watch the sockets of new nodes. Events are only reported on
+            // changes, so do not wait if a node has work left from earlier
+            bool fPending = false;
             {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend) {
-                        // do not read, if draining write queue
-                        if (!pnode->vSendMsg.empty())
-                            FD_SET(pnode->hSocket, &fdsetSend);
-                        else
-                            FD_SET(pnode->hSocket, &fdsetRecv);
-                        FD_SET(pnode->hSocket, &fdsetError);
-                        hSocketMax = max(hSocketMax, pnode->hSocket);
-                        have_fds = true;
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
+                    if (!pnode->fSocketWatched)
+                    {
+                        pnode->fSocketWatched = true;
+                        pnode->fRecvReady = pnode->fSendReady = true;
+                        setWatched.insert(pnode);
+                        if (!psocketEvents->Add(pnode->hSocket, pnode))
+                            pnode->CloseSocketDisconnect();
                     }
+                    if ((pnode->fRecvReady && pnode->nSendSize == 0) || (pnode->fSendReady && pnode->nSendSize != 0))
+                        fPending = true;
                 }
             }
-        }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
+            vector<CSocketEvents::CEvent> vEvents;
+            if (!psocketEvents->Wait(fPending ? 0 : SOCKET_EVENTS_TIMEOUT, vEvents))
+                MilliSleep(SOCKET_EVENTS_TIMEOUT);
+            boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
+            BOOST_FOREACH(const CSocketEvents::CEvent& event, vEvents)
+            {
+                CNode* pnode = (CNode*)event.pcookie;
+                if (pnode == NULL)
+                {
+                    // One of the listening sockets, accept() tells which
+                    vListenReady = vhListenSocket;
+                    continue;
+                }
+                if (!setWatched.count(pnode))
+                    continue;
+                if (event.nEvents & (CSocketEvents::EVENT_RECV | CSocketEvents::EVENT_ERROR))
+                    pnode->fRecvReady = true;
+                if (event.nEvents & CSocketEvents::EVENT_SEND)
+                    pnode->fSendReady = true;
+            }
+        }
+        else
         {
-            if (have_fds)
+            struct timeval timeout;
+            timeout.tv_sec  = 0;
+            timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+            SOCKET hSocketMax = 0;
+            bool have_fds = false;
+
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+                FD_SET(hListenSocket, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListenSocket);
+                have_fds = true;
+            }
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
+                    {
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        if (lockSend) {
+                            // do not read, if draining write queue
+                            if (!pnode->vSendMsg.empty())
+                                FD_SET(pnode->hSocket, &fdsetSend);
+                            else
+                                FD_SET(pnode->hSocket, &fdsetRecv);
+                            FD_SET(pnode->hSocket, &fdsetError);
+                            hSocketMax = max(hSocketMax, pnode->hSocket);
+                            have_fds = true;
+                        }
+                    }
+                }
+            }
+
+            int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                                 &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+            boost::this_thread::interruption_point();
+
+            if (nSelect == SOCKET_ERROR)
+            {
+                if (have_fds)
+                {
+                    int nErr = WSAGetLastError();
+                    LogPrintf("socket select error %d\n", nErr);
+                    for (unsigned int i = 0; i <= hSocketMax; i++)
+                        FD_SET(i, &fdsetRecv);
+                }
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                MilliSleep(timeout.tv_usec/1000);
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                    vListenReady.push_back(hListenSocket);
         }
 
 
         //
         // Accept new connections
         //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        BOOST_FOREACH(SOCKET hListenSocket, vListenReady)
+        if (hListenSocket != INVALID_SOCKET)
         {
             struct sockaddr_storage sockaddr;
             socklen_t len = sizeof(sockaddr);
@@ -865,7 +948,13 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (!psocketEvents)
+            {
+                pnode->fRecvReady = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+                pnode->fSendReady = FD_ISSET(pnode->hSocket, &fdsetSend);
+            }
+            // do not read, if draining write queue
+            if (pnode->fRecvReady && (!psocketEvents || pnode->nSendSize == 0))
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -898,7 +987,9 @@ void ThreadSocketHandler()
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fRecvReady = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
                                     LogPrintf("socket recv error %d\n", nErr);
@@ -914,11 +1005,20 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSendReady)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (lockSend && !pnode->vSendMsg.empty())
+                {
+                    // the message handler holds off a node whose send buffer is full
+                    bool fWasFull = pnode->nSendSize >= SendBufferSize();
                     SocketSendData(pnode);
+                    if (fWasFull && pnode->nSendSize < SendBufferSize())
+                        WakeMessageHandler();
+                    // a partial send means the socket buffer is full
+                    if (!pnode->vSendMsg.empty())
+                        pnode->fSendReady = false;
+                }
             }
 
             //
@@ -1401,6 +1501,102 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
+// Wakes the message handler as messages complete or blocks are to be
+// announced. SendMessages also has timed work, like trickling transactions,
+// pings and asking again for data, so it is never left waiting longer than
+// MESSAGE_HANDLER_TIMER
+CWakeup wakeupMessageHandler;
+static const int MESSAGE_HANDLER_TIMER = 100;
+
+void WakeMessageHandler()
+{
+    wakeupMessageHandler.Wake();
+}
+
+// Nodes handed to the message handler workers, each holding a reference,
+// and whether it is the node's turn to trickle
+static deque<pair<CNode*, bool> > queueMessageWork;
+static boost::mutex mutexMessageWork;
+static boost::condition_variable condMessageWork;
+
+// Process a node's next message and send it what is due; returns whether
+// it has more messages that can be processed now
+static bool HandleNodeMessages(CNode* pnode, bool fTrickle)
+{
+    bool fMore = false;
+
+    // Receive messages
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
+        {
+            if (!g_signals.ProcessMessages(pnode))
+                pnode->CloseSocketDisconnect();
+
+            if (pnode->nSendSize < SendBufferSize())
+            {
+                if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                {
+                    fMore = true;
+                }
+            }
+        }
+        else
+        {
+            // The socket handler is appending to it; a message may already
+            // be complete, so look again now rather than after the timer
+            fMore = true;
+        }
+    }
+    boost::this_thread::interruption_point();
+
+    // Send messages
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            g_signals.SendMessages(pnode, fTrickle);
+    }
+    boost::this_thread::interruption_point();
+
+    return fMore;
+}
+
+// Takes nodes off the queue one at a time. A node is queued again only once
+// a worker is done with it, so its messages are processed in the order they
+// came in, while a slow peer or a big block only holds up one worker
+void ThreadMessageWorker()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        CNode* pnode;
+        bool fTrickle;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMessageWork);
+            while (queueMessageWork.empty())
+                condMessageWork.wait(lock);
+            pnode = queueMessageWork.front().first;
+            fTrickle = queueMessageWork.front().second;
+            queueMessageWork.pop_front();
+        }
+
+        bool fMore = false;
+        if (!pnode->fDisconnect)
+            fMore = HandleNodeMessages(pnode, fTrickle);
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMessageWork);
+            pnode->fHandlerQueued = false;
+        }
+        {
+            LOCK(cs_vNodes);
+            pnode->Release();
+        }
+        if (fMore)
+            WakeMessageHandler();
+    }
+}
+
 void ThreadMessageHandler()
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
@@ -1422,45 +1618,26 @@ void ThreadMessageHandler()
         if (!fHaveSyncNode)
             StartSync(vNodesCopy);
 
-        // Poll the connected nodes for messages
+        // Hand the connected nodes to the workers, except those that
+        // are still with one
         CNode* pnodeTrickle = NULL;
         if (!vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
-        bool fSleep = true;
-
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            if (pnode->fDisconnect)
-                continue;
-
-            // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
-                }
-            }
-            boost::this_thread::interruption_point();
-
-            // Send messages
+            // References are only taken and dropped under cs_vNodes
+            LOCK(cs_vNodes);
+            boost::unique_lock<boost::mutex> lock(mutexMessageWork);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle);
+                if (pnode->fDisconnect || pnode->fHandlerQueued)
+                    continue;
+                pnode->fHandlerQueued = true;
+                pnode->AddRef();
+                queueMessageWork.push_back(make_pair(pnode, pnode == pnodeTrickle));
             }
-            boost::this_thread::interruption_point();
         }
+        condMessageWork.notify_all();
 
         {
             LOCK(cs_vNodes);
@@ -1468,8 +1645,9 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
-            MilliSleep(100);
+        // The workers wake us when a node has more to process
+        wakeupMessageHandler.Wait(MESSAGE_HANDLER_TIMER);
+        boost::this_thread::interruption_point();
     }
 }
 
@@ -1650,6 +1828,18 @@ void StartNode(boost::thread_group& threadGroup)
 #endif
 
     // Send and receive from sockets, accept connections
+    if (psocketEvents == NULL && GetBoolArg("-epoll", true))
+    {
+        CSocketEvents* pevents = new CSocketEvents();
+        bool fListening = pevents->IsValid();
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            fListening = fListening && pevents->Add(hListenSocket, NULL, true);
+        if (fListening)
+            psocketEvents = pevents;
+        else
+            delete pevents;
+    }
+    LogPrintf("Waiting for sockets with %s\n", psocketEvents ? "epoll" : "select");
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -1659,6 +1849,11 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
+    int nMessageThreads = GetArg("-msgthreads", DEFAULT_MESSAGE_THREADS);
+    nMessageThreads = max(1, min(nMessageThreads, MAX_MESSAGE_THREADS));
+    LogPrintf("Using %d threads for message processing\n", nMessageThreads);
+    for (int i = 0; i < nMessageThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgwork", &ThreadMessageWorker));
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
@@ -48,12 +48,23 @@ bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::str
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Make the socket handler look at the sockets now rather than on its next timeout */
+void WakeSocketHandler();
+/** Have the message handler make a pass over the nodes now, as a message
+    completed or there is something to send */
+void WakeMessageHandler();
+extern CWakeup wakeupMessageHandler;
+
+/** Worker threads processing peers' messages */
+static const int DEFAULT_MESSAGE_THREADS = 4;
+static const int MAX_MESSAGE_THREADS = 16;
 
 // Signals for message handling
 struct CNodeSignals
 {
     boost::signals2::signal<bool (CNode*)> ProcessMessages;
     boost::signals2::signal<bool (CNode*, bool)> SendMessages;
+    boost::signals2::signal<void (CNode*)> FinalizeNode;
 };
 
 CNodeSignals& GetNodeSignals();
@@ -89,6 +100,8 @@ enum
 {
     MSG_TX = 1,
     MSG_BLOCK,
+    // Numbered as in bitcoin, only asked for with getdata
+    MSG_CMPCT_BLOCK = 4,
 };
 
 extern bool fDiscover;
@@ -190,6 +203,17 @@ public:
     std::deque<CSerializeData> vSendMsg;
     CCriticalSection cs_vSend;
 
+    // Readiness of hSocket from the socket events, which are edge
+    // triggered, kept until recv or send would block. Only the socket
+    // handler thread uses them
+    bool fSocketWatched;
+    bool fRecvReady;
+    bool fSendReady;
+
+    // Set while the node waits for or is with a message handler worker, so
+    // that one worker at a time processes its messages, in order
+    bool fHandlerQueued;
+
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
@@ -225,12 +249,19 @@ public:
     uint256 hashContinue;
     CBlockIndex* pindexLastGetBlocksBegin;
     uint256 hashLastGetBlocksEnd;
+    uint256 hashLastGetHeaders;
+    bool fHeadersPending;   // has more headers, asked for once we need them
     int nStartingHeight;
+    int nSyncHeight;        // height of the best header it sent us
+    int nBlocksInFlight;    // blocks asked of it during headers first sync, under cs_main
     bool fStartSync;
+    bool fCompactBlocks;            // sent us sendcmpct, takes compact blocks
+    bool fCompactHighBandwidth;     // wants new blocks pushed as compact blocks
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
@@ -274,11 +305,21 @@ public:
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
+        fSocketWatched = false;
+        fRecvReady = false;
+        fSendReady = false;
+        fHandlerQueued = false;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
+        hashLastGetHeaders = 0;
+        fHeadersPending = false;
         nStartingHeight = -1;
+        nSyncHeight = -1;
+        nBlocksInFlight = 0;
         fStartSync = false;
+        fCompactBlocks = false;
+        fCompactHighBandwidth = false;
         fGetAddr = false;
         nMisbehavior = 0;
         setInventoryKnown.max_size(SendBufferSize() / 1000);
@@ -355,6 +396,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         setAddrKnown.insert(addr);
     }
 
@@ -363,6 +405,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -380,9 +423,13 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            if (setInventoryKnown.count(inv))
+                return;
+            vInventoryToSend.push_back(inv);
         }
+        // Blocks are announced at once, transactions wait for the trickle
+        if (inv.type == MSG_BLOCK)
+            WakeMessageHandler();
     }
 
     void AskFor(const CInv& inv)
@@ -455,9 +502,14 @@ public:
         ssSend.GetAndClear(*it);
         nSendSize += (*it).size();
 
-        // If write queue empty, attempt "optimistic write"
+        // If write queue empty, attempt "optimistic write", and have the
+        // socket handler send whatever did not fit
         if (it == vSendMsg.begin())
+        {
             SocketSendData(this);
+            if (!vSendMsg.empty())
+                WakeSocketHandler();
+        }
 
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
@@ -6,6 +6,7 @@
 
 #include "rpcserver.h"
 #include "chainparams.h"
+#include "chainstats.h"
 #include "main.h"
 #include "db.h"
 #include "txdb.h"
@@ -101,6 +102,7 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("blockvalue",    (uint64_t)GetProofOfWorkReward(0)));
     obj.push_back(Pair("netmhashps",     GetPoWMHashPS()));
     obj.push_back(Pair("netstakeweight", GetPoSKernelPS()));
+    obj.push_back(Pair("mintperblock",  ValueFromAmount(chainstats.GetMoneySupplyPerBlock())));
     obj.push_back(Pair("errors",        GetWarnings("statusbar")));
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
 
@@ -147,6 +149,17 @@ Value getstakinginfo(const Array& params, bool fHelp)
 
     obj.push_back(Pair("expectedtime", nExpectedTime));
 
+    Object search;
+    search.push_back(Pair("threads", nStakeSearchThreads));
+    search.push_back(Pair("searches", stakeSearchStats.GetSearches()));
+    search.push_back(Pair("kernelspersec", stakeSearchStats.GetHashesPerSecond()));
+    search.push_back(Pair("missedslots", stakeSearchStats.GetMissedSlots()));
+    search.push_back(Pair("kernelsfound", stakeSearchStats.GetKernelsFound()));
+    search.push_back(Pair("blocksrelayed", stakeSearchStats.GetBroadcasts()));
+    search.push_back(Pair("relaylatency", stakeSearchStats.GetBroadcastLatency()));
+    search.push_back(Pair("lastrelaylatency", stakeSearchStats.GetLastBroadcastLatency()));
+    obj.push_back(Pair("search", search));
+
     return obj;
 }
 
@@ -38,7 +38,7 @@ Value getinfo(const Array& params, bool fHelp)
     proxyType proxy;
     GetProxy(NET_IPV4, proxy);
 
-    Object obj, diff;
+    Object obj, diff, scripts;
     obj.push_back(Pair("version",       FormatFullVersion()));
     obj.push_back(Pair("protocolversion",(int)PROTOCOL_VERSION));
 #ifdef ENABLE_WALLET
@@ -60,6 +60,12 @@ Value getinfo(const Array& params, bool fHelp)
     diff.push_back(Pair("proof-of-stake", GetDifficulty(GetLastBlockIndex(pindexBest, true))));
     obj.push_back(Pair("difficulty",    diff));
 
+    uint64_t nTemplate, nInterpreted;
+    GetScriptStats(nTemplate, nInterpreted);
+    scripts.push_back(Pair("template",    nTemplate));
+    scripts.push_back(Pair("interpreter", nInterpreted));
+    obj.push_back(Pair("scripts",       scripts));
+
     obj.push_back(Pair("testnet",       TestNet()));
 #ifdef ENABLE_WALLET
     if (pwalletMain) {
@@ -4,8 +4,6 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
@@ -18,27 +16,15 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags,
+              const CPrecomputedSighash* psighash, CSignatureBatch* pbatch);
 
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
 static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
-static const size_t nDefaultMaxNumSize = 4;
 
 unsigned nMaxDatacarrierBytes = MAX_OP_RETURN_RELAY;
 
-CBigNum CastToBigNum(const valtype& vch, const size_t nMaxNumSize = nDefaultMaxNumSize)
-{
-    if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
-}
-
 bool CastToBool(const valtype& vch)
 {
     for (unsigned int i = 0; i < vch.size(); i++)
@@ -335,7 +321,7 @@ bool static CheckPubKeyEncoding(const valtype &vchSig) {
     return true;
 }
 
-static bool CheckLockTime(const CTransaction& txTo, unsigned int nIn, const CBigNum& nLockTime)
+static bool CheckLockTime(const CTransaction& txTo, unsigned int nIn, const CScriptNum& nLockTime)
 {
     // There are two times of nLockTime: lock-by-blockheight
     // and lock-by-blocktime, distinguished by whether
@@ -371,15 +357,16 @@ static bool CheckLockTime(const CTransaction& txTo, unsigned int nIn, const CBig
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                const CPrecomputedSighash* psighash, CSignatureBatch* pbatch)
 {
-    CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
     opcodetype opcode;
     valtype vchPushValue;
     vector<bool> vfExec;
+    int nExecFalse = 0; // entries of vfExec that are false
     vector<valtype> altstack;
     if (script.size() > 10000)
         return false;
@@ -390,7 +377,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
     {
         while (pc < pend)
         {
-            bool fExec = !count(vfExec.begin(), vfExec.end(), false);
+            bool fExec = nExecFalse == 0;
 
             //
             // Read instruction
@@ -446,7 +433,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
+                    CScriptNum bn((int)opcode - (int)(OP_1 - 1));
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -485,7 +472,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // Thus as a special case we tell CScriptNum to accept up
                     // to 5-byte bignums, which are good until 2**32-1, the
                     // same limit as the nLockTime field itself.
-                    const CBigNum nLockTime = CastToBigNum(stacktop(-1), 5);
+                    const CScriptNum nLockTime(stacktop(-1), 5);
 
                     // In the rare event that the argument may be < 0 due to
                     // some arithmetic being done first, you can always use
@@ -524,6 +511,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         popstack(stack);
                     }
                     vfExec.push_back(fValue);
+                    if (!fValue)
+                        nExecFalse++;
                 }
                 break;
 
@@ -532,6 +521,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (vfExec.empty())
                         return false;
                     vfExec.back() = !vfExec.back();
+                    nExecFalse += vfExec.back() ? -1 : 1;
                 }
                 break;
 
@@ -539,6 +529,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 {
                     if (vfExec.empty())
                         return false;
+                    if (!vfExec.back())
+                        nExecFalse--;
                     vfExec.pop_back();
                 }
                 break;
@@ -600,10 +592,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch1 = stacktop(-2);
-                    valtype vch2 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    stack.push_back(stacktop(-2));
+                    stack.push_back(stacktop(-2));
                 }
                 break;
 
@@ -612,12 +602,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                     if (stack.size() < 3)
                         return false;
-                    valtype vch1 = stacktop(-3);
-                    valtype vch2 = stacktop(-2);
-                    valtype vch3 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
-                    stack.push_back(vch3);
+                    stack.push_back(stacktop(-3));
+                    stack.push_back(stacktop(-3));
+                    stack.push_back(stacktop(-3));
                 }
                 break;
 
@@ -626,10 +613,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return false;
-                    valtype vch1 = stacktop(-4);
-                    valtype vch2 = stacktop(-3);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    stack.push_back(stacktop(-4));
+                    stack.push_back(stacktop(-4));
                 }
                 break;
 
@@ -661,16 +646,15 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x - 0 | x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    if (CastToBool(vch))
-                        stack.push_back(vch);
+                    if (CastToBool(stacktop(-1)))
+                        stack.push_back(stacktop(-1));
                 }
                 break;
 
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
+                    CScriptNum bn((int64_t)stack.size());
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -689,8 +673,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    stack.push_back(vch);
+                    stack.push_back(stacktop(-1));
                 }
                 break;
 
@@ -708,8 +691,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-2);
-                    stack.push_back(vch);
+                    stack.push_back(stacktop(-2));
                 }
                 break;
 
@@ -720,7 +702,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = CScriptNum(stacktop(-1)).getint();
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
@@ -768,7 +750,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
+                    CScriptNum bn((int64_t)stacktop(-1).size());
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -819,15 +801,15 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    CScriptNum bn(stacktop(-1));
                     switch (opcode)
                     {
-                    case OP_1ADD:       bn += bnOne; break;
-                    case OP_1SUB:       bn -= bnOne; break;
+                    case OP_1ADD:       bn = bn + CScriptNum(1); break;
+                    case OP_1SUB:       bn = bn - CScriptNum(1); break;
                     case OP_NEGATE:     bn = -bn; break;
-                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_ABS:        if (bn < 0) bn = -bn; break;
+                    case OP_NOT:        bn = CScriptNum(bn == 0); break;
+                    case OP_0NOTEQUAL:  bn = CScriptNum(bn != 0); break;
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
@@ -852,9 +834,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    CScriptNum bn1(stacktop(-2));
+                    CScriptNum bn2(stacktop(-1));
+                    CScriptNum bn(0);
                     switch (opcode)
                     {
                     case OP_ADD:
@@ -865,15 +847,15 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         bn = bn1 - bn2;
                         break;
 
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+                    case OP_BOOLAND:             bn = CScriptNum(bn1 != 0 && bn2 != 0); break;
+                    case OP_BOOLOR:              bn = CScriptNum(bn1 != 0 || bn2 != 0); break;
+                    case OP_NUMEQUAL:            bn = CScriptNum(bn1 == bn2); break;
+                    case OP_NUMEQUALVERIFY:      bn = CScriptNum(bn1 == bn2); break;
+                    case OP_NUMNOTEQUAL:         bn = CScriptNum(bn1 != bn2); break;
+                    case OP_LESSTHAN:            bn = CScriptNum(bn1 < bn2); break;
+                    case OP_GREATERTHAN:         bn = CScriptNum(bn1 > bn2); break;
+                    case OP_LESSTHANOREQUAL:     bn = CScriptNum(bn1 <= bn2); break;
+                    case OP_GREATERTHANOREQUAL:  bn = CScriptNum(bn1 >= bn2); break;
                     case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
                     case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
                     default:                     assert(!"invalid opcode"); break;
@@ -897,9 +879,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    CScriptNum bn1(stacktop(-3));
+                    CScriptNum bn2(stacktop(-2));
+                    CScriptNum bn3(stacktop(-1));
                     bool fValue = (bn2 <= bn1 && bn1 < bn3);
                     popstack(stack);
                     popstack(stack);
@@ -970,8 +952,13 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((flags & SCRIPT_VERIFY_STRICTENC) && (!CheckSignatureEncoding(vchSig, flags) || !CheckPubKeyEncoding(vchPubKey)))
                         return false;
 
+                    // A failed check can only be deferred to the batch when
+                    // it fails the script: OP_CHECKSIGVERIFY, or OP_CHECKSIG
+                    // as the last opcode, whose result decides the script
+                    bool fDefer = pbatch && (opcode == OP_CHECKSIGVERIFY || (pc == pend && vfExec.empty()));
+
                     bool fSuccess = CheckSignatureEncoding(vchSig, flags) && CheckPubKeyEncoding(vchPubKey) &&
-                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighash, fDefer ? pbatch : NULL);
 
                     popstack(stack);
                     popstack(stack);
@@ -995,7 +982,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int nKeysCount = CScriptNum(stacktop(-i)).getint();
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -1006,7 +993,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    int nSigsCount = CScriptNum(stacktop(-i)).getint();
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -1035,7 +1022,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                         // Check signature
                         bool fOk = CheckSignatureEncoding(vchSig, flags) && CheckPubKeyEncoding(vchPubKey) &&
-                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighash, NULL);
 
                         if (fOk)
                         {
@@ -1169,67 +1156,171 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
     return ss.GetHash();
 }
 
+CPrecomputedSighash::CPrecomputedSighash(const CTransaction& txToIn) : ptxTo(&txToIn)
+{
+    // Serialize as SignatureHash does, with every scriptSig blanked
+    const CTransaction& txTo = *ptxTo;
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(ss, txTo.vin.size());
+    vScriptPos.resize(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        ss << txTo.vin[i].prevout;
+        vScriptPos[i] = ss.size();
+        ss << CScript() << txTo.vin[i].nSequence;
+    }
+    ss << txTo.vout << txTo.nLockTime;
+    vchBlanked.assign(ss.begin(), ss.end());
+
+    // One pass records the hash state in front of each input's script
+    vMidstate.resize(txTo.vin.size());
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    unsigned int nHashed = 0;
+    for (unsigned int i = 0; i < vScriptPos.size(); i++)
+    {
+        SHA256_Update(&ctx, &vchBlanked[nHashed], vScriptPos[i] - nHashed);
+        nHashed = vScriptPos[i];
+        vMidstate[i] = ctx;
+    }
+}
+
+uint256 CPrecomputedSighash::SignatureHash(const CScript& scriptCodeIn, unsigned int nIn, int nHashType) const
+{
+    int nBaseType = nHashType & 0x1f;
+    if (nIn >= vMidstate.size() || (nHashType & SIGHASH_ANYONECANPAY) || nBaseType == SIGHASH_NONE || nBaseType == SIGHASH_SINGLE)
+        return ::SignatureHash(scriptCodeIn, *ptxTo, nIn, nHashType);
+
+    CScript scriptCode(scriptCodeIn);
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    SHA256_CTX ctx = vMidstate[nIn];
+    CDataStream ss(SER_GETHASH, 0);
+    ss << scriptCode;
+    SHA256_Update(&ctx, &ss[0], ss.size());
+
+    // Continue after the blanked script, a single zero length byte
+    unsigned int nPos = vScriptPos[nIn] + 1;
+    SHA256_Update(&ctx, &vchBlanked[nPos], vchBlanked.size() - nPos);
+
+    ss.clear();
+    ss << nHashType;
+    SHA256_Update(&ctx, &ss[0], ss.size());
+
+    uint256 hash1;
+    SHA256_Final((unsigned char*)&hash1, &ctx);
+    uint256 hash2;
+    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    return hash2;
+}
+
 
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
-
+//
+// An entry is the SHA256 of a random per-process salt followed by the
+// signature hash, public key and signature, so 32 bytes whatever the size
+// of the signature. Entries live in a table of two-entry buckets, sized once
+// from -sigcachemb, so a lookup reads a single 64-byte cache line.
+// Because of the salt nobody can aim signatures at one bucket, and a full
+// bucket replaces an entry that only depends on the salted digest.
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
+    static const size_t nBucketEntries = 2;
+
+    uint256 salt;
+    std::vector<uint256> vEntries; // zero marks an unused entry
+    size_t nBucketMask;
     boost::shared_mutex cs_sigcache;
 
+    size_t Bucket(const uint256& entry) const
+    {
+        return ((size_t)entry.GetCheapHash() & nBucketMask) * nBucketEntries;
+    }
+
 public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    CSignatureCache()
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        salt = GetRandHash();
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        // Round the budget down to a power of two number of buckets
+        int64_t nMaxCacheSize = min(GetArg("-sigcachemb", DEFAULT_MAX_SIG_CACHE_SIZE), (int64_t)1024);
+        size_t nBuckets = 0;
+        if (nMaxCacheSize > 0)
+        {
+            size_t nMaxBuckets = (size_t)nMaxCacheSize * 1048576 / (sizeof(uint256) * nBucketEntries);
+            for (nBuckets = 1; nBuckets * 2 <= nMaxBuckets; nBuckets *= 2);
+        }
+        vEntries.resize(nBuckets * nBucketEntries);
+        nBucketMask = nBuckets ? nBuckets - 1 : 0;
+    }
+
+    uint256 ComputeEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        // The public key encodes its own length and the signature comes
+        // last, so the concatenation is unambiguous
+        uint256 entry;
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, (const unsigned char*)&salt, sizeof(salt));
+        SHA256_Update(&ctx, (const unsigned char*)&hash, sizeof(hash));
+        SHA256_Update(&ctx, pubKey.begin(), pubKey.size());
+        if (!vchSig.empty())
+            SHA256_Update(&ctx, &vchSig[0], vchSig.size());
+        SHA256_Final((unsigned char*)&entry, &ctx);
+        return entry;
+    }
+
+    bool Get(const uint256& entry)
+    {
+        if (vEntries.empty())
+            return false;
+
+        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        size_t nFirst = Bucket(entry);
+        for (size_t i = nFirst; i < nFirst + nBucketEntries; i++)
+            if (vEntries[i] == entry)
+                return true;
         return false;
     }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    void Set(const uint256& entry)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        if (vEntries.empty())
+            return;
 
         boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        size_t nFirst = Bucket(entry);
+        for (size_t i = nFirst; i < nFirst + nBucketEntries; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            if (vEntries[i] == entry)
+                return;
+            if (vEntries[i] == 0)
+            {
+                vEntries[i] = entry;
+                return;
+            }
         }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // Bucket full, the top bit of the digest picks the entry to evict
+        vEntries[nFirst + (size_t)(entry.GetCheapHash() >> 63)] = entry;
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+static CSignatureCache& GetSignatureCache()
 {
+    // Constructed on first use, after -sigcachemb has been parsed
     static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CPrecomputedSighash* psighash,
+              CSignatureBatch* pbatch)
+{
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
@@ -1244,17 +1335,42 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash;
+    if (psighash)
+        sighash = psighash->SignatureHash(scriptCode, nIn, nHashType);
+    else
+        sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    uint256 entry = signatureCache.ComputeEntry(sighash, vchSig, pubkey);
+    if (signatureCache.Get(entry))
         return true;
 
+    if (pbatch)
+    {
+        pbatch->Add(pubkey, vchSig, sighash);
+        return true;
+    }
+
     if (!pubkey.Verify(sighash, vchSig))
         return false;
 
     if (!(flags & SCRIPT_VERIFY_NOCACHE))
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(entry);
+
+    return true;
+}
 
+bool VerifySignatureBatch(const CSignatureBatch& batch, unsigned int flags, size_t* pnFailed)
+{
+    if (!batch.Verify(pnFailed))
+        return false;
+
+    if (!(flags & SCRIPT_VERIFY_NOCACHE))
+    {
+        CSignatureCache& signatureCache = GetSignatureCache();
+        for (size_t i = 0; i < batch.size(); i++)
+            signatureCache.Set(signatureCache.ComputeEntry(batch[i].hash, batch[i].vchSig, batch[i].pubkey));
+    }
     return true;
 }
 
@@ -1672,16 +1788,177 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
     return true;
 }
 
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+bool fScriptTemplates = true;
+
+// Every thread counts its VerifyScript calls in its own counters, so the
+// -par script check threads do not contend for a lock on each script. The
+// counters of the running threads are summed when read, those of finished
+// threads are added to statsRetired
+struct CScriptStats
 {
-    vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    uint64_t nTemplate;
+    uint64_t nInterpreted;
+
+    CScriptStats() : nTemplate(0), nInterpreted(0) {}
+};
+
+static boost::mutex cs_scriptstats;
+static set<CScriptStats*> setScriptStats;
+static CScriptStats statsRetired;
+
+static void RetireScriptStats(CScriptStats* pstats)
+{
+    boost::lock_guard<boost::mutex> lock(cs_scriptstats);
+    statsRetired.nTemplate += pstats->nTemplate;
+    statsRetired.nInterpreted += pstats->nInterpreted;
+    setScriptStats.erase(pstats);
+    delete pstats;
+}
+
+static boost::thread_specific_ptr<CScriptStats> ptrScriptStats(RetireScriptStats);
+
+static CScriptStats& ThreadScriptStats()
+{
+    if (ptrScriptStats.get() == NULL)
+    {
+        CScriptStats* pstats = new CScriptStats();
+        {
+            boost::lock_guard<boost::mutex> lock(cs_scriptstats);
+            setScriptStats.insert(pstats);
+        }
+        ptrScriptStats.reset(pstats);
+    }
+    return *ptrScriptStats;
+}
+
+void GetScriptStats(uint64_t& nTemplate, uint64_t& nInterpreted)
+{
+    // The other threads keep counting while we read, the sum is a snapshot
+    boost::lock_guard<boost::mutex> lock(cs_scriptstats);
+    nTemplate = statsRetired.nTemplate;
+    nInterpreted = statsRetired.nInterpreted;
+    BOOST_FOREACH(const CScriptStats* pstats, setScriptStats)
+    {
+        nTemplate += pstats->nTemplate;
+        nInterpreted += pstats->nInterpreted;
+    }
+}
+
+// Standard scripts in the exact byte layout Solver() produces for them;
+// anything else, including other encodings of the same templates, is left
+// to the interpreter
+static txnouttype MatchScriptTemplate(const CScript& script)
+{
+    if (script.size() == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+        script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG)
+        return TX_PUBKEYHASH;
+    if (script.IsPayToScriptHash())
+        return TX_SCRIPTHASH;
+    if (((script.size() == 35 && script[0] == 33) || (script.size() == 67 && script[0] == 65)) && script.back() == OP_CHECKSIG)
+        return TX_PUBKEY;
+    return TX_NONSTANDARD;
+}
+
+// The stack EvalScript would leave for a scriptSig made only of data
+// pushes; false for any other scriptSig. Small stacks only, so that the
+// templates never come near the interpreter's stack size limit
+static bool EvalPushOnly(vector<valtype>& stack, const CScript& script)
+{
+    if (script.size() > 10000)
         return false;
 
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    valtype vchPushValue;
+    while (pc < script.end())
+    {
+        if (!script.GetOp(pc, opcode, vchPushValue) || opcode > OP_PUSHDATA4 || vchPushValue.size() > MAX_SCRIPT_ELEMENT_SIZE)
+            return false;
+        if (stack.size() >= 100)
+            return false;
+        stack.push_back(vchPushValue);
+    }
+    return true;
+}
+
+// Runs a script that MatchScriptTemplate() recognised, with the same result
+// and the same effect on the stack as EvalScript
+static bool EvalScriptTemplate(txnouttype type, vector<valtype>& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn,
+                               unsigned int flags, int nHashType, const CPrecomputedSighash* psighash, CSignatureBatch* pbatch)
+{
+    if (type == TX_SCRIPTHASH)
+    {
+        // OP_HASH160 <hash> OP_EQUAL
+        if (stack.empty())
+            return false;
+        uint160 hash = Hash160(stacktop(-1));
+        bool fEqual = memcmp(hash.begin(), &script[2], 20) == 0;
+        popstack(stack);
+        stack.push_back(fEqual ? vchTrue : vchFalse);
+        return true;
+    }
+
+    // OP_DUP OP_HASH160 <hash> OP_EQUALVERIFY OP_CHECKSIG consumes a
+    // signature and a public key, <pubkey> OP_CHECKSIG only a signature
+    unsigned int nArgs = (type == TX_PUBKEYHASH) ? 2 : 1;
+    if (stack.size() < nArgs)
+        return false;
+
+    valtype vchPubKey;
+    if (type == TX_PUBKEYHASH)
+    {
+        uint160 hash = Hash160(stacktop(-1));
+        if (memcmp(hash.begin(), &script[3], 20) != 0)
+            return false;
+        vchPubKey = stacktop(-1);
+    }
+    else
+        vchPubKey.assign(script.begin() + 1, script.end() - 1);
+    const valtype& vchSig = stacktop(-(int)nArgs);
+
+    CScript scriptCode(script);
+    scriptCode.FindAndDelete(CScript(vchSig));
+
+    if ((flags & SCRIPT_VERIFY_STRICTENC) && (!CheckSignatureEncoding(vchSig, flags) || !CheckPubKeyEncoding(vchPubKey)))
+        return false;
+
+    // The OP_CHECKSIG is last, so it can always be deferred to the batch
+    bool fSuccess = CheckSignatureEncoding(vchSig, flags) && CheckPubKeyEncoding(vchPubKey) &&
+        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighash, pbatch);
+
+    for (unsigned int i = 0; i < nArgs; i++)
+        popstack(stack);
+    stack.push_back(fSuccess ? vchTrue : vchFalse);
+    return true;
+}
+
+static bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                         unsigned int flags, int nHashType, const CPrecomputedSighash* psighash, CSignatureBatch* pbatch,
+                         bool& fInterpreted)
+{
+    // Standard scriptPubKeys spent by a plain list of pushes skip the
+    // interpreter
+    vector<vector<unsigned char> > stack, stackCopy;
+    txnouttype type = fScriptTemplates ? MatchScriptTemplate(scriptPubKey) : TX_NONSTANDARD;
+    if (type != TX_NONSTANDARD && !EvalPushOnly(stack, scriptSig))
+    {
+        type = TX_NONSTANDARD;
+        stack.clear();
+    }
+
+    if (type == TX_NONSTANDARD)
+    {
+        fInterpreted = true;
+
+        // Nothing is deferred from scriptSig, whose results are not final
+        if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, psighash))
+            return false;
+    }
+
     stackCopy = stack;
 
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (type == TX_NONSTANDARD ? !EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, psighash, pbatch) :
+                                 !EvalScriptTemplate(type, stack, scriptPubKey, txTo, nIn, flags, nHashType, psighash, pbatch))
         return false;
     if (stack.empty())
         return false;
@@ -1699,7 +1976,16 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        // The redeem script may be standard too, though stackCopy is only
+        // known to be small if scriptSig was taken apart above
+        txnouttype typeRedeem = (type == TX_NONSTANDARD) ? TX_NONSTANDARD : MatchScriptTemplate(pubKey2);
+        if (typeRedeem == TX_NONSTANDARD)
+        {
+            fInterpreted = true;
+            if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, psighash, pbatch))
+                return false;
+        }
+        else if (!EvalScriptTemplate(typeRedeem, stackCopy, pubKey2, txTo, nIn, flags, nHashType, psighash, pbatch))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1709,15 +1995,31 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
     return true;
 }
 
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                  unsigned int flags, int nHashType, const CPrecomputedSighash* psighash, CSignatureBatch* pbatch)
+{
+    bool fInterpreted = false;
+    bool fResult = VerifyScript(scriptSig, scriptPubKey, txTo, nIn, flags, nHashType, psighash, pbatch, fInterpreted);
+
+    CScriptStats& stats = ThreadScriptStats();
+    if (fInterpreted)
+        stats.nInterpreted++;
+    else
+        stats.nTemplate++;
+    return fResult;
+}
+
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CPrecomputedSighash* psighash)
 {
     assert(nIn < txTo.vin.size());
+    assert(!psighash || &psighash->GetTransaction() == &txTo);
     CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash = psighash ? psighash->SignatureHash(fromPubKey, nIn, nHashType) : SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
     txnouttype whichType;
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
@@ -1731,7 +2033,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = psighash ? psighash->SignatureHash(subscript, nIn, nHashType) : SignatureHash(subscript, txTo, nIn, nHashType);
 
         txnouttype subType;
         bool fSolved =
@@ -1742,10 +2044,11 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, STANDARD_SCRIPT_VERIFY_FLAGS, 0);
+    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, STANDARD_SCRIPT_VERIFY_FLAGS, 0, psighash);
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CPrecomputedSighash* psighash)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
@@ -1753,10 +2056,11 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
     assert(txin.prevout.hash == txFrom.GetHash());
     const CTxOut& txout = txFrom.vout[txin.prevout.n];
 
-    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
+    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType, psighash);
 }
 
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                     const CPrecomputedSighash* psighash)
 {
     assert(nIn < txTo.vin.size());
     const CTxIn& txin = txTo.vin[nIn];
@@ -1767,7 +2071,7 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
     if (txin.prevout.hash != txFrom.GetHash())
         return false;
 
-    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, flags, nHashType);
+    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, flags, nHashType, psighash);
 }
 
 static CScript PushAll(const vector<valtype>& values)
@@ -1808,7 +2112,7 @@ static CScript CombineMultisig(CScript scriptPubKey, const CTransaction& txTo, u
             if (sigs.count(pubkey))
                 continue; // Already got a sig for this pubkey
 
-            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0, 0))
+            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0, 0, NULL, NULL))
             {
                 sigs[pubkey] = sig;
                 break;
@@ -6,6 +6,8 @@
 #ifndef H_BITCOIN_SCRIPT
 #define H_BITCOIN_SCRIPT
 
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -14,6 +16,8 @@
 #include <boost/foreach.hpp>
 #include <boost/variant.hpp>
 
+#include <openssl/sha.h>
+
 #include "keystore.h"
 #include "bignum.h"
 #include "util.h"
@@ -24,7 +28,9 @@ class CTransaction;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
 static const unsigned int MAX_OP_RETURN_RELAY = 15000;   // bytes
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 4;  // megabytes
 extern unsigned nMaxDatacarrierBytes;
+extern bool fScriptTemplates;
 
 /** Signature hash types/flags */
 enum
@@ -260,6 +266,110 @@ enum opcodetype
 const char* GetOpName(opcodetype opcode);
 
 
+class scriptnum_error : public std::runtime_error
+{
+public:
+    explicit scriptnum_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+/**
+ * Script integer, as consumed and produced by the numeric opcodes.
+ *
+ * Operands are little-endian sign and magnitude byte vectors of at most
+ * nMaxNumSize bytes, so they always fit in 64 bits, as do the results of
+ * any single operation on them (results may be up to 5 bytes long and only
+ * fail when used as an operand). This is the CBigNum arithmetic that
+ * EvalScript used to do, without a BIGNUM allocation per operand.
+ */
+class CScriptNum
+{
+private:
+    int64_t nValue;
+
+    static int64_t Decode(const std::vector<unsigned char>& vch)
+    {
+        if (vch.empty())
+            return 0;
+
+        int64_t n = 0;
+        for (size_t i = 0; i < vch.size(); i++)
+            n |= (int64_t)vch[i] << (8 * i);
+
+        // The top bit of the last byte is the sign, which makes 0x80 a
+        // negative zero
+        if (vch.back() & 0x80)
+            return -(int64_t)(n & ~((uint64_t)0x80 << (8 * (vch.size() - 1))));
+        return n;
+    }
+
+public:
+    static const size_t nDefaultMaxNumSize = 4;
+
+    explicit CScriptNum(int64_t n) : nValue(n) {}
+
+    /** Throws scriptnum_error if vch is longer than nMaxNumSize */
+    explicit CScriptNum(const std::vector<unsigned char>& vch, size_t nMaxNumSize = nDefaultMaxNumSize)
+    {
+        if (vch.size() > nMaxNumSize)
+            throw scriptnum_error("CScriptNum() : overflow");
+        nValue = Decode(vch);
+    }
+
+    bool operator==(int64_t n) const { return nValue == n; }
+    bool operator!=(int64_t n) const { return nValue != n; }
+    bool operator<=(int64_t n) const { return nValue <= n; }
+    bool operator< (int64_t n) const { return nValue <  n; }
+    bool operator>=(int64_t n) const { return nValue >= n; }
+    bool operator> (int64_t n) const { return nValue >  n; }
+
+    bool operator==(const CScriptNum& b) const { return nValue == b.nValue; }
+    bool operator!=(const CScriptNum& b) const { return nValue != b.nValue; }
+    bool operator<=(const CScriptNum& b) const { return nValue <= b.nValue; }
+    bool operator< (const CScriptNum& b) const { return nValue <  b.nValue; }
+    bool operator>=(const CScriptNum& b) const { return nValue >= b.nValue; }
+    bool operator> (const CScriptNum& b) const { return nValue >  b.nValue; }
+
+    CScriptNum operator+(const CScriptNum& b) const { return CScriptNum(nValue + b.nValue); }
+    CScriptNum operator-(const CScriptNum& b) const { return CScriptNum(nValue - b.nValue); }
+    CScriptNum operator-() const { return CScriptNum(-nValue); }
+
+    int64_t GetInt64() const { return nValue; }
+
+    /** Clamped to the range of int, like CBigNum::getint */
+    int getint() const
+    {
+        if (nValue > std::numeric_limits<int>::max())
+            return std::numeric_limits<int>::max();
+        if (nValue < std::numeric_limits<int>::min())
+            return std::numeric_limits<int>::min();
+        return (int)nValue;
+    }
+
+    /** Shortest encoding, the same bytes as CBigNum::getvch */
+    std::vector<unsigned char> getvch() const
+    {
+        std::vector<unsigned char> vch;
+        if (nValue == 0)
+            return vch;
+
+        bool fNegative = nValue < 0;
+        uint64_t n = fNegative ? -(uint64_t)nValue : (uint64_t)nValue;
+        while (n)
+        {
+            vch.push_back(n & 0xff);
+            n >>= 8;
+        }
+
+        // Make room for the sign bit if the top byte uses it
+        if (vch.back() & 0x80)
+            vch.push_back(fNegative ? 0x80 : 0);
+        else if (fNegative)
+            vch.back() |= 0x80;
+        return vch;
+    }
+};
+
+
 
 inline std::string ValueString(const std::vector<unsigned char>& vch)
 {
@@ -408,6 +518,12 @@ public:
         return *this;
     }
 
+    CScript& operator<<(const CScriptNum& b)
+    {
+        *this << b.getvch();
+        return *this;
+    }
+
     CScript& operator<<(const std::vector<unsigned char>& b)
     {
         if (b.size() < OP_PUSHDATA1)
@@ -711,10 +827,43 @@ public:
 };
 
 
+/**
+ * Signature hashes of one transaction's inputs, without copying and
+ * reserializing the whole transaction for each of them.
+ *
+ * For SIGHASH_ALL the legacy digest covers the transaction with every
+ * scriptSig blanked except the signed input's, which holds scriptCode. The
+ * bytes in front of input i's script are a prefix of the bytes in front of
+ * input i+1, so one pass over the blanked serialization records a SHA256
+ * midstate for every input; a signature hash then only hashes scriptCode and
+ * the rest of the blanked serialization. Other hash types are rare and fall
+ * back to SignatureHash().
+ *
+ * Only scriptSigs may change while this is in use, e.g. during signing.
+ */
+class CPrecomputedSighash
+{
+private:
+    const CTransaction* ptxTo;
+    std::vector<unsigned char> vchBlanked;  // serialization with empty scriptSigs
+    std::vector<unsigned int> vScriptPos;   // offset of each input's empty scriptSig
+    std::vector<SHA256_CTX> vMidstate;      // state after hashing up to vScriptPos[i]
+
+public:
+    explicit CPrecomputedSighash(const CTransaction& txToIn);
+
+    const CTransaction& GetTransaction() const { return *ptxTo; }
+
+    /** Same result as SignatureHash(scriptCode, txTo, nIn, nHashType) */
+    uint256 SignatureHash(const CScript& scriptCode, unsigned int nIn, int nHashType) const;
+};
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 bool IsDERSignature(const valtype &vchSig, bool haveHashType = true);
 bool IsLowDERSignature(const valtype &vchSig, bool haveHashType = true);
 bool IsCompressedOrUncompressedPubKey(const valtype &vchPubKey);
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                const CPrecomputedSighash* psighash = NULL, CSignatureBatch* pbatch = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
@@ -723,11 +872,23 @@ bool IsMine(const CKeyStore& keystore, const CTxDestination &dest);
 void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey, std::vector<CKeyID> &vKeys);
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL,
+                   const CPrecomputedSighash* psighash = NULL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL,
+                   const CPrecomputedSighash* psighash = NULL);
+/** With pbatch, signature checks whose failure would fail the script anyway
+ *  are added to the batch instead of being verified, and the script is only
+ *  valid if the batch later verifies (see VerifySignatureBatch) */
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                   unsigned int flags, int nHashType);
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+                   unsigned int flags, int nHashType, const CPrecomputedSighash* psighash = NULL, CSignatureBatch* pbatch = NULL);
+/** Verify the signature checks deferred by VerifyScript, remembering them in
+ *  the signature cache unless flags has SCRIPT_VERIFY_NOCACHE */
+bool VerifySignatureBatch(const CSignatureBatch& batch, unsigned int flags, size_t* pnFailed = NULL);
+/** Number of VerifyScript calls that were decided by the standard template
+ *  fast paths and that needed the script interpreter */
+void GetScriptStats(uint64_t& nTemplate, uint64_t& nInterpreted);
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                     const CPrecomputedSighash* psighash = NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
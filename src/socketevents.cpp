@@ -0,0 +1,150 @@
+// Copyright (c) 2017 The Rpicoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include "util.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define USE_EPOLL 1
+#endif
+
+using namespace std;
+
+// Events taken from the kernel per epoll_wait
+static const int MAX_SOCKET_EVENTS = 256;
+
+CSocketEvents::CSocketEvents()
+{
+    fdEpoll = -1;
+    fdWake = -1;
+#ifdef USE_EPOLL
+    fdEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (fdEpoll == -1)
+    {
+        LogPrintf("CSocketEvents() : epoll_create1 failed: %s\n", strerror(errno));
+        return;
+    }
+    fdWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fdWake == -1)
+    {
+        LogPrintf("CSocketEvents() : eventfd failed: %s\n", strerror(errno));
+        close(fdEpoll);
+        fdEpoll = -1;
+        return;
+    }
+
+    // The wakeup counter is level triggered, Wait() reads it back to zero
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = this;
+    if (epoll_ctl(fdEpoll, EPOLL_CTL_ADD, fdWake, &event) == -1)
+    {
+        LogPrintf("CSocketEvents() : epoll_ctl failed: %s\n", strerror(errno));
+        close(fdWake);
+        close(fdEpoll);
+        fdWake = fdEpoll = -1;
+    }
+#endif
+}
+
+CSocketEvents::~CSocketEvents()
+{
+#ifdef USE_EPOLL
+    if (fdWake != -1)
+        close(fdWake);
+    if (fdEpoll != -1)
+        close(fdEpoll);
+#endif
+}
+
+bool CSocketEvents::IsValid() const
+{
+    return fdEpoll != -1;
+}
+
+bool CSocketEvents::Add(SOCKET hSocket, void* pcookie, bool fListen)
+{
+#ifdef USE_EPOLL
+    if (!IsValid())
+        return false;
+    struct epoll_event event;
+    event.events = fListen ? EPOLLIN : (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    event.data.ptr = pcookie;
+    // Already there with another cookie if the socket number was reused
+    // while it was being added
+    if (epoll_ctl(fdEpoll, EPOLL_CTL_ADD, hSocket, &event) == -1 &&
+        (errno != EEXIST || epoll_ctl(fdEpoll, EPOLL_CTL_MOD, hSocket, &event) == -1))
+        return error("CSocketEvents::Add() : epoll_ctl failed for socket %d: %s", (int)hSocket, strerror(errno));
+    return true;
+#else
+    return false;
+#endif
+}
+
+void CSocketEvents::Remove(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    // Closing the socket removes it as well
+    if (IsValid())
+        epoll_ctl(fdEpoll, EPOLL_CTL_DEL, hSocket, NULL);
+#endif
+}
+
+bool CSocketEvents::Wait(int nTimeout, vector<CEvent>& vEvents)
+{
+    vEvents.clear();
+#ifdef USE_EPOLL
+    if (!IsValid())
+        return false;
+
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    int nEvents = epoll_wait(fdEpoll, events, MAX_SOCKET_EVENTS, nTimeout);
+    if (nEvents == -1)
+    {
+        if (errno == EINTR)
+            return true;
+        return error("CSocketEvents::Wait() : epoll_wait failed: %s", strerror(errno));
+    }
+
+    vEvents.reserve(nEvents);
+    for (int i = 0; i < nEvents; i++)
+    {
+        if (events[i].data.ptr == this)
+        {
+            uint64_t nCount;
+            if (read(fdWake, &nCount, sizeof(nCount)) != sizeof(nCount) && errno != EAGAIN)
+                LogPrintf("CSocketEvents::Wait() : eventfd read failed: %s\n", strerror(errno));
+            continue;
+        }
+
+        CEvent event;
+        event.pcookie = events[i].data.ptr;
+        event.nEvents = 0;
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+            event.nEvents |= EVENT_RECV;
+        if (events[i].events & EPOLLOUT)
+            event.nEvents |= EVENT_SEND;
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+            event.nEvents |= EVENT_ERROR;
+        vEvents.push_back(event);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void CSocketEvents::Wake()
+{
+#ifdef USE_EPOLL
+    if (!IsValid())
+        return;
+    uint64_t nOne = 1;
+    if (write(fdWake, &nOne, sizeof(nOne)) != sizeof(nOne) && errno != EAGAIN)
+        LogPrintf("CSocketEvents::Wake() : eventfd write failed: %s\n", strerror(errno));
+#endif
+}
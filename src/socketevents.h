@@ -0,0 +1,63 @@
+// Copyright (c) 2017 The Rpicoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SOCKETEVENTS_H
+#define BITCOIN_SOCKETEVENTS_H
+
+#include "compat.h"
+
+#include <vector>
+
+/**
+ * Readiness of a set of sockets, reported by epoll where it is available.
+ *
+ * Sockets are registered once, not for every wait. Peer sockets are edge
+ * triggered: an event only says that a socket became readable or writable,
+ * so the caller has to remember that until recv or send would block. Wake()
+ * makes a Wait() in another thread return at once, which lets a thread
+ * queueing data get it sent without waiting out the timeout.
+ *
+ * Where epoll is missing IsValid() is false and the callers go on using
+ * select().
+ */
+class CSocketEvents
+{
+public:
+    enum
+    {
+        EVENT_RECV = 1,
+        EVENT_SEND = 2,
+        EVENT_ERROR = 4,
+    };
+
+    struct CEvent
+    {
+        void* pcookie;          // as passed to Add()
+        unsigned int nEvents;   // EVENT_ flags
+    };
+
+    CSocketEvents();
+    ~CSocketEvents();
+
+    bool IsValid() const;
+
+    /** Watch hSocket until it is closed, or removed. Peer sockets are
+        watched for recv and send, edge triggered; listening sockets only
+        for recv, reported for as long as connections are pending */
+    bool Add(SOCKET hSocket, void* pcookie, bool fListen = false);
+    void Remove(SOCKET hSocket);
+
+    /** Wait up to nTimeout milliseconds for events, or for Wake() */
+    bool Wait(int nTimeout, std::vector<CEvent>& vEvents);
+    void Wake();
+
+private:
+    int fdEpoll;
+    int fdWake;
+
+    // not copyable
+    CSocketEvents(const CSocketEvents&);
+    CSocketEvents& operator=(const CSocketEvents&);
+};
+
+#endif // BITCOIN_SOCKETEVENTS_H
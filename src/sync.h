@@ -12,6 +12,7 @@
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/thread_time.hpp>
 
 
 ////////////////////////////////////////////////
@@ -204,6 +205,40 @@ public:
     }
 };
 
+/** Wakes a thread waiting for work. A Wake() while nobody waits is kept
+    for the next Wait(), so no work announced in between is missed */
+class CWakeup
+{
+private:
+    boost::condition_variable condition;
+    boost::mutex mutex;
+    bool fWoken;
+
+public:
+    CWakeup() : fWoken(false) {}
+
+    void Wake() {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fWoken = true;
+        }
+        condition.notify_one();
+    }
+
+    // Wait for Wake() at most nMillis milliseconds, returns whether woken
+    bool Wait(int64_t nMillis) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(nMillis);
+        while (!fWoken) {
+            if (!condition.timed_wait(lock, deadline))
+                break;
+        }
+        bool fRet = fWoken;
+        fWoken = false;
+        return fRet;
+    }
+};
+
 /** RAII-style semaphore lock */
 class CSemaphoreGrant
 {
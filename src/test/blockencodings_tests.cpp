@@ -0,0 +1,198 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bignum.h"
+#include "blockencodings.h"
+#include "hash.h"
+#include "main.h"
+#include "txmempool.h"
+#include "util.h"
+
+using namespace std;
+
+static CTransaction MakeTransaction()
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1 * COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+// A proof-of-stake block with nTx transactions after the coinbase and the
+// coinstake
+static CBlock MakeBlock(int nTx)
+{
+    CBlock block;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = GetAdjustedTime();
+    block.nBits = CBigNum(~uint256(0) >> 48).GetCompact();
+
+    CTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vin[0].scriptSig = CScript() << 3000000 << OP_0;
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].SetEmpty();
+    block.vtx.push_back(txCoinBase);
+
+    CTransaction txCoinStake = MakeTransaction();
+    txCoinStake.vout.resize(2);
+    txCoinStake.vout[0].SetEmpty();
+    txCoinStake.vout[1].nValue = 1000 * COIN;
+    txCoinStake.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx.push_back(txCoinStake);
+
+    for (int i = 0; i < nTx; i++)
+        block.vtx.push_back(MakeTransaction());
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.vchBlockSig.assign(72, 0x30);
+    return block;
+}
+
+static void AddToPool(CTxMemPool& pool, const CTransaction& tx)
+{
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, nSize, GetTime(), 0));
+}
+
+// Through the wire, as the receiver sees it
+static CBlockHeaderAndShortTxIDs SendReceive(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CBlockHeaderAndShortTxIDs cmpctblockRecv;
+    ss >> cmpctblockRecv;
+    return cmpctblockRecv;
+}
+
+static bool SameBlock(const CBlock& a, const CBlock& b)
+{
+    if (a.GetHash() != b.GetHash() || a.vtx.size() != b.vtx.size() || a.vchBlockSig != b.vchBlockSig)
+        return false;
+    for (unsigned int i = 0; i < a.vtx.size(); i++)
+        if (a.vtx[i].GetHash() != b.vtx[i].GetHash())
+            return false;
+    return true;
+}
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+BOOST_AUTO_TEST_CASE(blockencodings_siphash)
+{
+    // From the reference implementation's test vectors
+    const uint64_t k0 = 0x0706050403020100ULL, k1 = 0x0F0E0D0C0B0A0908ULL;
+    uint256 val("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    BOOST_CHECK_EQUAL(SipHashUint256(k0, k1, val), 0x7127512f72f27cceULL);
+}
+
+BOOST_AUTO_TEST_CASE(blockencodings_from_pool)
+{
+    CBlock block = MakeBlock(20);
+    CTxMemPool pool;
+    for (unsigned int i = 2; i < block.vtx.size(); i++)
+        AddToPool(pool, block.vtx[i]);
+    // Others in the pool make no difference
+    for (int i = 0; i < 100; i++)
+        AddToPool(pool, MakeTransaction());
+
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTxn.size(), 2);
+    BOOST_CHECK_EQUAL(cmpctblock.vShortTxIDs.size(), 20);
+
+    CBlockHeaderAndShortTxIDs cmpctblockRecv = SendReceive(cmpctblock);
+    BOOST_CHECK(cmpctblockRecv.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctblockRecv.GetShortID(block.vtx[5].GetHash()) == cmpctblock.GetShortID(block.vtx[5].GetHash()));
+
+    CPartialBlock partial;
+    BOOST_CHECK_EQUAL(partial.Init(cmpctblockRecv, pool), CPartialBlock::READ_STATUS_OK);
+    BOOST_CHECK(partial.IsComplete());
+    BOOST_CHECK_EQUAL(partial.nFromPool, 20);
+
+    CBlock blockRecv;
+    BOOST_CHECK_EQUAL(partial.FillBlock(blockRecv, vector<CTransaction>()), CPartialBlock::READ_STATUS_OK);
+    BOOST_CHECK(SameBlock(blockRecv, block));
+
+    unsigned int nFullSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    unsigned int nCompactSize = ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(nCompactSize < nFullSize / 4);
+    BOOST_TEST_MESSAGE(strprintf("block of %u transactions: %u bytes, %u as a compact block",
+        block.vtx.size(), nFullSize, nCompactSize));
+}
+
+BOOST_AUTO_TEST_CASE(blockencodings_missing)
+{
+    CBlock block = MakeBlock(20);
+    CTxMemPool pool;
+    for (unsigned int i = 2; i < block.vtx.size(); i++)
+        if (i != 7 && i != 14)
+            AddToPool(pool, block.vtx[i]);
+
+    CPartialBlock partial;
+    BOOST_CHECK_EQUAL(partial.Init(SendReceive(CBlockHeaderAndShortTxIDs(block)), pool), CPartialBlock::READ_STATUS_OK);
+    BOOST_CHECK(!partial.IsComplete());
+
+    CBlockTransactionsRequest req;
+    req.blockhash = block.GetHash();
+    partial.GetMissing(req.vIndexes);
+    BOOST_REQUIRE_EQUAL(req.vIndexes.size(), 2);
+    BOOST_CHECK_EQUAL(req.vIndexes[0], 7);
+    BOOST_CHECK_EQUAL(req.vIndexes[1], 14);
+
+    // The request and the answer go through the wire as well
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << req;
+    CBlockTransactionsRequest reqRecv;
+    ss >> reqRecv;
+    BOOST_CHECK(reqRecv.blockhash == req.blockhash);
+    BOOST_CHECK(reqRecv.vIndexes == req.vIndexes);
+    ss << CBlockTransactions(block, reqRecv);
+    CBlockTransactions resp;
+    ss >> resp;
+    BOOST_REQUIRE_EQUAL(resp.vtx.size(), 2);
+
+    CBlock blockRecv;
+    vector<CTransaction> vMissing;
+    vMissing.push_back(resp.vtx[0]);
+    BOOST_CHECK_EQUAL(partial.FillBlock(blockRecv, vMissing), CPartialBlock::READ_STATUS_INVALID);
+    vMissing.push_back(resp.vtx[1]);
+    vMissing.push_back(MakeTransaction());
+    BOOST_CHECK_EQUAL(partial.FillBlock(blockRecv, vMissing), CPartialBlock::READ_STATUS_INVALID);
+
+    // The wrong transactions do not make the block
+    vMissing[0] = resp.vtx[1];
+    vMissing[1] = resp.vtx[0];
+    vMissing.pop_back();
+    BOOST_CHECK_EQUAL(partial.FillBlock(blockRecv, vMissing), CPartialBlock::READ_STATUS_FAILED);
+
+    BOOST_CHECK_EQUAL(partial.FillBlock(blockRecv, resp.vtx), CPartialBlock::READ_STATUS_OK);
+    BOOST_CHECK(SameBlock(blockRecv, block));
+}
+
+BOOST_AUTO_TEST_CASE(blockencodings_invalid)
+{
+    CBlock block = MakeBlock(5);
+    CTxMemPool pool;
+    CPartialBlock partial;
+
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.vPrefilledTxn[1].nIndex = 10;
+    BOOST_CHECK_EQUAL(partial.Init(SendReceive(cmpctblock), pool), CPartialBlock::READ_STATUS_INVALID);
+
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    swap(cmpctblock.vPrefilledTxn[0], cmpctblock.vPrefilledTxn[1]);
+    BOOST_CHECK_EQUAL(partial.Init(SendReceive(cmpctblock), pool), CPartialBlock::READ_STATUS_INVALID);
+
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    cmpctblock.vShortTxIDs.clear();
+    cmpctblock.vPrefilledTxn.clear();
+    BOOST_CHECK_EQUAL(partial.Init(SendReceive(cmpctblock), pool), CPartialBlock::READ_STATUS_INVALID);
+
+    // Two transactions of the block with the same short id
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    cmpctblock.vShortTxIDs[3] = cmpctblock.vShortTxIDs[1];
+    BOOST_CHECK_EQUAL(partial.Init(SendReceive(cmpctblock), pool), CPartialBlock::READ_STATUS_FAILED);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,177 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include "blockfile.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// Append nCount transactions to block file nFile in pathDir, returning their offsets
+static vector<unsigned int> AppendTransactions(const boost::filesystem::path& pathDir, unsigned int nFile, int nCount, vector<CTransaction>& vtxRet)
+{
+    vector<unsigned int> vPos;
+    string strPath = (pathDir / strprintf("rpi%04u.dat", nFile)).string();
+    CAutoFile fileout = CAutoFile(fopen(strPath.c_str(), "ab"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(fileout);
+    fseek(fileout, 0, SEEK_END);
+    for (int i = 0; i < nCount; i++)
+    {
+        CTransaction tx;
+        tx.nTime = 1500000000 + i;
+        tx.vin.resize(1 + i % 3);
+        for (unsigned int j = 0; j < tx.vin.size(); j++)
+        {
+            tx.vin[j].prevout.hash = GetRandHash();
+            tx.vin[j].prevout.n = j;
+            tx.vin[j].scriptSig << vector<unsigned char>(72, (unsigned char)i);
+        }
+        tx.vout.resize(2);
+        tx.vout[0].nValue = i * COIN;
+        tx.vout[0].scriptPubKey << OP_DUP << OP_HASH160 << vector<unsigned char>(20, (unsigned char)i) << OP_EQUALVERIFY << OP_CHECKSIG;
+        tx.vout[1].nValue = CENT;
+        tx.vout[1].scriptPubKey << OP_RETURN;
+
+        vPos.push_back(ftell(fileout));
+        fileout << tx;
+        vtxRet.push_back(tx);
+    }
+    return vPos;
+}
+
+// The pre-mmap read path: open, seek and deserialize for every transaction
+static bool ReadWithStdio(const boost::filesystem::path& pathDir, unsigned int nFile, unsigned int nPos, CTransaction& tx)
+{
+    string strPath = (pathDir / strprintf("rpi%04u.dat", nFile)).string();
+    CAutoFile filein = CAutoFile(fopen(strPath.c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein || fseek(filein, nPos, SEEK_SET) != 0)
+        return false;
+    filein >> tx;
+    return true;
+}
+
+struct BlockFileSetup
+{
+    boost::filesystem::path pathDir;
+
+    BlockFileSetup()
+    {
+        pathDir = boost::filesystem::temp_directory_path() / strprintf("test_rpicoin_blockfile_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+        boost::filesystem::create_directories(pathDir);
+    }
+    ~BlockFileSetup()
+    {
+        boost::filesystem::remove_all(pathDir);
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(blockfile_tests, BlockFileSetup)
+
+BOOST_AUTO_TEST_CASE(blockfile_read_matches_stdio)
+{
+    CBlockFileManager files(0, pathDir);
+    vector<CTransaction> vtx;
+    vector<unsigned int> vPos = AppendTransactions(pathDir, 1, 1000, vtx);
+
+    for (unsigned int i = 0; i < vPos.size(); i++)
+    {
+        CTransaction txOld, txNew;
+        BOOST_CHECK(ReadWithStdio(pathDir, 1, vPos[i], txOld));
+        BOOST_CHECK(files.Read(1, vPos[i], txNew));
+        BOOST_CHECK(txOld.GetHash() == vtx[i].GetHash());
+        BOOST_CHECK(txNew.GetHash() == vtx[i].GetHash());
+    }
+
+    // Out of range offsets and missing files fail cleanly
+    CTransaction tx;
+    BOOST_CHECK(!files.Read(1, 0x7F000000, tx));
+    BOOST_CHECK(!files.Read(2, 0, tx));
+    BOOST_CHECK(!files.Read(0, 0, tx));
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_growth_and_lru)
+{
+    CBlockFileManager files(1, pathDir);
+    vector<CTransaction> vtx;
+    vector<unsigned int> vPos = AppendTransactions(pathDir, 1, 10, vtx);
+
+    CTransaction tx;
+    BOOST_CHECK(files.Read(1, vPos[0], tx));
+
+    // Appending after the file was mapped must not hide the new data
+    vector<unsigned int> vPosMore = AppendTransactions(pathDir, 1, 10, vtx);
+    BOOST_CHECK(files.Read(1, vPosMore[9], tx));
+    BOOST_CHECK(tx.GetHash() == vtx[19].GetHash());
+
+    // Only nMaxMaps files stay mapped
+    vector<CTransaction> vtx2;
+    vector<unsigned int> vPos2 = AppendTransactions(pathDir, 2, 10, vtx2);
+    BOOST_CHECK(files.Read(2, vPos2[5], tx));
+    BOOST_CHECK(tx.GetHash() == vtx2[5].GetHash());
+    BOOST_CHECK(files.MappedFiles() == 1);
+    BOOST_CHECK(files.Read(1, vPos[5], tx));
+    BOOST_CHECK(tx.GetHash() == vtx[5].GetHash());
+    BOOST_CHECK(files.MappedFiles() == 1);
+
+    files.Clear();
+    BOOST_CHECK(files.MappedFiles() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_stdio_fallback)
+{
+    vector<CTransaction> vtx;
+    vector<unsigned int> vPos = AppendTransactions(pathDir, 1, 10, vtx);
+
+    // Too big to map from the start
+    CBlockFileManager files(0, pathDir, 100);
+    CTransaction tx;
+    BOOST_CHECK(files.Read(1, vPos[3], tx));
+    BOOST_CHECK(tx.GetHash() == vtx[3].GetHash());
+    BOOST_CHECK(files.MappedFiles() == 0);
+    BOOST_CHECK(!files.Read(1, 0x7F000000, tx));
+
+    // Grown too big to map again
+    CBlockFileManager filesGrow(0, pathDir, vPos.back() + 1000);
+    BOOST_CHECK(filesGrow.Read(1, vPos[9], tx));
+    BOOST_CHECK(filesGrow.MappedFiles() == 1);
+    vector<unsigned int> vPosMore = AppendTransactions(pathDir, 1, 10, vtx);
+    BOOST_CHECK(filesGrow.Read(1, vPosMore[9], tx));
+    BOOST_CHECK(tx.GetHash() == vtx[19].GetHash());
+    BOOST_CHECK(filesGrow.MappedFiles() == 0);
+    BOOST_CHECK(filesGrow.Read(1, vPos[0], tx));
+    BOOST_CHECK(tx.GetHash() == vtx[0].GetHash());
+}
+
+// Rough comparison of the FetchInputs read pattern (random previous
+// transactions) served by fopen/fseek versus the mapped files
+BOOST_AUTO_TEST_CASE(blockfile_fetchinputs_bench)
+{
+    CBlockFileManager files(0, pathDir);
+    vector<CTransaction> vtx;
+    vector<unsigned int> vPos = AppendTransactions(pathDir, 1, 5000, vtx);
+
+    vector<unsigned int> vOrder;
+    for (int i = 0; i < 20000; i++)
+        vOrder.push_back(GetRandInt(vPos.size()));
+
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < vOrder.size(); i++)
+    {
+        CTransaction tx;
+        BOOST_REQUIRE(ReadWithStdio(pathDir, 1, vPos[vOrder[i]], tx));
+    }
+    int64_t nStdio = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < vOrder.size(); i++)
+    {
+        CTransaction tx;
+        BOOST_REQUIRE(files.Read(1, vPos[vOrder[i]], tx));
+    }
+    int64_t nMapped = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("blockfile: %u reads, stdio %.2fms, mmap %.2fms",
+        (unsigned int)vOrder.size(), nStdio * 0.001, nMapped * 0.001));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
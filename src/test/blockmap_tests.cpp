@@ -0,0 +1,118 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockmap.h"
+#include "main.h"
+#include "util.h"
+
+#include <map>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockmap_tests)
+
+BOOST_AUTO_TEST_CASE(blockmap_insert_find)
+{
+    CBlockMap map;
+    CArena<CBlockIndex> arena(100);
+    std::map<uint256, CBlockIndex*> mapRef;
+    vector<const uint256*> vKeys;
+
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.begin() == map.end());
+    BOOST_CHECK(map.find(GetRandHash()) == map.end());
+
+    for (int i = 0; i < 10000; i++)
+    {
+        uint256 hash = GetRandHash();
+        CBlockIndex* pindex = new (arena.Allocate()) CBlockIndex();
+        pindex->nHeight = i;
+        pair<CBlockMap::iterator, bool> ret = map.insert(make_pair(hash, pindex));
+        BOOST_CHECK(ret.second);
+        pindex->phashBlock = &ret.first->first;
+        vKeys.push_back(pindex->phashBlock);
+        mapRef[hash] = pindex;
+
+        // Inserting again keeps the first entry
+        ret = map.insert(make_pair(hash, (CBlockIndex*)NULL));
+        BOOST_CHECK(!ret.second);
+        BOOST_CHECK(ret.first->second == pindex);
+    }
+    BOOST_CHECK(map.size() == 10000);
+
+    // Keys do not move while the table grows
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+    {
+        CBlockMap::iterator mi = map.find(*vKeys[i]);
+        BOOST_CHECK(mi != map.end());
+        BOOST_CHECK(&mi->first == vKeys[i]);
+        BOOST_CHECK(mi->second->nHeight == (int)i);
+        BOOST_CHECK(map.at(*vKeys[i]) == mi->second);
+    }
+
+    // Iteration visits every entry once
+    unsigned int nVisited = 0;
+    BOOST_FOREACH(const CBlockMap::value_type& item, map)
+    {
+        BOOST_CHECK(mapRef[item.first] == item.second);
+        nVisited++;
+    }
+    BOOST_CHECK(nVisited == mapRef.size());
+
+    uint256 hashMissing = GetRandHash();
+    BOOST_CHECK(map.count(hashMissing) == 0);
+    BOOST_CHECK_THROW(map.at(hashMissing), std::out_of_range);
+    BOOST_CHECK(map[hashMissing] == NULL);
+    BOOST_CHECK(map.count(hashMissing) == 1);
+    BOOST_CHECK(map.size() == 10001);
+}
+
+// Rough memory and lookup comparison of the arena and hash table against
+// heap allocated entries in a std::map
+BOOST_AUTO_TEST_CASE(blockmap_bench)
+{
+    const int nEntries = 200000;
+    const int nLookups = 1000000;
+
+    vector<uint256> vHashes;
+    for (int i = 0; i < nEntries; i++)
+        vHashes.push_back(GetRandHash());
+    vector<unsigned int> vOrder;
+    for (int i = 0; i < nLookups; i++)
+        vOrder.push_back(GetRandInt(nEntries));
+
+    std::map<uint256, CBlockIndex*> mapOld;
+    for (int i = 0; i < nEntries; i++)
+        mapOld.insert(make_pair(vHashes[i], new CBlockIndex()));
+
+    CBlockMap mapNew;
+    CArena<CBlockIndex> arena;
+    mapNew.reserve(nEntries);
+    for (int i = 0; i < nEntries; i++)
+        mapNew.insert(make_pair(vHashes[i], new (arena.Allocate()) CBlockIndex()));
+
+    int64_t nSum = 0;
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nLookups; i++)
+        nSum += mapOld.find(vHashes[vOrder[i]])->second->nHeight;
+    int64_t nOld = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nLookups; i++)
+        nSum += mapNew.find(vHashes[vOrder[i]])->second->nHeight;
+    int64_t nNew = GetTimeMicros() - nStart;
+    BOOST_CHECK(nSum == 0);
+
+    // A red-black tree node carries three pointers and a color on top of its
+    // value, and every heap block has about two words of allocator overhead
+    size_t nOldBytes = nEntries * (sizeof(std::map<uint256, CBlockIndex*>::value_type) + 4 * sizeof(void*) + 2 * sizeof(void*) +
+                                   sizeof(CBlockIndex) + 2 * sizeof(void*));
+    size_t nNewBytes = mapNew.DynamicMemoryUsage() + arena.DynamicMemoryUsage();
+
+    BOOST_TEST_MESSAGE(strprintf("blockmap: %d entries, %d lookups, std::map %.2fms ~%uKB, CBlockMap %.2fms %uKB",
+        nEntries, nLookups, nOld * 0.001, (unsigned int)(nOldBytes / 1024), nNew * 0.001, (unsigned int)(nNewBytes / 1024)));
+
+    for (std::map<uint256, CBlockIndex*>::iterator mi = mapOld.begin(); mi != mapOld.end(); ++mi)
+        delete mi->second;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
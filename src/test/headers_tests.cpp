@@ -0,0 +1,247 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bignum.h"
+#include "kernel.h"
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+// Past the checkpoints and the proof-of-work blocks
+static const int nBaseHeight = 3000000;
+
+static unsigned int StakeBits()
+{
+    return CBigNum(~uint256(0) >> 48).GetCompact();
+}
+
+// A block of ours for the headers to follow
+static CBlockIndex* AddBlockIndex(const uint256& hash, int nHeight, unsigned int nTime)
+{
+    CBlockIndex* pindex = new CBlockIndex();
+    pindex->nHeight = nHeight;
+    pindex->nTime = nTime;
+    pair<CBlockMap::iterator, bool> ret = mapBlockIndex.insert(make_pair(hash, pindex));
+    pindex->phashBlock = &ret.first->first;
+    return pindex;
+}
+
+static vector<CBlock> MakeHeaders(const uint256& hashPrev, unsigned int nTimePrev, int nCount)
+{
+    vector<CBlock> vHeaders;
+    uint256 hash = hashPrev;
+    unsigned int nTime = nTimePrev;
+    for (int i = 0; i < nCount; i++)
+    {
+        CBlock header;
+        header.nVersion = CBlock::CURRENT_VERSION;
+        header.hashPrevBlock = hash;
+        header.hashMerkleRoot = GetRandHash();
+        nTime += 64;
+        header.nTime = nTime;
+        header.nBits = StakeBits();
+        header.nNonce = 0;
+        vHeaders.push_back(header);
+        hash = header.GetHash();
+    }
+    return vHeaders;
+}
+
+static unsigned int BaseTime()
+{
+    return (GetAdjustedTime() - 100000) & ~STAKE_TIMESTAMP_MASK;
+}
+
+BOOST_AUTO_TEST_SUITE(headers_tests)
+
+BOOST_AUTO_TEST_CASE(headers_extend)
+{
+    LOCK(cs_main);
+    unsigned int nTime = BaseTime();
+    CBlockIndex* pindexBase = AddBlockIndex(GetRandHash(), nBaseHeight, nTime);
+    CHeaderChain chain;
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    int nDoS;
+
+    vector<CBlock> vHeaders = MakeHeaders(pindexBase->GetBlockHash(), nTime, 10);
+    BOOST_CHECK(chain.AddHeaders(vHeaders, &node, nDoS));
+    BOOST_CHECK_EQUAL(chain.size(), 10);
+    BOOST_CHECK_EQUAL(chain.Height(), nBaseHeight + 10);
+    for (int i = 0; i < 10; i++)
+    {
+        BOOST_CHECK_EQUAL(chain.Find(vHeaders[i].GetHash()), i);
+        BOOST_CHECK_EQUAL(chain[i].nHeight, nBaseHeight + 1 + i);
+    }
+    BOOST_CHECK_EQUAL(chain.Find(pindexBase->GetBlockHash()), -1);
+
+    // The next message goes on from the last header
+    vector<CBlock> vMore = MakeHeaders(vHeaders.back().GetHash(), vHeaders.back().nTime, 5);
+    BOOST_CHECK(chain.AddHeaders(vMore, &node, nDoS));
+    BOOST_CHECK_EQUAL(chain.Height(), nBaseHeight + 15);
+    BOOST_CHECK_EQUAL(chain.Find(vMore[4].GetHash()), 14);
+
+    // Headers that follow nothing of ours are left
+    vector<CBlock> vStray = MakeHeaders(GetRandHash(), nTime, 20);
+    BOOST_CHECK(chain.AddHeaders(vStray, &node, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 0);
+    BOOST_CHECK_EQUAL(chain.Height(), nBaseHeight + 15);
+}
+
+BOOST_AUTO_TEST_CASE(headers_rejected)
+{
+    LOCK(cs_main);
+    unsigned int nTime = BaseTime();
+    CBlockIndex* pindexBase = AddBlockIndex(GetRandHash(), nBaseHeight, nTime);
+    CHeaderChain chain;
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    int nDoS;
+
+    // Not following each other
+    vector<CBlock> vHeaders = MakeHeaders(pindexBase->GetBlockHash(), nTime, 5);
+    vHeaders[3].hashPrevBlock = GetRandHash();
+    BOOST_CHECK(!chain.AddHeaders(vHeaders, &node, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 20);
+
+    // Proof-of-stake timestamps are on the coinstake grid
+    vHeaders = MakeHeaders(pindexBase->GetBlockHash(), nTime, 1);
+    vHeaders[0].nTime += 1;
+    BOOST_CHECK(!chain.AddHeaders(vHeaders, &node, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 50);
+
+    // A target easier than proof-of-stake allows
+    vHeaders = MakeHeaders(pindexBase->GetBlockHash(), nTime, 1);
+    vHeaders[0].nBits = CBigNum(~uint256(0) >> 8).GetCompact();
+    BOOST_CHECK(!chain.AddHeaders(vHeaders, &node, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+
+    vHeaders = MakeHeaders(pindexBase->GetBlockHash(), nTime, 1);
+    vHeaders[0].nVersion = CBlock::CURRENT_VERSION + 1;
+    BOOST_CHECK(!chain.AddHeaders(vHeaders, &node, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+
+    // Timestamps go forward, and not into the future
+    vHeaders = MakeHeaders(pindexBase->GetBlockHash(), nTime - 64, 1);
+    BOOST_CHECK(!chain.AddHeaders(vHeaders, &node, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 0);
+    vHeaders = MakeHeaders(pindexBase->GetBlockHash(), (GetAdjustedTime() + 3600) & ~STAKE_TIMESTAMP_MASK, 1);
+    BOOST_CHECK(!chain.AddHeaders(vHeaders, &node, nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 0);
+
+    BOOST_CHECK(chain.IsEmpty());
+}
+
+BOOST_AUTO_TEST_CASE(headers_fork)
+{
+    LOCK(cs_main);
+    unsigned int nTime = BaseTime();
+    CBlockIndex* pindexBase = AddBlockIndex(GetRandHash(), nBaseHeight, nTime);
+    CHeaderChain chain;
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    int nDoS;
+
+    vector<CBlock> vHeaders = MakeHeaders(pindexBase->GetBlockHash(), nTime, 10);
+    BOOST_CHECK(chain.AddHeaders(vHeaders, &node, nDoS));
+
+    // A branch that does not get further is left
+    vector<CBlock> vShort = MakeHeaders(vHeaders[4].GetHash(), vHeaders[4].nTime, 5);
+    BOOST_CHECK(chain.AddHeaders(vShort, &node, nDoS));
+    BOOST_CHECK_EQUAL(chain.Find(vShort[0].GetHash()), -1);
+    BOOST_CHECK_EQUAL(chain.Find(vHeaders[9].GetHash()), 9);
+
+    // One that does replaces ours from where it branches off
+    vector<CBlock> vLong = MakeHeaders(vHeaders[4].GetHash(), vHeaders[4].nTime, 8);
+    BOOST_CHECK(chain.AddHeaders(vLong, &node, nDoS));
+    BOOST_CHECK_EQUAL(chain.Height(), nBaseHeight + 13);
+    BOOST_CHECK_EQUAL(chain.Find(vHeaders[4].GetHash()), 4);
+    BOOST_CHECK_EQUAL(chain.Find(vHeaders[5].GetHash()), -1);
+    BOOST_CHECK_EQUAL(chain.Find(vLong[7].GetHash()), 12);
+
+    // As does one branching off a block of ours
+    CBlockIndex* pindexOther = AddBlockIndex(GetRandHash(), nBaseHeight - 1, nTime - 64);
+    vector<CBlock> vOther = MakeHeaders(pindexOther->GetBlockHash(), pindexOther->nTime, 20);
+    BOOST_CHECK(chain.AddHeaders(vOther, &node, nDoS));
+    BOOST_CHECK_EQUAL(chain.Height(), nBaseHeight + 19);
+    BOOST_CHECK_EQUAL(chain.Find(vOther[0].GetHash()), 0);
+    BOOST_CHECK_EQUAL(chain.Find(vLong[7].GetHash()), -1);
+}
+
+BOOST_AUTO_TEST_CASE(headers_other_peer)
+{
+    LOCK(cs_main);
+    unsigned int nTime = BaseTime();
+    CBlockIndex* pindexBase = AddBlockIndex(GetRandHash(), nBaseHeight, nTime);
+    CHeaderChain chain;
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    CNode nodeOther(INVALID_SOCKET, CAddress(), "", true);
+    int nDoS;
+
+    vector<CBlock> vHeaders = MakeHeaders(pindexBase->GetBlockHash(), nTime, 10);
+    BOOST_CHECK(chain.AddHeaders(vHeaders, &node, nDoS));
+
+    // Made up headers from another peer do not replace ours, however far
+    // they get
+    vector<CBlock> vFake = MakeHeaders(vHeaders[4].GetHash(), vHeaders[4].nTime, 100);
+    BOOST_CHECK(chain.AddHeaders(vFake, &nodeOther, nDoS));
+    BOOST_CHECK_EQUAL(chain.Height(), nBaseHeight + 10);
+    BOOST_CHECK_EQUAL(chain.Find(vFake[0].GetHash()), -1);
+    vFake = MakeHeaders(pindexBase->GetBlockHash(), nTime, 100);
+    BOOST_CHECK(chain.AddHeaders(vFake, &nodeOther, nDoS));
+    BOOST_CHECK_EQUAL(chain.Find(vHeaders[0].GetHash()), 0);
+
+    // The same headers, and more after them, are taken from anyone
+    vector<CBlock> vMore = MakeHeaders(vHeaders.back().GetHash(), vHeaders.back().nTime, 5);
+    vector<CBlock> vAgain(vHeaders.begin() + 5, vHeaders.end());
+    vAgain.insert(vAgain.end(), vMore.begin(), vMore.end());
+    BOOST_CHECK(chain.AddHeaders(vAgain, &nodeOther, nDoS));
+    BOOST_CHECK_EQUAL(chain.Height(), nBaseHeight + 15);
+    BOOST_CHECK(chain[14].pfrom == &nodeOther);
+    BOOST_CHECK(chain[9].pfrom == &node);
+
+    // A peer that went away is no longer the sender of anything
+    chain.ForgetSource(&node);
+    BOOST_CHECK(chain[9].pfrom == NULL);
+    BOOST_CHECK(chain[14].pfrom == &nodeOther);
+
+    // Once ours are dropped, the other branch goes
+    chain.Truncate(vHeaders[0].GetHash());
+    BOOST_CHECK(chain.AddHeaders(vFake, &nodeOther, nDoS));
+    BOOST_CHECK_EQUAL(chain.Height(), nBaseHeight + 100);
+}
+
+BOOST_AUTO_TEST_CASE(headers_advance_truncate)
+{
+    LOCK(cs_main);
+    unsigned int nTime = BaseTime();
+    CBlockIndex* pindexBase = AddBlockIndex(GetRandHash(), nBaseHeight, nTime);
+    CHeaderChain chain;
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    int nDoS;
+
+    vector<CBlock> vHeaders = MakeHeaders(pindexBase->GetBlockHash(), nTime, 10);
+    BOOST_CHECK(chain.AddHeaders(vHeaders, &node, nDoS));
+
+    // The first blocks come in
+    for (int i = 0; i < 3; i++)
+        AddBlockIndex(vHeaders[i].GetHash(), nBaseHeight + 1 + i, vHeaders[i].nTime);
+    chain.Advance();
+    BOOST_CHECK_EQUAL(chain.size(), 7);
+    BOOST_CHECK_EQUAL(chain.Find(vHeaders[2].GetHash()), -1);
+    BOOST_CHECK_EQUAL(chain.Find(vHeaders[3].GetHash()), 0);
+    BOOST_CHECK_EQUAL(chain.Height(), nBaseHeight + 10);
+
+    // Headers for the blocks we have are skipped
+    vector<CBlock> vMore = MakeHeaders(vHeaders.back().GetHash(), vHeaders.back().nTime, 2);
+    vHeaders.insert(vHeaders.end(), vMore.begin(), vMore.end());
+    BOOST_CHECK(chain.AddHeaders(vector<CBlock>(vHeaders.begin() + 1, vHeaders.end()), &node, nDoS));
+    BOOST_CHECK_EQUAL(chain.Height(), nBaseHeight + 12);
+
+    // A block that is no good takes the headers after it along
+    chain.Truncate(vHeaders[6].GetHash());
+    BOOST_CHECK_EQUAL(chain.size(), 3);
+    BOOST_CHECK_EQUAL(chain.Height(), nBaseHeight + 6);
+    BOOST_CHECK_EQUAL(chain.Find(vHeaders[6].GetHash()), -1);
+    BOOST_CHECK_EQUAL(chain.Find(vHeaders[11].GetHash()), -1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
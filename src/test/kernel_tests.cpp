@@ -0,0 +1,388 @@
+#include <boost/test/unit_test.hpp>
+
+#include "kernel.h"
+#include "util.h"
+
+using namespace std;
+
+struct CKernelInput
+{
+    CTransaction txPrev;
+    COutPoint prevout;
+};
+
+static void RandomKernelInputs(vector<CKernelInput>& vInputs, int nInputs)
+{
+    vInputs.resize(nInputs);
+    for (int i = 0; i < nInputs; i++)
+    {
+        CKernelInput& input = vInputs[i];
+        input.txPrev.nTime = 1500000000 + GetRandInt(20000);
+        input.txPrev.vout.resize(1 + GetRandInt(3));
+        input.prevout = COutPoint(GetRandHash(), GetRandInt(input.txPrev.vout.size()));
+        input.txPrev.vout[input.prevout.n].nValue = (1 + GetRandInt(8)) * COIN / 4;
+    }
+}
+
+// What the search must find: the latest timestamp on the grid, then the
+// first input, that CheckStakeKernelHash accepts
+static bool SearchOneByOne(CBlockIndex* pindexPrev, unsigned int nBits, const vector<CKernelInput>& vInputs, int64_t nTimeBegin, int64_t nTimeEnd,
+                           size_t& nIndexRet, unsigned int& nTimeRet, uint256& hashProofRet)
+{
+    CBlock blockFrom;
+    for (int64_t nTime = nTimeEnd & ~(int64_t)STAKE_TIMESTAMP_MASK; nTime >= nTimeBegin; nTime -= STAKE_TIMESTAMP_MASK + 1)
+    {
+        for (size_t i = 0; i < vInputs.size(); i++)
+        {
+            // Earlier times are rejected, noisily
+            if (nTime < vInputs[i].txPrev.nTime)
+                continue;
+            uint256 hashProofOfStake, targetProofOfStake;
+            if (CheckStakeKernelHash(pindexPrev, nBits, blockFrom, 0, vInputs[i].txPrev, vInputs[i].prevout, nTime, hashProofOfStake, targetProofOfStake))
+            {
+                nIndexRet = i;
+                nTimeRet = nTime;
+                hashProofRet = hashProofOfStake;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Stake modifier selection as it was before the selection hashes were
+// computed once per candidate, with no shortcuts
+static int64_t ReferenceSelectionIntervalSection(int nSection)
+{
+    return (nModifierInterval * 63 / (63 + ((63 - nSection) * (MODIFIER_INTERVAL_RATIO - 1))));
+}
+
+static uint64_t ReferenceNextStakeModifier(const CBlockIndex* pindexPrev, bool& fGenerated)
+{
+    fGenerated = true;
+    if (!pindexPrev)
+        return 0;
+    fGenerated = false;
+
+    const CBlockIndex* pindexLast = pindexPrev;
+    while (pindexLast->pprev && !pindexLast->GeneratedStakeModifier())
+        pindexLast = pindexLast->pprev;
+    uint64_t nStakeModifier = pindexLast->nStakeModifier;
+    if (pindexLast->GetBlockTime() / nModifierInterval >= pindexPrev->GetBlockTime() / nModifierInterval)
+        return nStakeModifier;
+
+    int64_t nSelectionInterval = 0;
+    for (int nSection = 0; nSection < 64; nSection++)
+        nSelectionInterval += ReferenceSelectionIntervalSection(nSection);
+    int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
+
+    vector<pair<int64_t, uint256> > vSortedByTimestamp;
+    map<uint256, const CBlockIndex*> mapCandidates;
+    for (const CBlockIndex* pindex = pindexPrev; pindex && pindex->GetBlockTime() >= nSelectionIntervalStart; pindex = pindex->pprev)
+    {
+        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        mapCandidates[pindex->GetBlockHash()] = pindex;
+    }
+    sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
+
+    uint64_t nStakeModifierNew = 0;
+    int64_t nSelectionIntervalStop = nSelectionIntervalStart;
+    set<uint256> setSelected;
+    for (int nRound = 0; nRound < min(64, (int)vSortedByTimestamp.size()); nRound++)
+    {
+        nSelectionIntervalStop += ReferenceSelectionIntervalSection(nRound);
+        bool fSelected = false;
+        uint256 hashBest = 0;
+        const CBlockIndex* pindexSelected = NULL;
+        for (unsigned int i = 0; i < vSortedByTimestamp.size(); i++)
+        {
+            const CBlockIndex* pindex = mapCandidates[vSortedByTimestamp[i].second];
+            if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
+                break;
+            if (setSelected.count(pindex->GetBlockHash()))
+                continue;
+            CDataStream ss(SER_GETHASH, 0);
+            ss << pindex->hashProof << nStakeModifier;
+            uint256 hashSelection = Hash(ss.begin(), ss.end());
+            if (pindex->IsProofOfStake())
+                hashSelection >>= 32;
+            if (!fSelected || hashSelection < hashBest)
+            {
+                fSelected = true;
+                hashBest = hashSelection;
+                pindexSelected = pindex;
+            }
+        }
+        nStakeModifierNew |= ((uint64_t)pindexSelected->GetStakeEntropyBit()) << nRound;
+        setSelected.insert(pindexSelected->GetBlockHash());
+    }
+    fGenerated = true;
+    return nStakeModifierNew;
+}
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+// A made up chain with timestamps that sometimes go backwards, as real ones
+// may, and a competing block at every height
+BOOST_AUTO_TEST_CASE(kernel_stake_modifier_matches_reference)
+{
+    const int nBlocks = 1000;
+    vector<uint256> vHashes(2 * nBlocks);
+    vector<CBlockIndex> vIndex(2 * nBlocks);
+    for (int i = 0; i < 2 * nBlocks; i++)
+    {
+        vHashes[i] = GetRandHash();
+        CBlockIndex& index = vIndex[i];
+        index.phashBlock = &vHashes[i];
+        index.hashProof = GetRandHash();
+        index.nHeight = i / 2;
+        index.pprev = (i >= 2) ? &vIndex[(i / 2 - 1) * 2] : NULL;
+        index.nTime = 1500000000 + (i / 2) * 64 + GetRandInt(120) - 60;
+        index.SetStakeEntropyBit(GetRandInt(2));
+        if (GetRandInt(2))
+            index.SetProofOfStake();
+    }
+
+    int64_t nTimeReference = 0, nTimeComputed = 0;
+    for (int i = 0; i < 2 * nBlocks; i++)
+    {
+        CBlockIndex& index = vIndex[i];
+        bool fGeneratedReference = false, fGenerated = false;
+        uint64_t nStakeModifier = 0;
+
+        int64_t nStart = GetTimeMicros();
+        uint64_t nStakeModifierReference = ReferenceNextStakeModifier(index.pprev, fGeneratedReference);
+        nTimeReference += GetTimeMicros() - nStart;
+
+        nStart = GetTimeMicros();
+        BOOST_REQUIRE(ComputeNextStakeModifier(index.pprev, nStakeModifier, fGenerated));
+        nTimeComputed += GetTimeMicros() - nStart;
+
+        BOOST_CHECK_EQUAL(nStakeModifier, nStakeModifierReference);
+        BOOST_CHECK_EQUAL(fGenerated, fGeneratedReference);
+        index.SetStakeModifier(nStakeModifier, fGenerated);
+
+        // Once more, now from what was remembered
+        uint64_t nStakeModifierAgain = 0;
+        bool fGeneratedAgain = false;
+        BOOST_REQUIRE(ComputeNextStakeModifier(index.pprev, nStakeModifierAgain, fGeneratedAgain));
+        BOOST_CHECK_EQUAL(nStakeModifierAgain, nStakeModifier);
+        BOOST_CHECK_EQUAL(fGeneratedAgain, fGenerated);
+    }
+
+    // Forgetting a block only costs a recomputation
+    for (int i = 0; i < 2 * nBlocks; i += 97)
+    {
+        ForgetStakeModifier(&vIndex[i]);
+        bool fGenerated = false;
+        uint64_t nStakeModifier = 0;
+        BOOST_REQUIRE(ComputeNextStakeModifier(&vIndex[i], nStakeModifier, fGenerated));
+        bool fGeneratedReference = false;
+        BOOST_CHECK_EQUAL(nStakeModifier, ReferenceNextStakeModifier(&vIndex[i], fGeneratedReference));
+        BOOST_CHECK_EQUAL(fGenerated, fGeneratedReference);
+    }
+
+    BOOST_TEST_MESSAGE(strprintf("stake modifiers: %d blocks, reference %.2fms, computed %.2fms",
+        2 * nBlocks, nTimeReference * 0.001, nTimeComputed * 0.001));
+}
+
+BOOST_AUTO_TEST_CASE(kernel_search_matches_check)
+{
+    CBlockIndex indexPrev;
+    // About one kernel in 40 attempts for a whole coin, hardly any at 256
+    // times that difficulty, and weighted targets too large for 256 bits
+    const unsigned int vBits[] = {0x1d00ffff, 0x1c00ffff, 0x2100ffff};
+    for (unsigned int nBits = 0; nBits < sizeof(vBits) / sizeof(vBits[0]); nBits++)
+    {
+        for (int nRound = 0; nRound < 40; nRound++)
+        {
+            indexPrev.bnStakeModifierV2 = GetRandHash();
+            vector<CKernelInput> vInputs;
+            RandomKernelInputs(vInputs, 1 + GetRandInt(20));
+
+            CStakeKernelSearch search(&indexPrev, vBits[nBits]);
+            for (size_t i = 0; i < vInputs.size(); i++)
+                search.Add(vInputs[i].prevout, vInputs[i].txPrev.nTime, vInputs[i].txPrev.vout[vInputs[i].prevout.n].nValue);
+            BOOST_CHECK_EQUAL(search.size(), vInputs.size());
+
+            int64_t nTimeEnd = 1500010000 + GetRandInt(20000);
+            int64_t nTimeBegin = nTimeEnd - GetRandInt(1200);
+
+            size_t nIndex = 0, nIndexExpected = 0;
+            unsigned int nTime = 0, nTimeExpected = 0;
+            uint256 hashProof = 0, hashProofExpected = 0;
+            bool fFound = search.Search(nTimeBegin, nTimeEnd, nIndex, nTime, hashProof);
+            bool fExpected = SearchOneByOne(&indexPrev, vBits[nBits], vInputs, nTimeBegin, nTimeEnd, nIndexExpected, nTimeExpected, hashProofExpected);
+
+            BOOST_CHECK_EQUAL(fFound, fExpected);
+            if (fFound && fExpected)
+            {
+                BOOST_CHECK_EQUAL(nIndex, nIndexExpected);
+                BOOST_CHECK_EQUAL(nTime, nTimeExpected);
+                BOOST_CHECK(hashProof == hashProofExpected);
+                BOOST_CHECK_EQUAL(nTime & STAKE_TIMESTAMP_MASK, 0U);
+            }
+        }
+    }
+
+    // An empty window or a window before every input finds nothing
+    CStakeKernelSearch search(&indexPrev, 0x2100ffff);
+    search.Add(COutPoint(GetRandHash(), 0), 1500000000, COIN);
+    size_t nIndex;
+    unsigned int nTime;
+    uint256 hashProof;
+    BOOST_CHECK(!search.Search(1500000001, 1500000015, nIndex, nTime, hashProof));
+    BOOST_CHECK(!search.Search(1400000000, 1499999999, nIndex, nTime, hashProof));
+    BOOST_CHECK(search.Search(1500000000, 1500000015, nIndex, nTime, hashProof));
+    BOOST_CHECK_EQUAL(nTime, 1500000000U);
+}
+
+// Splitting the outputs between threads must not change which kernel wins
+BOOST_AUTO_TEST_CASE(kernel_search_threads_match)
+{
+    CBlockIndex indexPrev;
+    const unsigned int vBits[] = {0x1d00ffff, 0x1c00ffff, 0x1b00ffff};
+    for (unsigned int nBits = 0; nBits < sizeof(vBits) / sizeof(vBits[0]); nBits++)
+    {
+        for (int nRound = 0; nRound < 10; nRound++)
+        {
+            indexPrev.bnStakeModifierV2 = GetRandHash();
+            vector<CKernelInput> vInputs;
+            RandomKernelInputs(vInputs, 1 + GetRandInt(1000));
+
+            CStakeKernelSearch search(&indexPrev, vBits[nBits]);
+            for (size_t i = 0; i < vInputs.size(); i++)
+                search.Add(vInputs[i].prevout, vInputs[i].txPrev.nTime, vInputs[i].txPrev.vout[vInputs[i].prevout.n].nValue);
+
+            int64_t nTimeEnd = 1500010000 + GetRandInt(20000);
+            int64_t nTimeBegin = nTimeEnd - GetRandInt(600);
+
+            size_t nIndexExpected = 0;
+            unsigned int nTimeExpected = 0;
+            uint256 hashProofExpected = 0;
+            bool fExpected = search.Search(nTimeBegin, nTimeEnd, nIndexExpected, nTimeExpected, hashProofExpected);
+
+            const int vThreads[] = {2, 3, 8};
+            for (unsigned int nThreads = 0; nThreads < sizeof(vThreads) / sizeof(vThreads[0]); nThreads++)
+            {
+                size_t nIndex = 0;
+                unsigned int nTime = 0;
+                uint256 hashProof = 0;
+                bool fFound = search.Search(nTimeBegin, nTimeEnd, nIndex, nTime, hashProof, vThreads[nThreads]);
+                BOOST_CHECK_EQUAL(fFound, fExpected);
+                if (fFound && fExpected)
+                {
+                    BOOST_CHECK_EQUAL(nIndex, nIndexExpected);
+                    BOOST_CHECK_EQUAL(nTime, nTimeExpected);
+                    BOOST_CHECK(hashProof == hashProofExpected);
+                }
+            }
+        }
+    }
+}
+
+// Coin age of a coinstake from inputs already in memory, as ConnectBlock
+// has them after fetching the inputs
+BOOST_AUTO_TEST_CASE(kernel_coin_age_from_inputs)
+{
+    vector<CBlockIndex> vIndex(100);
+    for (size_t i = 0; i < vIndex.size(); i++)
+    {
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].nHeight = i;
+        vIndex[i].nFile = 1;
+        vIndex[i].nBlockPos = 1000 + i;
+    }
+    const CBlockIndex* pindexPrev = &vIndex.back();
+
+    // An old output, one too recent to earn age and one not in the index
+    const unsigned int nTimeOld = 1500000000;
+    CTransaction txOld, txRecent, txUnknown;
+    txOld.nTime = txRecent.nTime = txUnknown.nTime = nTimeOld;
+    txOld.vout.resize(2);
+    txOld.vout[1].nValue = 2 * COIN;
+    txRecent.vout.resize(1);
+    txRecent.vout[0].nValue = 100 * COIN;
+    txUnknown.vout.resize(1);
+    txUnknown.vout[0].nValue = 100 * COIN;
+
+    MapPrevTx inputs;
+    inputs[txOld.GetHash()] = make_pair(CTxIndex(CDiskTxPos(1, vIndex[0].nBlockPos, 1), txOld.vout.size()), txOld);
+    inputs[txRecent.GetHash()] = make_pair(CTxIndex(CDiskTxPos(1, pindexPrev->nBlockPos - 2, 1), txRecent.vout.size()), txRecent);
+
+    CTransaction tx;
+    tx.nTime = nTimeOld + 3 * 24 * 60 * 60;
+    tx.vin.push_back(CTxIn(COutPoint(txOld.GetHash(), 1)));
+    tx.vin.push_back(CTxIn(COutPoint(txRecent.GetHash(), 0)));
+    tx.vin.push_back(CTxIn(COutPoint(txUnknown.GetHash(), 0)));
+    tx.vin.push_back(CTxIn(COutPoint(txOld.GetHash(), 5)));
+    tx.vout.resize(1);
+
+    uint64_t nCoinAge = 0;
+    BOOST_CHECK(tx.GetCoinAge(inputs, pindexPrev, nCoinAge));
+    BOOST_CHECK_EQUAL(nCoinAge, (uint64_t)6);
+
+    // A coinstake older than its inputs is rejected
+    tx.nTime = nTimeOld - 1;
+    BOOST_CHECK(!tx.GetCoinAge(inputs, pindexPrev, nCoinAge));
+
+    // Timing for a coinstake that combines many outputs
+    CTransaction txMany;
+    txMany.nTime = nTimeOld + 30 * 24 * 60 * 60;
+    MapPrevTx inputsMany;
+    for (int i = 0; i < 50; i++)
+    {
+        CTransaction txPrev;
+        txPrev.nTime = nTimeOld + i;
+        txPrev.vout.resize(1);
+        txPrev.vout[0].nValue = COIN;
+        inputsMany[txPrev.GetHash()] = make_pair(CTxIndex(CDiskTxPos(1, vIndex[i].nBlockPos, 1), 1), txPrev);
+        txMany.vin.push_back(CTxIn(COutPoint(txPrev.GetHash(), 0)));
+    }
+    const int nRuns = 1000;
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nRuns; i++)
+        BOOST_REQUIRE(txMany.GetCoinAge(inputsMany, pindexPrev, nCoinAge));
+    int64_t nElapsed = GetTimeMicros() - nStart;
+    BOOST_CHECK(nCoinAge > 0);
+
+    BOOST_TEST_MESSAGE(strprintf("coin age: %u inputs from memory, %.2fus per coinstake",
+        (unsigned int)txMany.vin.size(), (double)nElapsed / nRuns));
+}
+
+// Sweeping an hour of timestamps over a large wallet with no kernel to find
+BOOST_AUTO_TEST_CASE(kernel_search_bench)
+{
+    CBlockIndex indexPrev;
+    indexPrev.bnStakeModifierV2 = GetRandHash();
+    const unsigned int nBits = 0x03000001;
+    vector<CKernelInput> vInputs;
+    RandomKernelInputs(vInputs, 200);
+    int64_t nTimeEnd = 1500030000, nTimeBegin = nTimeEnd - 3600;
+
+    size_t nIndex;
+    unsigned int nTime;
+    uint256 hashProof;
+    int64_t nStart = GetTimeMicros();
+    BOOST_CHECK(!SearchOneByOne(&indexPrev, nBits, vInputs, nTimeBegin, nTimeEnd, nIndex, nTime, hashProof));
+    int64_t nOneByOne = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    CStakeKernelSearch search(&indexPrev, nBits);
+    for (size_t i = 0; i < vInputs.size(); i++)
+        search.Add(vInputs[i].prevout, vInputs[i].txPrev.nTime, vInputs[i].txPrev.vout[vInputs[i].prevout.n].nValue);
+    BOOST_CHECK(!search.Search(nTimeBegin, nTimeEnd, nIndex, nTime, hashProof));
+    int64_t nSearch = GetTimeMicros() - nStart;
+
+    // Nothing is found, so every output is tried at every timestamp
+    uint64_t nHashes = 0;
+    nStart = GetTimeMicros();
+    BOOST_CHECK(!search.Search(nTimeBegin, nTimeEnd, nIndex, nTime, hashProof, 4, &nHashes));
+    int64_t nSearchThreads = GetTimeMicros() - nStart;
+    BOOST_CHECK(nHashes > 0);
+
+    BOOST_TEST_MESSAGE(strprintf("kernel search: %u outputs over %d seconds, one by one %.2fms, search %.2fms, 4 threads %.2fms",
+        (unsigned int)vInputs.size(), (int)(nTimeEnd - nTimeBegin), nOneByOne * 0.001, nSearch * 0.001, nSearchThreads * 0.001));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,10 +1,12 @@
 #include <boost/test/unit_test.hpp>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
 #include "key.h"
 #include "base58.h"
+#include "script.h"
 #include "uint256.h"
 #include "util.h"
 
@@ -23,6 +25,47 @@ static const CBitcoinAddress addr2C("1CRj2HyM1CXWzHAXLQtiGLyggNT9WQqsDs");
 static const string strAddressBad("1HV9Lc3sNHZxwj4Zk6fB38tEmBryq2cBiF");
 
 
+// Re-encode a DER signature with S replaced by order - S, which is just as
+// valid but not in low S form
+static vector<unsigned char> NegateS(const vector<unsigned char>& vchSig)
+{
+    static const unsigned char vchOrder[32] = {
+        0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xfe,
+        0xba,0xae,0xdc,0xe6,0xaf,0x48,0xa0,0x3b,0xbf,0xd2,0x5e,0x8c,0xd0,0x36,0x41,0x41
+    };
+    unsigned int nLenR = vchSig[3];
+    unsigned int nLenS = vchSig[5 + nLenR];
+    vector<unsigned char> vchR(vchSig.begin() + 4, vchSig.begin() + 4 + nLenR);
+    vector<unsigned char> vchS(32, 0);
+    for (unsigned int i = 0; i < nLenS && i < 32; i++)
+        vchS[31 - i] = vchSig[6 + nLenR + nLenS - 1 - i];
+
+    int nBorrow = 0;
+    for (int i = 31; i >= 0; i--)
+    {
+        int n = vchOrder[i] - vchS[i] - nBorrow;
+        nBorrow = n < 0;
+        vchS[i] = (unsigned char)(n + (nBorrow ? 256 : 0));
+    }
+    while (vchS.size() > 1 && vchS[0] == 0 && !(vchS[1] & 0x80))
+        vchS.erase(vchS.begin());
+    if (vchS[0] & 0x80)
+        vchS.insert(vchS.begin(), 0);
+
+    vector<unsigned char> vchRet;
+    vchRet.push_back(0x30);
+    vchRet.push_back(4 + vchR.size() + vchS.size());
+    vchRet.push_back(0x02);
+    vchRet.push_back(vchR.size());
+    vchRet.insert(vchRet.end(), vchR.begin(), vchR.end());
+    vchRet.push_back(0x02);
+    vchRet.push_back(vchS.size());
+    vchRet.insert(vchRet.end(), vchS.begin(), vchS.end());
+    vchRet.insert(vchRet.end(), vchSig.begin() + 6 + nLenR + nLenS, vchSig.end());
+    return vchRet;
+}
+
+
 #ifdef KEY_TESTS_DUMPINFO
 void dumpKeyInfo(uint256 privkey)
 {
@@ -138,4 +181,176 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(key_signature_batch)
+{
+    CSignatureBatch batch;
+    BOOST_CHECK(batch.Verify());
+
+    // Interleave the keys, so that grouping has something to do
+    vector<CKey> vKeys(4);
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+        vKeys[i].MakeNewKey(i % 2 == 0);
+    for (int i = 0; i < 40; i++)
+    {
+        const CKey& key = vKeys[i % vKeys.size()];
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        batch.Add(key.GetPubKey(), vchSig, hash);
+    }
+    size_t nFailed = 12345;
+    BOOST_CHECK(batch.Verify(&nFailed));
+    BOOST_CHECK(nFailed == 12345);
+
+    // The lowest invalid entry is reported, whatever key it belongs to
+    int vBad[] = {33, 13, 26};
+    for (unsigned int j = 0; j < sizeof(vBad) / sizeof(vBad[0]); j++)
+    {
+        CSignatureBatch batchBad;
+        for (unsigned int i = 0; i < batch.size(); i++)
+        {
+            uint256 hash = batch[i].hash;
+            for (unsigned int k = 0; k <= j; k++)
+                if ((int)i == vBad[k])
+                    hash = ~hash;
+            batchBad.Add(batch[i].pubkey, batch[i].vchSig, hash);
+        }
+        BOOST_CHECK(!batchBad.Verify(&nFailed));
+        BOOST_CHECK_EQUAL(nFailed, (size_t)*min_element(vBad, vBad + j + 1));
+    }
+
+    // Unparseable keys and signatures fail their own entry only
+    CSignatureBatch batchKey;
+    batchKey.Add(batch[0].pubkey, batch[0].vchSig, batch[0].hash);
+    batchKey.Add(CPubKey(), batch[1].vchSig, batch[1].hash);
+    batchKey.Add(batch[2].pubkey, vector<unsigned char>(), batch[2].hash);
+    BOOST_CHECK(!batchKey.Verify(&nFailed));
+    BOOST_CHECK_EQUAL(nFailed, 1U);
+}
+
+// Checking the signatures of a consolidation transaction, many inputs
+// signed by a few keys, one at a time and as a batch
+BOOST_AUTO_TEST_CASE(key_signature_batch_bench)
+{
+    vector<CKey> vKeys(10);
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+        vKeys[i].MakeNewKey(true);
+
+    CSignatureBatch batch;
+    for (int i = 0; i < 500; i++)
+    {
+        const CKey& key = vKeys[GetRandInt(vKeys.size())];
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSig;
+        key.Sign(hash, vchSig);
+        batch.Add(key.GetPubKey(), vchSig, hash);
+    }
+
+    int64_t nStart = GetTimeMicros();
+    bool fAllValid = true;
+    for (unsigned int i = 0; i < batch.size(); i++)
+        fAllValid &= batch[i].pubkey.Verify(batch[i].hash, batch[i].vchSig);
+    int64_t nSingle = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    BOOST_CHECK(batch.Verify());
+    int64_t nBatch = GetTimeMicros() - nStart;
+    BOOST_CHECK(fAllValid);
+
+    BOOST_TEST_MESSAGE(strprintf("signature batch (%s): %u signatures, %u keys, single %.2fms, batch %.2fms",
+        ECC_GetBackend(), (unsigned int)batch.size(), (unsigned int)vKeys.size(), nSingle * 0.001, nBatch * 0.001));
+}
+
+#ifdef USE_SECP256K1
+struct CSigCheck
+{
+    CPubKey pubkey;
+    uint256 hash;
+    vector<unsigned char> vchSig;
+    bool fExpected;
+};
+
+// Both backends must agree on public keys and on every verification result.
+// Lax DER encodings are left out: strict DER is enforced before signatures
+// reach CPubKey::Verify, and OpenSSL itself differs between versions there.
+BOOST_AUTO_TEST_CASE(key_ecbackend_differential)
+{
+    const int nKeys = 64;
+    vector<CKey> vKeys(nKeys);
+    vector<uint256> vHashes(nKeys);
+    vector<CPubKey> vPubKeys(nKeys);
+    vector<vector<unsigned char> > vSigsOpenSSL(nKeys), vSigsSecp(nKeys);
+
+    BOOST_CHECK(ECC_Start("openssl"));
+    for (int i = 0; i < nKeys; i++)
+    {
+        vKeys[i].MakeNewKey(i % 2 == 0);
+        vHashes[i] = GetRandHash();
+        vPubKeys[i] = vKeys[i].GetPubKey();
+        BOOST_CHECK(vKeys[i].Sign(vHashes[i], vSigsOpenSSL[i]));
+    }
+
+    BOOST_CHECK(ECC_Start("secp256k1"));
+    BOOST_CHECK(ECC_GetBackend() == "secp256k1");
+    for (int i = 0; i < nKeys; i++)
+    {
+        BOOST_CHECK(vKeys[i].GetPubKey() == vPubKeys[i]);
+        BOOST_CHECK(vKeys[i].Sign(vHashes[i], vSigsSecp[i]));
+        BOOST_CHECK(IsLowDERSignature(vSigsSecp[i], false));
+    }
+
+    vector<CSigCheck> vChecks;
+    for (int i = 0; i < nKeys; i++)
+    {
+        const CPubKey& pubkey = vPubKeys[i];
+        const uint256& hash = vHashes[i];
+        CSigCheck checks[] = {
+            {pubkey, hash, vSigsOpenSSL[i], true},
+            {pubkey, hash, vSigsSecp[i], true},
+            {pubkey, hash, NegateS(vSigsOpenSSL[i]), true},
+            {pubkey, hash, NegateS(vSigsSecp[i]), true},
+            {pubkey, vHashes[(i + 1) % nKeys], vSigsSecp[i], false},
+            {vPubKeys[(i + 1) % nKeys], hash, vSigsOpenSSL[i], false},
+        };
+        vChecks.insert(vChecks.end(), checks, checks + sizeof(checks) / sizeof(checks[0]));
+
+        // A flipped bit anywhere usually breaks the signature, but both
+        // backends have to reach the same verdict either way
+        CSigCheck check = {pubkey, hash, vSigsSecp[i], false};
+        check.vchSig[GetRandInt(check.vchSig.size())] ^= 1 << GetRandInt(8);
+        vChecks.push_back(check);
+        check.vchSig = vSigsOpenSSL[i];
+        check.vchSig.resize(1 + GetRandInt(check.vchSig.size() - 1));
+        vChecks.push_back(check);
+    }
+
+    vector<bool> vResultsSecp;
+    BOOST_FOREACH(const CSigCheck& check, vChecks)
+        vResultsSecp.push_back(check.pubkey.Verify(check.hash, check.vchSig));
+
+    BOOST_CHECK(ECC_Start("openssl"));
+    BOOST_CHECK(ECC_GetBackend() == "openssl");
+    for (unsigned int i = 0; i < vChecks.size(); i++)
+    {
+        const CSigCheck& check = vChecks[i];
+        bool fOpenSSL = check.pubkey.Verify(check.hash, check.vchSig);
+        BOOST_CHECK_MESSAGE(fOpenSSL == vResultsSecp[i], strprintf("check %u: openssl %d, secp256k1 %d, sig %s",
+            i, fOpenSSL, vResultsSecp[i], HexStr(check.vchSig)));
+        if (check.fExpected)
+            BOOST_CHECK(fOpenSSL);
+    }
+
+    BOOST_CHECK(!ECC_Start("nosuchcurvelib"));
+    ECC_Stop();
+}
+#else
+BOOST_AUTO_TEST_CASE(key_ecbackend_unavailable)
+{
+    BOOST_CHECK(!ECC_Start("secp256k1"));
+    BOOST_CHECK(!ECC_Start("nosuchcurvelib"));
+    BOOST_CHECK(ECC_Start("openssl"));
+    BOOST_CHECK(ECC_GetBackend() == "openssl");
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
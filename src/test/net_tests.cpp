@@ -0,0 +1,294 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+#ifndef WIN32
+// A connected pair of TCP sockets over the loopback interface
+static void MakeLoopbackPair(SOCKET& hSocket1, SOCKET& hSocket2)
+{
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListen != INVALID_SOCKET);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    BOOST_REQUIRE(bind(hListen, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    BOOST_REQUIRE(listen(hListen, 1) == 0);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&addr, &len) == 0);
+
+    hSocket1 = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(connect(hSocket1, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    hSocket2 = accept(hListen, NULL, NULL);
+    BOOST_REQUIRE(hSocket2 != INVALID_SOCKET);
+    closesocket(hListen);
+}
+
+// The socket handler's part: hand whatever arrives to the node
+static void ReceiveLoop(CNode* pnode, SOCKET hSocket)
+{
+    char pchBuf[0x10000];
+    while (true)
+    {
+        int nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), 0);
+        if (nBytes <= 0)
+            return;
+        LOCK(pnode->cs_vRecvMsg);
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            return;
+    }
+}
+
+static bool PopCompleteMessage(CNode* pnode)
+{
+    LOCK(pnode->cs_vRecvMsg);
+    if (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete())
+        return false;
+    pnode->vRecvMsg.pop_front();
+    return true;
+}
+
+static CCriticalSection cs_vHandled;
+
+// The message handler's part: note when each message is seen, waiting to
+// be woken in between, or polling every 100ms as it used to
+static void HandleLoop(CNode* pnode, bool fWakeup, int nMessages, vector<int64_t>* pvHandled)
+{
+    int64_t nDeadline = GetTimeMillis() + 60000;
+    for (int nHandled = 0; nHandled < nMessages && GetTimeMillis() < nDeadline; )
+    {
+        if (PopCompleteMessage(pnode))
+        {
+            LOCK(cs_vHandled);
+            pvHandled->push_back(GetTimeMicros());
+            nHandled++;
+            continue;
+        }
+        if (fWakeup)
+            wakeupMessageHandler.Wait(100);
+        else
+            MilliSleep(100);
+    }
+}
+
+// Relay a block sized message from one node to the other over loopback
+// nRuns times; returns the average latency from the send to the message
+// handler seeing the whole message, in microseconds
+static int64_t RelayLatency(bool fWakeup, int nRuns)
+{
+    SOCKET hSend, hRecv;
+    MakeLoopbackPair(hSend, hRecv);
+    CNode* pnodeFrom = new CNode(hSend, CAddress(), "", true);
+    CNode* pnodeTo = new CNode(INVALID_SOCKET, CAddress(), "", true);
+    vector<int64_t> vHandled;
+    boost::thread threadReceive(ReceiveLoop, pnodeTo, hRecv);
+    boost::thread threadHandle(HandleLoop, pnodeTo, fWakeup, nRuns, &vHandled);
+
+    vector<unsigned char> vchBlock(50000, 0x42);
+    int64_t nTotal = 0;
+    for (int i = 0; i < nRuns; i++)
+    {
+        // Arrive at any point of the handler's wait
+        MilliSleep(GetRandInt(100));
+        int64_t nStart = GetTimeMicros();
+        pnodeFrom->PushMessage("block", vchBlock);
+        while (true)
+        {
+            {
+                LOCK(pnodeFrom->cs_vSend);
+                if (pnodeFrom->vSendMsg.empty())
+                    break;
+                SocketSendData(pnodeFrom);
+            }
+            MilliSleep(1);
+        }
+
+        int64_t nDeadline = GetTimeMillis() + 10000;
+        while (GetTimeMillis() < nDeadline)
+        {
+            {
+                LOCK(cs_vHandled);
+                if ((int)vHandled.size() > i)
+                {
+                    nTotal += vHandled[i] - nStart;
+                    break;
+                }
+            }
+            MilliSleep(1);
+        }
+    }
+
+    threadHandle.join();
+    BOOST_CHECK_EQUAL((int)vHandled.size(), nRuns);
+    shutdown(hRecv, SHUT_RDWR);
+    threadReceive.join();
+    closesocket(hRecv);
+    delete pnodeFrom;
+    delete pnodeTo;
+    return nTotal / nRuns;
+}
+#endif
+
+// Started by StartNode
+void ThreadMessageHandler();
+void ThreadMessageWorker();
+
+// Messages waiting for each node in place of vRecvMsg, and what the
+// workers made of them
+static CCriticalSection cs_vWork;
+static map<CNode*, deque<int> > mapWork;
+static map<CNode*, vector<int> > mapProcessed;
+static set<CNode*> setProcessing;
+static CNode* pnodeSlow;
+static bool fOverlap;
+static int64_t nSlowDone, nFastDone;
+
+static bool ProcessWork(CNode* pnode)
+{
+    int n;
+    {
+        LOCK(cs_vWork);
+        if (mapWork[pnode].empty())
+            return true;
+        if (!setProcessing.insert(pnode).second)
+            fOverlap = true;
+        n = mapWork[pnode].front();
+        mapWork[pnode].pop_front();
+    }
+
+    // One peer sends big blocks
+    if (pnode == pnodeSlow)
+        MilliSleep(20);
+
+    LOCK(cs_vWork);
+    setProcessing.erase(pnode);
+    mapProcessed[pnode].push_back(n);
+    if (!mapWork[pnode].empty())
+        WakeMessageHandler();
+    else if (pnode == pnodeSlow)
+        nSlowDone = GetTimeMillis();
+    else
+        nFastDone = max(nFastDone, GetTimeMillis());
+    return true;
+}
+
+static bool SendNothing(CNode* pnode, bool fTrickle)
+{
+    return true;
+}
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(net_wakeup)
+{
+    CWakeup wakeup;
+    BOOST_CHECK(!wakeup.Wait(1));
+
+    // A wake before the wait is not lost, and only counts once
+    wakeup.Wake();
+    wakeup.Wake();
+    BOOST_CHECK(wakeup.Wait(1000));
+    BOOST_CHECK(!wakeup.Wait(1));
+
+    int64_t nStart = GetTimeMillis();
+    boost::thread threadWake(boost::bind(&CWakeup::Wake, &wakeup));
+    BOOST_CHECK(wakeup.Wait(10000));
+    BOOST_CHECK(GetTimeMillis() - nStart < 5000);
+    threadWake.join();
+}
+
+#ifndef WIN32
+// One hop of block relay between loopback peers, as the message handler
+// waited before and waits now
+BOOST_AUTO_TEST_CASE(net_block_relay_latency)
+{
+    const int nRuns = 20;
+    int64_t nPoll = RelayLatency(false, nRuns);
+    int64_t nWakeup = RelayLatency(true, nRuns);
+
+    BOOST_CHECK(nWakeup < nPoll);
+    BOOST_TEST_MESSAGE(strprintf("block relay hop over loopback: %.2fms polling every 100ms, %.2fms woken",
+        nPoll * 0.001, nWakeup * 0.001));
+}
+#endif
+
+// A slow peer holds up one worker, the others carry on, and each peer's
+// messages are processed one at a time, in order
+BOOST_AUTO_TEST_CASE(net_message_workers)
+{
+    const int nNodes = 8;
+    const int nMessages = 20;
+    vector<CNode*> vNodesTest;
+    for (int i = 0; i < nNodes; i++)
+    {
+        CNode* pnode = new CNode(INVALID_SOCKET, CAddress(), "", true);
+        for (int n = 0; n < nMessages; n++)
+            mapWork[pnode].push_back(n);
+        vNodesTest.push_back(pnode);
+    }
+    pnodeSlow = vNodesTest[0];
+    {
+        LOCK(cs_vNodes);
+        vNodes.insert(vNodes.end(), vNodesTest.begin(), vNodesTest.end());
+    }
+    GetNodeSignals().ProcessMessages.connect(&ProcessWork);
+    GetNodeSignals().SendMessages.connect(&SendNothing);
+
+    boost::thread_group threadsWorker, threadHandler;
+    for (int i = 0; i < 4; i++)
+        threadsWorker.create_thread(&ThreadMessageWorker);
+    int64_t nStart = GetTimeMillis();
+    threadHandler.create_thread(&ThreadMessageHandler);
+
+    bool fDone = false;
+    while (!fDone && GetTimeMillis() - nStart < 30000)
+    {
+        MilliSleep(10);
+        LOCK(cs_vWork);
+        fDone = true;
+        BOOST_FOREACH(CNode* pnode, vNodesTest)
+            fDone = fDone && mapProcessed[pnode].size() == (size_t)nMessages;
+    }
+    BOOST_CHECK(fDone);
+
+    // Let the workers hand back the nodes before they go away
+    threadHandler.interrupt_all();
+    threadHandler.join_all();
+    bool fIdle = false;
+    while (!fIdle && GetTimeMillis() - nStart < 60000)
+    {
+        MilliSleep(10);
+        LOCK(cs_vNodes);
+        fIdle = true;
+        BOOST_FOREACH(CNode* pnode, vNodesTest)
+            fIdle = fIdle && pnode->GetRefCount() == 0;
+    }
+    BOOST_CHECK(fIdle);
+    threadsWorker.interrupt_all();
+    threadsWorker.join_all();
+
+    BOOST_CHECK(!fOverlap);
+    BOOST_FOREACH(CNode* pnode, vNodesTest)
+        for (int n = 0; n < nMessages; n++)
+            BOOST_CHECK_EQUAL(mapProcessed[pnode][n], n);
+    BOOST_CHECK(nFastDone < nSlowDone);
+    BOOST_TEST_MESSAGE(strprintf("message workers: fast peers done after %dms, the slow one after %dms",
+        nFastDone - nStart, nSlowDone - nStart));
+
+    GetNodeSignals().ProcessMessages.disconnect(&ProcessWork);
+    GetNodeSignals().SendMessages.disconnect(&SendNothing);
+    {
+        LOCK(cs_vNodes);
+        vNodes.clear();
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesTest)
+        delete pnode;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
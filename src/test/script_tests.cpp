@@ -0,0 +1,226 @@
+#include <boost/test/unit_test.hpp>
+
+#include "key.h"
+#include "main.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+static const unsigned int nTestFlags = MANDATORY_SCRIPT_VERIFY_FLAGS | SCRIPT_VERIFY_NOCACHE;
+
+// Spend output 0 of txFrom, whose scriptPubKey is given, with a single
+// signature by key; fCorrupt spoils the signature but keeps it well formed
+static void BuildSpend(const CKey& key, const CScript& scriptPubKey, bool fCorrupt, CTransaction& txFrom, CTransaction& txTo)
+{
+    txFrom.vout.resize(1);
+    txFrom.vout[0].nValue = COIN;
+    txFrom.vout[0].scriptPubKey = scriptPubKey;
+
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+    txTo.vin[0].prevout.n = 0;
+    txTo.vin[0].prevout.hash = txFrom.GetHash();
+    txTo.vout[0].nValue = COIN;
+
+    uint256 hash = SignatureHash(scriptPubKey, txTo, 0, SIGHASH_ALL);
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    if (fCorrupt)
+        vchSig[4 + vchSig[3] - 1] ^= 1; // last byte of R
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    txTo.vin[0].scriptSig = CScript() << vchSig;
+}
+
+static vector<unsigned char> SignInput(const CKey& key, const CScript& scriptCode, const CTransaction& txTo)
+{
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(SignatureHash(scriptCode, txTo, 0, SIGHASH_ALL), vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    return vchSig;
+}
+
+// The result with the template fast paths, which must be the same as the
+// interpreter's, with and without deferring the signature checks
+static bool VerifyBothWays(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int flags)
+{
+    bool fResult[2], fBatch[2];
+    for (int i = 0; i < 2; i++)
+    {
+        fScriptTemplates = (i == 1);
+        fResult[i] = VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags, 0);
+        CSignatureBatch batch;
+        fBatch[i] = VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags, 0, NULL, &batch) && VerifySignatureBatch(batch, flags);
+    }
+    fScriptTemplates = true;
+
+    BOOST_CHECK_EQUAL(fResult[0], fResult[1]);
+    BOOST_CHECK_EQUAL(fBatch[0], fBatch[1]);
+    BOOST_CHECK_EQUAL(fResult[1], fBatch[1]);
+    return fResult[1];
+}
+
+BOOST_AUTO_TEST_SUITE(script_tests)
+
+// Only signature checks whose failure fails the script are deferred
+BOOST_AUTO_TEST_CASE(script_signature_batch)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    vector<unsigned char> vchPubKey(pubkey.begin(), pubkey.end());
+
+    CScript scriptFinal = CScript() << vchPubKey << OP_CHECKSIG;
+    CScript scriptVerify = CScript() << vchPubKey << OP_CHECKSIGVERIFY << OP_1;
+    CScript scriptNot = CScript() << vchPubKey << OP_CHECKSIG << OP_NOT;
+
+    for (int nCorrupt = 0; nCorrupt < 2; nCorrupt++)
+    {
+        bool fCorrupt = nCorrupt == 1;
+        CScript scripts[] = {scriptFinal, scriptVerify};
+        for (unsigned int i = 0; i < sizeof(scripts) / sizeof(scripts[0]); i++)
+        {
+            CTransaction txFrom, txTo;
+            BuildSpend(key, scripts[i], fCorrupt, txFrom, txTo);
+            BOOST_CHECK(VerifySignature(txFrom, txTo, 0, nTestFlags, 0) == !fCorrupt);
+
+            // Deferred: the script passes and the batch decides
+            CSignatureBatch batch;
+            BOOST_CHECK(VerifyScript(txTo.vin[0].scriptSig, scripts[i], txTo, 0, nTestFlags, 0, NULL, &batch));
+            BOOST_CHECK_EQUAL(batch.size(), 1U);
+            size_t nFailed = 1;
+            BOOST_CHECK(VerifySignatureBatch(batch, nTestFlags, &nFailed) == !fCorrupt);
+            if (fCorrupt)
+                BOOST_CHECK_EQUAL(nFailed, 0U);
+        }
+
+        // A failed OP_CHECKSIG that is not last can still make the script
+        // succeed, so it is verified on the spot
+        CTransaction txFrom, txTo;
+        BuildSpend(key, scriptNot, fCorrupt, txFrom, txTo);
+        CSignatureBatch batch;
+        BOOST_CHECK(VerifyScript(txTo.vin[0].scriptSig, scriptNot, txTo, 0, nTestFlags, 0, NULL, &batch) == fCorrupt);
+        BOOST_CHECK(batch.empty());
+    }
+}
+
+// Standard scripts must be accepted and rejected exactly as the
+// interpreter does, including near misses that fall back to it
+BOOST_AUTO_TEST_CASE(script_template_matches_interpreter)
+{
+    CKey key, key2;
+    key.MakeNewKey(true);
+    key2.MakeNewKey(false);
+    CPubKey pubkey = key.GetPubKey(), pubkey2 = key2.GetPubKey();
+    vector<unsigned char> vchPubKey(pubkey.begin(), pubkey.end());
+    vector<unsigned char> vchPubKey2(pubkey2.begin(), pubkey2.end());
+
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+    txTo.vin[0].prevout.hash = GetRandHash();
+    txTo.vout[0].nValue = COIN;
+
+    CScript scriptP2PKH, scriptP2PK, scriptP2PK2, scriptMultisig;
+    scriptP2PKH << OP_DUP << OP_HASH160 << pubkey.GetID() << OP_EQUALVERIFY << OP_CHECKSIG;
+    scriptP2PK << vchPubKey << OP_CHECKSIG;
+    scriptP2PK2 << vchPubKey2 << OP_CHECKSIG;
+    scriptMultisig << OP_1 << vchPubKey << OP_1 << OP_CHECKMULTISIG;
+
+    CScript vRedeem[] = {scriptP2PKH, scriptP2PK, scriptP2PK2, scriptMultisig};
+    const unsigned int vFlags[] = {nTestFlags, SCRIPT_VERIFY_NOCACHE};
+    for (unsigned int nFlags = 0; nFlags < sizeof(vFlags) / sizeof(vFlags[0]); nFlags++)
+    {
+        unsigned int flags = vFlags[nFlags];
+        for (unsigned int nRedeem = 0; nRedeem < sizeof(vRedeem) / sizeof(vRedeem[0]); nRedeem++)
+        {
+            const CScript& scriptCode = vRedeem[nRedeem];
+            const CKey& keySigner = (nRedeem == 2) ? key2 : key;
+            vector<unsigned char> vchSig = SignInput(keySigner, scriptCode, txTo);
+
+            vector<vector<unsigned char> > vSigs;
+            vSigs.push_back(vchSig);
+            vSigs.push_back(SignInput((nRedeem == 2) ? key : key2, scriptCode, txTo));
+            vSigs.push_back(vector<unsigned char>());
+            vSigs.push_back(vchSig);
+            vSigs.back()[4 + vchSig[3] - 1] ^= 1;
+            vSigs.push_back(vchSig);
+            vSigs.back().back() = 0x05;
+
+            for (unsigned int nSig = 0; nSig < vSigs.size(); nSig++)
+            {
+                vector<CScript> vScriptSigs;
+                CScript scriptSig;
+                if (nRedeem == 3)
+                    scriptSig << OP_0;
+                scriptSig << vSigs[nSig];
+                if (nRedeem == 0)
+                    scriptSig << vchPubKey;
+                vScriptSigs.push_back(scriptSig);
+                vScriptSigs.push_back((CScript() << vector<unsigned char>(1, 7)) + scriptSig);
+                vScriptSigs.push_back((CScript() << OP_1) + scriptSig);
+                if (nRedeem == 0)
+                    vScriptSigs.push_back(CScript() << vSigs[nSig] << vchPubKey2);
+                vScriptSigs.push_back(CScript() << vSigs[nSig]);
+                vScriptSigs.push_back(CScript());
+
+                for (unsigned int i = 0; i < vScriptSigs.size(); i++)
+                {
+                    bool fValid = VerifyBothWays(vScriptSigs[i], scriptCode, txTo, flags);
+                    if (nSig == 0 && i == 0)
+                        BOOST_CHECK(fValid);
+
+                    // The same spend through pay-to-script-hash, also with
+                    // the wrong redeem script and with no redeem script
+                    CScript scriptP2SH;
+                    scriptP2SH.SetDestination(CScriptID(Hash160(scriptCode)));
+                    const CScript& scriptWrong = vRedeem[(nRedeem + 1) % (sizeof(vRedeem) / sizeof(vRedeem[0]))];
+                    fValid = VerifyBothWays(CScript(vScriptSigs[i]) << static_cast<vector<unsigned char> >(scriptCode), scriptP2SH, txTo, flags);
+                    if (nSig == 0 && i == 0)
+                        BOOST_CHECK(fValid);
+                    BOOST_CHECK(!VerifyBothWays(CScript(vScriptSigs[i]) << static_cast<vector<unsigned char> >(scriptWrong), scriptP2SH, txTo, flags));
+                    VerifyBothWays(vScriptSigs[i], scriptP2SH, txTo, flags);
+                }
+            }
+        }
+    }
+
+    // Only spends that never reach the interpreter count as templates
+    uint64_t nTemplate, nInterpreted, nTemplateAfter, nInterpretedAfter;
+    CScript scriptSig = CScript() << SignInput(key, scriptP2PKH, txTo) << vchPubKey;
+    GetScriptStats(nTemplate, nInterpreted);
+    BOOST_CHECK(VerifyScript(scriptSig, scriptP2PKH, txTo, 0, nTestFlags, 0));
+    BOOST_CHECK(VerifyScript((CScript() << OP_NOP) + scriptSig, scriptP2PKH, txTo, 0, nTestFlags, 0));
+    GetScriptStats(nTemplateAfter, nInterpretedAfter);
+    BOOST_CHECK_EQUAL(nTemplateAfter - nTemplate, (uint64_t)1);
+    BOOST_CHECK_EQUAL(nInterpretedAfter - nInterpreted, (uint64_t)1);
+}
+
+// Numeric and conditional opcodes, with no signature checks; the op count
+// stays under the limit of 201
+BOOST_AUTO_TEST_CASE(script_eval_bench)
+{
+    CScript script;
+    script << OP_1;
+    for (int i = 0; i < 30; i++)
+        script << OP_DUP << OP_1ADD << OP_ADD << OP_IF << OP_16 << OP_ELSE << OP_1NEGATE << OP_ENDIF;
+    script << OP_16 << OP_NUMEQUAL;
+
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    const int nRuns = 5000;
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nRuns; i++)
+    {
+        vector<vector<unsigned char> > stack;
+        BOOST_REQUIRE(EvalScript(stack, script, txTo, 0, nTestFlags, 0));
+        BOOST_REQUIRE_EQUAL(stack.size(), 1U);
+        BOOST_REQUIRE(stack.back() == vector<unsigned char>(1, 1));
+    }
+    int64_t nElapsed = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("EvalScript: %u byte arithmetic script, %.2fus per run",
+        (unsigned int)script.size(), (double)nElapsed / nRuns));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
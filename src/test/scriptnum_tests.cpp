@@ -0,0 +1,116 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bignum.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+// What EvalScript used to do with an operand: parse it as a bignum and get
+// rid of extra leading zeros
+static CBigNum CastToBigNum(const vector<unsigned char>& vch)
+{
+    return CBigNum(CBigNum(vch).getvch());
+}
+
+static vector<unsigned char> RandomOperand(size_t nMaxSize)
+{
+    vector<unsigned char> vch(GetRandInt(nMaxSize + 1));
+    for (size_t i = 0; i < vch.size(); i++)
+        vch[i] = GetRandInt(256);
+    // Favour the interesting bytes at the top
+    if (!vch.empty() && GetRandInt(2) == 0)
+    {
+        static const unsigned char vchTop[] = {0x00, 0x7f, 0x80, 0xff, 0x01, 0x81};
+        vch.back() = vchTop[GetRandInt(sizeof(vchTop))];
+    }
+    return vch;
+}
+
+static void CheckSame(const CScriptNum& num, const CBigNum& bn)
+{
+    BOOST_CHECK(num.getvch() == bn.getvch());
+    BOOST_CHECK_EQUAL(num.getint(), bn.getint());
+}
+
+BOOST_AUTO_TEST_SUITE(scriptnum_tests)
+
+BOOST_AUTO_TEST_CASE(scriptnum_encoding)
+{
+    static const unsigned char vchCases[][5] = {
+        {0x00}, {0x80}, {0x00, 0x00}, {0x00, 0x80}, {0x7f}, {0xff}, {0x80, 0x00}, {0x80, 0x80},
+        {0xff, 0xff, 0xff, 0x7f}, {0xff, 0xff, 0xff, 0xff}, {0x00, 0x00, 0x00, 0x80},
+        {0xff, 0xff, 0xff, 0xff, 0x7f}, {0xff, 0xff, 0xff, 0xff, 0xff}, {0x00, 0x00, 0x00, 0x00, 0x80},
+    };
+    for (unsigned int i = 0; i < sizeof(vchCases) / sizeof(vchCases[0]); i++)
+    {
+        for (size_t nSize = 1; nSize <= 5; nSize++)
+        {
+            vector<unsigned char> vch(vchCases[i], vchCases[i] + nSize);
+            CheckSame(CScriptNum(vch, 5), CastToBigNum(vch));
+        }
+    }
+
+    // Negative zero and non-minimal zeros are all plain zero
+    BOOST_CHECK(CScriptNum(vector<unsigned char>(1, 0x80)) == 0);
+    BOOST_CHECK(CScriptNum(vector<unsigned char>(4, 0x00)) == 0);
+    BOOST_CHECK(CScriptNum(vector<unsigned char>(1, 0x80)).getvch().empty());
+
+    for (int64_t n = -70000; n <= 70000; n += 7)
+        CheckSame(CScriptNum(n), CBigNum(n));
+    static const int64_t nLimits[] = {
+        0x7fffffffLL, -0x7fffffffLL, 0x80000000LL, -0x80000000LL, 0xffffffffLL, -0xffffffffLL,
+        0xfffffffffeLL, -0xfffffffffeLL, 0x7fffffffffLL, -0x7fffffffffLL
+    };
+    for (unsigned int i = 0; i < sizeof(nLimits) / sizeof(nLimits[0]); i++)
+        CheckSame(CScriptNum(nLimits[i]), CBigNum(nLimits[i]));
+}
+
+BOOST_AUTO_TEST_CASE(scriptnum_overflow)
+{
+    BOOST_CHECK_NO_THROW(CScriptNum(vector<unsigned char>(4, 0xff)).GetInt64());
+    BOOST_CHECK_THROW(CScriptNum(vector<unsigned char>(5, 0x01)).GetInt64(), scriptnum_error);
+    BOOST_CHECK_NO_THROW(CScriptNum(vector<unsigned char>(5, 0x01), 5).GetInt64());
+    BOOST_CHECK_THROW(CScriptNum(vector<unsigned char>(6, 0x01), 5).GetInt64(), scriptnum_error);
+
+    // Results of arithmetic on 4 byte operands may take 5 bytes, and those
+    // fail as operands
+    CScriptNum num(vector<unsigned char>(4, 0x7f));
+    vector<unsigned char> vchSum = (num + num).getvch();
+    BOOST_CHECK_EQUAL(vchSum.size(), 5U);
+    BOOST_CHECK_THROW(CScriptNum(vchSum).GetInt64(), scriptnum_error);
+}
+
+// Every numeric operation must agree with the bignum arithmetic it replaces
+BOOST_AUTO_TEST_CASE(scriptnum_matches_bignum)
+{
+    for (int i = 0; i < 20000; i++)
+    {
+        vector<unsigned char> vch1 = RandomOperand(4);
+        vector<unsigned char> vch2 = RandomOperand(4);
+        CScriptNum num1(vch1), num2(vch2);
+        CBigNum bn1 = CastToBigNum(vch1), bn2 = CastToBigNum(vch2);
+
+        CheckSame(num1, bn1);
+        CheckSame(num1 + num2, bn1 + bn2);
+        CheckSame(num1 - num2, bn1 - bn2);
+        CheckSame(-num1, -bn1);
+        CheckSame(num1 + CScriptNum(1), bn1 + 1);
+        CheckSame(num1 - CScriptNum(1), bn1 - 1);
+
+        BOOST_CHECK_EQUAL(num1 == num2, bn1 == bn2);
+        BOOST_CHECK_EQUAL(num1 != num2, bn1 != bn2);
+        BOOST_CHECK_EQUAL(num1 < num2, bn1 < bn2);
+        BOOST_CHECK_EQUAL(num1 > num2, bn1 > bn2);
+        BOOST_CHECK_EQUAL(num1 <= num2, bn1 <= bn2);
+        BOOST_CHECK_EQUAL(num1 >= num2, bn1 >= bn2);
+        BOOST_CHECK_EQUAL(num1 == 0, bn1 == 0);
+        BOOST_CHECK_EQUAL(num1 < 0, bn1 < 0);
+
+        // 5 byte operands, as taken by OP_CHECKLOCKTIMEVERIFY
+        vector<unsigned char> vch5 = RandomOperand(5);
+        CheckSame(CScriptNum(vch5, 5), CastToBigNum(vch5));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,109 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+static void RandomScript(CScript &script)
+{
+    static const opcodetype oplist[] = {OP_FALSE, OP_1, OP_2, OP_3, OP_CHECKSIG, OP_IF, OP_VERIF, OP_RETURN, OP_CODESEPARATOR};
+    script = CScript();
+    int ops = GetRandInt(10);
+    for (int i = 0; i < ops; i++)
+        script << oplist[GetRandInt(sizeof(oplist)/sizeof(oplist[0]))];
+}
+
+static void RandomTransaction(CTransaction &tx, int nInputs, int nOutputs)
+{
+    tx.nVersion = GetRand(0x7FFFFFFF);
+    tx.nTime = GetRand(0xFFFFFFFF);
+    tx.vin.clear();
+    tx.vout.clear();
+    tx.nLockTime = (GetRandInt(2)) ? GetRand(0xFFFFFFFF) : 0;
+    for (int in = 0; in < nInputs; in++) {
+        tx.vin.push_back(CTxIn());
+        CTxIn &txin = tx.vin.back();
+        txin.prevout.hash = GetRandHash();
+        txin.prevout.n = GetRandInt(4);
+        RandomScript(txin.scriptSig);
+        txin.nSequence = (GetRandInt(2)) ? GetRand(0xFFFFFFFF) : (unsigned int)-1;
+    }
+    for (int out = 0; out < nOutputs; out++) {
+        tx.vout.push_back(CTxOut());
+        CTxOut &txout = tx.vout.back();
+        txout.nValue = GetRand(100000000);
+        RandomScript(txout.scriptPubKey);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(sighash_tests)
+
+// The precomputed hashes must match SignatureHash() bit for bit, for every
+// input and every hash type, including the ones that fall back to it
+BOOST_AUTO_TEST_CASE(sighash_precomputed_matches_legacy)
+{
+    static const int vHashTypes[] = {
+        0, SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE,
+        SIGHASH_ALL | SIGHASH_ANYONECANPAY, SIGHASH_NONE | SIGHASH_ANYONECANPAY, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY,
+        4, 0x21, 0x41, 0x7f, -1
+    };
+
+    for (int i = 0; i < 500; i++)
+    {
+        CTransaction txTo;
+        RandomTransaction(txTo, 1 + GetRandInt(8), GetRandInt(4));
+        CPrecomputedSighash sighashes(txTo);
+
+        for (unsigned int nIn = 0; nIn <= txTo.vin.size(); nIn++)
+        {
+            CScript scriptCode;
+            RandomScript(scriptCode);
+            int nHashType = (GetRandInt(3) == 0) ? (int)GetRand(0xFFFFFFFF) : vHashTypes[GetRandInt(sizeof(vHashTypes)/sizeof(vHashTypes[0]))];
+
+            // nIn == vin.size() exercises the out of range result
+            uint256 hashLegacy = SignatureHash(scriptCode, txTo, nIn, nHashType);
+            uint256 hashFast = sighashes.SignatureHash(scriptCode, nIn, nHashType);
+            BOOST_CHECK_MESSAGE(hashLegacy == hashFast, strprintf("input %u of %u, hash type %08x", nIn, txTo.vin.size(), nHashType));
+        }
+    }
+
+    // scriptSigs do not take part, so they may change after precomputing
+    CTransaction txTo;
+    RandomTransaction(txTo, 3, 2);
+    CPrecomputedSighash sighashes(txTo);
+    CScript scriptCode;
+    scriptCode << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    txTo.vin[1].scriptSig << vector<unsigned char>(72, 2);
+    for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++)
+        BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, SIGHASH_ALL) == sighashes.SignatureHash(scriptCode, nIn, SIGHASH_ALL));
+}
+
+// Signing every input of a large consolidation transaction
+BOOST_AUTO_TEST_CASE(sighash_consolidation_bench)
+{
+    CTransaction txTo;
+    RandomTransaction(txTo, 500, 2);
+    CScript scriptCode;
+    scriptCode << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    int64_t nStart = GetTimeMicros();
+    uint256 hashLegacy = 0;
+    for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++)
+        hashLegacy ^= SignatureHash(scriptCode, txTo, nIn, SIGHASH_ALL);
+    int64_t nLegacy = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    uint256 hashFast = 0;
+    CPrecomputedSighash sighashes(txTo);
+    for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++)
+        hashFast ^= sighashes.SignatureHash(scriptCode, nIn, SIGHASH_ALL);
+    int64_t nFast = GetTimeMicros() - nStart;
+
+    BOOST_CHECK(hashLegacy == hashFast);
+    BOOST_TEST_MESSAGE(strprintf("sighash: %u inputs, legacy %.2fms, precomputed %.2fms",
+        (unsigned int)txTo.vin.size(), nLegacy * 0.001, nFast * 0.001));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
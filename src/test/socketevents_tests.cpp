@@ -0,0 +1,200 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+#include "socketevents.h"
+#include "util.h"
+
+using namespace std;
+
+#ifndef WIN32
+static void MakeSocketPair(SOCKET& hSocket1, SOCKET& hSocket2)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    hSocket1 = fds[0];
+    hSocket2 = fds[1];
+}
+
+static bool HasEvent(const vector<CSocketEvents::CEvent>& vEvents, void* pcookie, unsigned int nEvent)
+{
+    BOOST_FOREACH(const CSocketEvents::CEvent& event, vEvents)
+        if (event.pcookie == pcookie && (event.nEvents & nEvent))
+            return true;
+    return false;
+}
+
+static void WakeLater(CSocketEvents* pevents)
+{
+    MilliSleep(20);
+    pevents->Wake();
+}
+
+// Read everything the peers sent, waiting with select() as the socket
+// handler did; returns the bytes read
+static uint64_t ReadAllSelect(const vector<SOCKET>& vSockets, uint64_t nExpected)
+{
+    uint64_t nRead = 0;
+    char pchBuf[0x10000];
+    while (nRead < nExpected)
+    {
+        fd_set fdsetRecv;
+        FD_ZERO(&fdsetRecv);
+        SOCKET hSocketMax = 0;
+        BOOST_FOREACH(SOCKET hSocket, vSockets)
+        {
+            FD_SET(hSocket, &fdsetRecv);
+            hSocketMax = max(hSocketMax, hSocket);
+        }
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 50000;
+        if (select(hSocketMax + 1, &fdsetRecv, NULL, NULL, &timeout) <= 0)
+            continue;
+        BOOST_FOREACH(SOCKET hSocket, vSockets)
+        {
+            if (!FD_ISSET(hSocket, &fdsetRecv))
+                continue;
+            int nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+            if (nBytes > 0)
+                nRead += nBytes;
+        }
+    }
+    return nRead;
+}
+
+// The same with the edge triggered events, reading each ready socket
+// until it would block
+static uint64_t ReadAllEvents(CSocketEvents& events, uint64_t nExpected)
+{
+    uint64_t nRead = 0;
+    char pchBuf[0x10000];
+    vector<CSocketEvents::CEvent> vEvents;
+    while (nRead < nExpected)
+    {
+        if (!events.Wait(50, vEvents))
+            break;
+        BOOST_FOREACH(const CSocketEvents::CEvent& event, vEvents)
+        {
+            if (!(event.nEvents & CSocketEvents::EVENT_RECV))
+                continue;
+            SOCKET hSocket = *(SOCKET*)event.pcookie;
+            int nBytes;
+            while ((nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT)) > 0)
+                nRead += nBytes;
+        }
+    }
+    return nRead;
+}
+
+static void WriteAll(const vector<SOCKET>& vSockets, int nMessages)
+{
+    char pchMessage[256];
+    memset(pchMessage, 0x5a, sizeof(pchMessage));
+    for (int i = 0; i < nMessages; i++)
+        BOOST_FOREACH(SOCKET hSocket, vSockets)
+            send(hSocket, pchMessage, sizeof(pchMessage), MSG_NOSIGNAL);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE(socketevents_tests)
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(socketevents_edge_triggered)
+{
+    CSocketEvents events;
+    if (!events.IsValid())
+    {
+        BOOST_TEST_MESSAGE("no epoll, the socket handler uses select");
+        return;
+    }
+
+    SOCKET hSocket1, hSocket2;
+    MakeSocketPair(hSocket1, hSocket2);
+    int nCookie = 0;
+    BOOST_CHECK(events.Add(hSocket1, &nCookie));
+
+    // A new socket is writable at once, and that is reported once
+    vector<CSocketEvents::CEvent> vEvents;
+    BOOST_CHECK(events.Wait(0, vEvents));
+    BOOST_CHECK(HasEvent(vEvents, &nCookie, CSocketEvents::EVENT_SEND));
+    BOOST_CHECK(!HasEvent(vEvents, &nCookie, CSocketEvents::EVENT_RECV));
+    BOOST_CHECK(events.Wait(0, vEvents));
+    BOOST_CHECK(vEvents.empty());
+
+    // Data arriving is reported, and not again while it is left unread
+    BOOST_CHECK_EQUAL(send(hSocket2, "x", 1, MSG_NOSIGNAL), 1);
+    BOOST_CHECK(events.Wait(1000, vEvents));
+    BOOST_CHECK(HasEvent(vEvents, &nCookie, CSocketEvents::EVENT_RECV));
+    BOOST_CHECK(events.Wait(0, vEvents));
+    BOOST_CHECK(vEvents.empty());
+
+    // More data is a new edge
+    BOOST_CHECK_EQUAL(send(hSocket2, "y", 1, MSG_NOSIGNAL), 1);
+    BOOST_CHECK(events.Wait(1000, vEvents));
+    BOOST_CHECK(HasEvent(vEvents, &nCookie, CSocketEvents::EVENT_RECV));
+
+    // Wake() ends a wait from another thread, without an event
+    boost::thread threadWake(WakeLater, &events);
+    int64_t nStart = GetTimeMillis();
+    BOOST_CHECK(events.Wait(10000, vEvents));
+    BOOST_CHECK(GetTimeMillis() - nStart < 5000);
+    BOOST_CHECK(vEvents.empty());
+    threadWake.join();
+
+    // The peer going away is reported as readable
+    closesocket(hSocket2);
+    BOOST_CHECK(events.Wait(1000, vEvents));
+    BOOST_CHECK(HasEvent(vEvents, &nCookie, CSocketEvents::EVENT_RECV));
+
+    events.Remove(hSocket1);
+    closesocket(hSocket1);
+}
+
+// Many connections with a little traffic each, as on a busy public node
+BOOST_AUTO_TEST_CASE(socketevents_throughput_bench)
+{
+    CSocketEvents events;
+    if (!events.IsValid())
+        return;
+
+    const int nPairs = 400;
+    const int nMessages = 20;
+    vector<SOCKET> vRead(nPairs), vWrite(nPairs);
+    for (int i = 0; i < nPairs; i++)
+    {
+        MakeSocketPair(vRead[i], vWrite[i]);
+        BOOST_REQUIRE(events.Add(vRead[i], &vRead[i]));
+    }
+    // Drain the initial writable events
+    vector<CSocketEvents::CEvent> vEvents;
+    events.Wait(0, vEvents);
+
+    const uint64_t nExpected = (uint64_t)nPairs * nMessages * 256;
+    const int nRounds = 5;
+    int64_t nSelectMicros = 0, nEventsMicros = 0;
+    for (int nRound = 0; nRound < nRounds; nRound++)
+    {
+        WriteAll(vWrite, nMessages);
+        int64_t nStart = GetTimeMicros();
+        BOOST_CHECK_EQUAL(ReadAllSelect(vRead, nExpected), nExpected);
+        nSelectMicros += GetTimeMicros() - nStart;
+
+        WriteAll(vWrite, nMessages);
+        nStart = GetTimeMicros();
+        BOOST_CHECK_EQUAL(ReadAllEvents(events, nExpected), nExpected);
+        nEventsMicros += GetTimeMicros() - nStart;
+    }
+
+    BOOST_TEST_MESSAGE(strprintf("socket reads: %d connections, %.1f MB/s with select, %.1f MB/s with epoll",
+        nPairs, (double)nExpected * nRounds / max(nSelectMicros, (int64_t)1), (double)nExpected * nRounds / max(nEventsMicros, (int64_t)1)));
+
+    for (int i = 0; i < nPairs; i++)
+    {
+        closesocket(vRead[i]);
+        closesocket(vWrite[i]);
+    }
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
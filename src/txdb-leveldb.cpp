@@ -15,6 +15,7 @@
 #include <leveldb/filter_policy.h>
 #include <memenv/memenv.h>
 
+#include "chainstats.h"
 #include "kernel.h"
 #include "txdb.h"
 #include "util.h"
@@ -26,10 +27,185 @@ using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+/**
+ * Write-back cache shared by all CTxDB instances. Committed transactions
+ * land here and reach LevelDB together in one atomic WriteBatch, so the
+ * database on disk is always a consistent, if slightly older, state.
+ * Values read from LevelDB are kept as clean entries until the cache
+ * outgrows its budget. A read that missed the cache only adds its value if
+ * the cache has not changed since the miss (nGeneration), otherwise a value
+ * read before a newer one was applied and dropped again could stay cached.
+ */
+class CDBCache
+{
+private:
+    mutable CCriticalSection cs;
+    CDBBatch mapEntries;
+    size_t nBytes;       // estimated memory held by mapEntries
+    size_t nDirtyBytes;  // part of nBytes that is waiting to be written
+    size_t nMaxBytes;
+    int64_t nLastFlush;
+    uint64_t nGeneration; // bumped whenever entries change or go
+
+    static size_t EntryBytes(const std::string& strKey, const CDBCacheEntry& entry)
+    {
+        // Key and value plus hash node and string headers
+        return strKey.size() + entry.strValue.size() + 96;
+    }
+
+    void Set(const std::string& strKey, const CDBCacheEntry& entry)
+    {
+        CDBBatch::iterator it = mapEntries.find(strKey);
+        if (it != mapEntries.end())
+        {
+            size_t nOld = EntryBytes(it->first, it->second);
+            nBytes -= nOld;
+            if (it->second.fDirty)
+                nDirtyBytes -= nOld;
+            it->second = entry;
+        }
+        else
+            it = mapEntries.insert(make_pair(strKey, entry)).first;
+        size_t nNew = EntryBytes(it->first, it->second);
+        nBytes += nNew;
+        if (entry.fDirty)
+            nDirtyBytes += nNew;
+    }
+
+    bool WriteDirty(leveldb::DB* pdb)
+    {
+        if (nDirtyBytes == 0)
+            return true;
+
+        int64_t nStart = GetTimeMillis();
+        leveldb::WriteBatch batch;
+        unsigned int nWritten = 0;
+        for (CDBBatch::iterator it = mapEntries.begin(); it != mapEntries.end(); ++it)
+        {
+            if (!it->second.fDirty)
+                continue;
+            if (it->second.fErased)
+                batch.Delete(it->first);
+            else
+                batch.Put(it->first, it->second.strValue);
+            nWritten++;
+        }
+        leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+        if (!status.ok())
+            return error("CDBCache::WriteDirty() : LevelDB batch commit failure: %s", status.ToString());
+
+        // Deletes are not worth keeping, everything else is now clean
+        nGeneration++;
+        for (CDBBatch::iterator it = mapEntries.begin(); it != mapEntries.end(); )
+        {
+            if (it->second.fErased)
+            {
+                nBytes -= EntryBytes(it->first, it->second);
+                it = mapEntries.erase(it);
+            }
+            else
+            {
+                it->second.fDirty = false;
+                ++it;
+            }
+        }
+        nDirtyBytes = 0;
+        nLastFlush = GetTime();
+        LogPrint("db", "CDBCache::WriteDirty() : %u entries in %dms\n", nWritten, GetTimeMillis() - nStart);
+        return true;
+    }
+
+public:
+    CDBCache() : nBytes(0), nDirtyBytes(0), nMaxBytes(0), nLastFlush(0), nGeneration(0) {}
+
+    void SetMaxBytes(size_t nMaxBytesIn)
+    {
+        LOCK(cs);
+        nMaxBytes = nMaxBytesIn;
+    }
+
+    /** True if the cache knows strKey; fErased tells whether it is deleted.
+        On a miss nGenerationRet is for AddClean */
+    bool Get(const std::string& strKey, std::string& strValue, bool& fErased, uint64_t& nGenerationRet) const
+    {
+        LOCK(cs);
+        CDBBatch::const_iterator it = mapEntries.find(strKey);
+        nGenerationRet = nGeneration;
+        if (it == mapEntries.end())
+            return false;
+        fErased = it->second.fErased;
+        if (!fErased)
+            strValue = it->second.strValue;
+        return true;
+    }
+
+    /** Remember a value just read from LevelDB, after a miss in Get that
+        returned nGenerationRead */
+    void AddClean(const std::string& strKey, const std::string& strValue, uint64_t nGenerationRead)
+    {
+        LOCK(cs);
+        if (nGenerationRead != nGeneration || nBytes >= nMaxBytes || mapEntries.count(strKey))
+            return;
+        Set(strKey, CDBCacheEntry(strValue, false, false));
+    }
+
+    /** Take over the writes of a committed transaction */
+    void Apply(const CDBBatch& batch)
+    {
+        LOCK(cs);
+        nGeneration++;
+        for (CDBBatch::const_iterator it = batch.begin(); it != batch.end(); ++it)
+            Set(it->first, it->second);
+    }
+
+    /** Write out dirty entries if forced or a threshold is reached, then trim */
+    bool Flush(leveldb::DB* pdb, bool fForce)
+    {
+        LOCK(cs);
+        if (nLastFlush == 0)
+            nLastFlush = GetTime();
+        if (fForce || nDirtyBytes >= nMaxBytes || GetTime() - nLastFlush >= DB_CACHE_FLUSH_INTERVAL)
+            if (!WriteDirty(pdb))
+                return false;
+
+        // Over budget with mostly clean entries, start over
+        if (nBytes >= nMaxBytes)
+        {
+            nGeneration++;
+            for (CDBBatch::iterator it = mapEntries.begin(); it != mapEntries.end(); )
+            {
+                if (it->second.fDirty)
+                    ++it;
+                else
+                {
+                    nBytes -= EntryBytes(it->first, it->second);
+                    it = mapEntries.erase(it);
+                }
+            }
+        }
+        return true;
+    }
+
+    void Clear()
+    {
+        LOCK(cs);
+        nGeneration++;
+        mapEntries.clear();
+        nBytes = 0;
+        nDirtyBytes = 0;
+    }
+};
+
+static CDBCache dbcache;
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
-    int nCacheSizeMB = GetArg("-dbcache", 25);
-    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
+    // A quarter of -dbcache goes to LevelDB's block cache, the rest to the
+    // write-back cache in front of it
+    int64_t nCacheSize = GetArg("-dbcache", DEFAULT_DB_CACHE) * 1048576;
+    nCacheSize = max(nCacheSize, (int64_t)4 * 1048576);
+    options.block_cache = leveldb::NewLRUCache(nCacheSize / 4);
+    dbcache.SetMaxBytes(nCacheSize - nCacheSize / 4);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
     return options;
 }
@@ -101,6 +277,7 @@ CTxDB::CTxDB(const char* pszMode)
             LogPrintf("Required index version is %d, removing old database\n", DATABASE_VERSION);
 
             // Leveldb instance destruction
+            dbcache.Clear();
             delete txdb;
             txdb = pdb = NULL;
             delete activeBatch;
@@ -128,6 +305,8 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    FlushTxDB();
+    dbcache.Clear();
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
@@ -138,68 +317,81 @@ void CTxDB::Close()
     activeBatch = NULL;
 }
 
+bool FlushTxDB()
+{
+    if (!txdb)
+        return true;
+    return dbcache.Flush(txdb, true);
+}
+
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
-    activeBatch = new leveldb::WriteBatch();
+    activeBatch = new CDBBatch();
     return true;
 }
 
 bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+    dbcache.Apply(*activeBatch);
     delete activeBatch;
     activeBatch = NULL;
-    if (!status.ok()) {
-        LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
+    if (!dbcache.Flush(pdb, false)) {
+        LogPrintf("LevelDB batch commit failure\n");
         return false;
     }
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
+bool CTxDB::ReadRaw(const string& strKey, string& strValue)
+{
+    // Pending changes of this transaction come first, the rest of the code
+    // assumes that reads are consistent with them
+    if (activeBatch) {
+        CDBBatch::const_iterator it = activeBatch->find(strKey);
+        if (it != activeBatch->end()) {
+            if (it->second.fErased)
+                return false;
+            strValue = it->second.strValue;
+            return true;
         }
     }
 
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
-        }
-    }
-};
+    bool fErased = false;
+    uint64_t nGeneration;
+    if (dbcache.Get(strKey, strValue, fErased, nGeneration))
+        return !fErased;
 
-// When performing a read, if we have an active batch we need to check it first
-// before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
-bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
-    assert(activeBatch);
-    *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
+    leveldb::Status status = pdb->Get(leveldb::ReadOptions(), strKey, &strValue);
     if (!status.ok()) {
-        throw runtime_error(status.ToString());
+        if (status.IsNotFound())
+            return false;
+        // Some unexpected error.
+        LogPrintf("LevelDB read failure: %s\n", status.ToString());
+        return false;
+    }
+    dbcache.AddClean(strKey, strValue, nGeneration);
+    return true;
+}
+
+bool CTxDB::WriteRaw(const string& strKey, const string& strValue, bool fErase)
+{
+    if (activeBatch) {
+        (*activeBatch)[strKey] = CDBCacheEntry(strValue, fErase, true);
+        return true;
     }
-    return scanner.foundEntry;
+
+    CDBBatch batch;
+    batch[strKey] = CDBCacheEntry(strValue, fErase, true);
+    dbcache.Apply(batch);
+    return dbcache.Flush(pdb, false);
+}
+
+bool CTxDB::ExistsRaw(const string& strKey)
+{
+    string unused;
+    return ReadRaw(strKey, unused);
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
@@ -283,62 +475,67 @@ bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
     return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
 }
 
-static CBlockIndex *InsertBlockIndex(uint256 hash)
+namespace {
+/** A blockindex record, read by the main thread and decoded by a worker */
+struct CBlockIndexRecord
+{
+    std::string strValue;
+    CDiskBlockIndex diskindex;
+    uint256 hash;
+    bool fDecoded;
+};
+}
+
+// Records handed to the decoding threads at a time
+static const size_t BLOCKINDEX_LOAD_BATCH = 8192;
+
+static CBlockIndex *InsertBlockIndex(const uint256& hash)
 {
     if (hash == 0)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
-    if (mi != mapBlockIndex.end())
-        return (*mi).second;
+    pair<CBlockMap::iterator, bool> ret = mapBlockIndex.insert(make_pair(hash, (CBlockIndex*)NULL));
+    if (!ret.second)
+        return ret.first->second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+    CBlockIndex* pindexNew = new (arenaBlockIndex.Allocate()) CBlockIndex();
+    ret.first->second = pindexNew;
+    pindexNew->phashBlock = &ret.first->first;
 
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+static void DecodeBlockIndexRecords(vector<CBlockIndexRecord>* pvRecords, size_t nBegin, size_t nEnd)
 {
-    if (mapBlockIndex.size() > 0) {
-        // Already loaded once in this session. It can happen during migration
-        // from BDB.
-        return true;
-    }
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
+    for (size_t i = nBegin; i < nEnd; i++)
     {
-        boost::this_thread::interruption_point();
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
+        CBlockIndexRecord& rec = (*pvRecords)[i];
+        rec.fDecoded = false;
+        try {
+            CSpanReader ssValue(rec.strValue.data(), rec.strValue.data() + rec.strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> rec.diskindex;
+            // Hashing the header is the costly part for recent blocks
+            rec.hash = rec.diskindex.GetBlockHash();
+            rec.fDecoded = true;
+        }
+        catch (std::exception &e) {
+            LogPrintf("LoadBlockIndex() : deserialize error: %s\n", e.what());
+        }
+    }
+}
 
-        uint256 blockHash = diskindex.GetBlockHash();
+static bool LinkBlockIndexRecords(const vector<CBlockIndexRecord>& vRecords)
+{
+    BOOST_FOREACH(const CBlockIndexRecord& rec, vRecords)
+    {
+        if (!rec.fDecoded)
+            return error("LoadBlockIndex() : unreadable blockindex record");
+        const CDiskBlockIndex& diskindex = rec.diskindex;
 
         // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+        CBlockIndex* pindexNew    = InsertBlockIndex(rec.hash);
         pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
         pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
         pindexNew->nFile          = diskindex.nFile;
@@ -358,40 +555,119 @@ bool CTxDB::LoadBlockIndex()
         pindexNew->nBits          = diskindex.nBits;
         pindexNew->nNonce         = diskindex.nNonce;
 
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
+        if (!pindexNew->CheckIndex())
             return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-        }
 
         // NovaCoin: build setStakeSeen
         if (pindexNew->IsProofOfStake())
             setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    }
+    return true;
+}
 
-        iterator->Next();
+bool CTxDB::LoadBlockIndex()
+{
+    if (mapBlockIndex.size() > 0) {
+        // Already loaded once in this session. It can happen during migration
+        // from BDB.
+        return true;
+    }
+    // The block index is an in-memory structure that maps hashes to on-disk
+    // locations where the contents of the block can be found. Here, we scan it
+    // out of the DB and into mapBlockIndex.
+    int64_t nStart = GetTimeMillis();
+    int nThreads = max(nScriptCheckThreads, 1);
+
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("blockindex");
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("blockindex"), uint256(0));
+    CDataStream ssEndKey(SER_DISK, CLIENT_VERSION);
+    ssEndKey << make_pair(string("blockindex"), ~uint256(0));
+
+    // Size the hash table up front from the on-disk size of the records
+    uint64_t nApproxBytes = 0;
+    leveldb::Range range(ssStartKey.str(), ssEndKey.str());
+    pdb->GetApproximateSizes(&range, 1, &nApproxBytes);
+    mapBlockIndex.reserve(nApproxBytes / 150 + 1);
+
+    // The main thread reads the next batch from the database and links the
+    // previous one while the workers decode the current one
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    iterator->Seek(ssStartKey.str());
+    leveldb::Slice prefix(&ssPrefix[0], ssPrefix.size());
+    vector<CBlockIndexRecord> vDecoding, vLinking;
+    size_t nRecords = 0;
+    while (true)
+    {
+        boost::this_thread::interruption_point();
+        size_t nCount = 0;
+        for (; nCount < BLOCKINDEX_LOAD_BATCH && iterator->Valid(); iterator->Next())
+        {
+            // Did we reach the end of the data to read?
+            if (!iterator->key().starts_with(prefix))
+                break;
+            if (vDecoding.size() <= nCount)
+                vDecoding.resize(nCount + 1);
+            vDecoding[nCount++].strValue.assign(iterator->value().data(), iterator->value().size());
+        }
+        vDecoding.resize(nCount);
+        nRecords += nCount;
+
+        boost::thread_group decoders;
+        if (nThreads > 1 && nCount > 0)
+        {
+            size_t nPerThread = (nCount + nThreads - 1) / nThreads;
+            for (size_t nBegin = 0; nBegin < nCount; nBegin += nPerThread)
+                decoders.create_thread(boost::bind(&DecodeBlockIndexRecords, &vDecoding, nBegin, min(nBegin + nPerThread, nCount)));
+        }
+        else
+            DecodeBlockIndexRecords(&vDecoding, 0, nCount);
+
+        bool fLinked = LinkBlockIndexRecords(vLinking);
+        decoders.join_all();
+        if (!fLinked)
+        {
+            delete iterator;
+            return false;
+        }
+        if (nCount == 0)
+            break;
+        vLinking.swap(vDecoding);
     }
     delete iterator;
+    int64_t nLoaded = GetTimeMillis();
+
+    // Watch for genesis block
+    CBlockMap::iterator miGenesis = mapBlockIndex.find(Params().HashGenesisBlock());
+    if (pindexGenesisBlock == NULL && miGenesis != mapBlockIndex.end())
+        pindexGenesisBlock = miGenesis->second;
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
+    // Calculate nChainTrust in one pass: walk back to the nearest ancestor
+    // whose trust is known, then fill in forward, so each block is visited
+    // once without sorting the whole index by height
+    vector<CBlockIndex*> vPath;
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        for (CBlockIndex* pindex = item.second; pindex && pindex->nChainTrust == 0; pindex = pindex->pprev)
+            vPath.push_back(pindex);
+        while (!vPath.empty())
+        {
+            CBlockIndex* pindex = vPath.back();
+            vPath.pop_back();
+            pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        }
     }
 
+    // Map block file positions back to the index for CTxIndex lookups
+    blockposindex.Rebuild();
+    int64_t nTrusted = GetTimeMillis();
+
+    LogPrintf("LoadBlockIndex(): %u records using %d threads: read %dms, trust %dms\n",
+      (unsigned int)nRecords, nThreads, nLoaded - nStart, nTrusted - nLoaded);
+
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
     {
@@ -402,6 +678,8 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    chainActive.SetTip(pindexBest);
+    chainstats.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -422,6 +700,7 @@ bool CTxDB::LoadBlockIndex()
     if (nCheckDepth > nBestHeight)
         nCheckDepth = nBestHeight;
     LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+    int64_t nVerifyStart = GetTimeMillis();
     CBlockIndex* pindexFork = NULL;
     map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
@@ -530,6 +809,7 @@ bool CTxDB::LoadBlockIndex()
             }
         }
     }
+    LogPrintf("LoadBlockIndex(): verify %dms\n", GetTimeMillis() - nVerifyStart);
     if (pindexFork)
     {
         boost::this_thread::interruption_point();
@@ -15,6 +15,8 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+#include <boost/unordered_map.hpp>
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -27,6 +29,30 @@
 // together when too many files stack up.
 //
 // Learn more: http://code.google.com/p/leveldb/
+/** Default for -dbcache, in megabytes */
+static const int DEFAULT_DB_CACHE = 25;
+/** Flush the write-back cache at least this often, in seconds */
+static const int64_t DB_CACHE_FLUSH_INTERVAL = 10 * 60;
+
+/** A value waiting in the write-back cache, or a delete if fErased */
+struct CDBCacheEntry
+{
+    std::string strValue;
+    bool fErased;
+    bool fDirty;
+
+    CDBCacheEntry() : fErased(false), fDirty(false) {}
+    CDBCacheEntry(const std::string& strValueIn, bool fErasedIn, bool fDirtyIn) :
+        strValue(strValueIn), fErased(fErasedIn), fDirty(fDirtyIn) {}
+};
+
+/** Writes of one database transaction, keyed by the serialized key */
+typedef boost::unordered_map<std::string, CDBCacheEntry> CDBBatch;
+
+/** Write everything held in the write-back cache to LevelDB, e.g. on shutdown
+ *  or for a new best block after the initial download */
+bool FlushTxDB();
+
 class CTxDB
 {
 public:
@@ -44,17 +70,20 @@ private:
     leveldb::DB *pdb;  // Points to the global instance.
 
     // A batch stores up writes and deletes for atomic application. When this
-    // field is non-NULL, writes/deletes go there instead of directly to disk.
-    leveldb::WriteBatch *activeBatch;
+    // field is non-NULL, writes/deletes go there instead of to the cache.
+    CDBBatch *activeBatch;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
 
 protected:
-    // Returns true and sets (value,false) if activeBatch contains the given key
-    // or leaves value alone and sets deleted = true if activeBatch contains a
-    // delete for it.
-    bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
+    // Reads go to the active batch first, then the shared write-back cache,
+    // then LevelDB. Writes and deletes go to the active batch, or straight to
+    // the cache outside of a transaction; the cache reaches the disk in large
+    // atomic batches once it grows past -dbcache or DB_CACHE_FLUSH_INTERVAL.
+    bool ReadRaw(const std::string& strKey, std::string& strValue);
+    bool WriteRaw(const std::string& strKey, const std::string& strValue, bool fErase);
+    bool ExistsRaw(const std::string& strKey);
 
     template<typename K, typename T>
     bool Read(const K& key, T& value)
@@ -63,28 +92,9 @@ protected:
         ssKey.reserve(1000);
         ssKey << key;
         std::string strValue;
+        if (!ReadRaw(ssKey.str(), strValue))
+            return false;
 
-        bool readFromDb = true;
-        if (activeBatch) {
-            // First we must search for it in the currently pending set of
-            // changes to the db. If not found in the batch, go on to read disk.
-            bool deleted = false;
-            readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
-            if (deleted) {
-                return false;
-            }
-        }
-        if (readFromDb) {
-            leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
-                                              ssKey.str(), &strValue);
-            if (!status.ok()) {
-                if (status.IsNotFound())
-                    return false;
-                // Some unexpected error.
-                LogPrintf("LevelDB read failure: %s\n", status.ToString());
-                return false;
-            }
-        }
         // Unserialize value
         try {
             CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(),
@@ -110,16 +120,7 @@ protected:
         ssValue.reserve(10000);
         ssValue << value;
 
-        if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
-            return true;
-        }
-        leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
-        if (!status.ok()) {
-            LogPrintf("LevelDB write failure: %s\n", status.ToString());
-            return false;
-        }
-        return true;
+        return WriteRaw(ssKey.str(), ssValue.str(), false);
     }
 
     template<typename K>
@@ -133,12 +134,7 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
-            return true;
-        }
-        leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
-        return (status.ok() || status.IsNotFound());
+        return WriteRaw(ssKey.str(), std::string(), true);
     }
 
     template<typename K>
@@ -147,18 +143,7 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        std::string unused;
-
-        if (activeBatch) {
-            bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
-            }
-        }
-
-
-        leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
-        return status.IsNotFound() == false;
+        return ExistsRaw(ssKey.str());
     }
 
 
@@ -9,8 +9,17 @@
 
 using namespace std;
 
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, unsigned int nTxSizeIn,
+                                 int64_t nTimeIn, unsigned int nHeightIn) :
+    ptx(new CTransaction(txIn)), hash(txIn.GetHash()), nFee(nFeeIn), nTxSize(nTxSizeIn),
+    nTime(nTimeIn), nHeight(nHeightIn)
+{
+}
+
 CTxMemPool::CTxMemPool()
 {
+    nTransactionsUpdated = 0;
+    nTotalTxSize = 0;
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -25,16 +34,18 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = tx;
+        indexed_transaction_set::iterator it = mapTx.insert(entry).first;
+        const CTransaction& tx = it->GetTx();
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+        nTotalTxSize += it->GetTxSize();
         nTransactionsUpdated++;
     }
     return true;
@@ -46,7 +57,8 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
     {
         LOCK(cs);
         uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
+        indexed_transaction_set::iterator mi = mapTx.find(hash);
+        if (mi != mapTx.end())
         {
             if (fRecursive) {
                 for (unsigned int i = 0; i < tx.vout.size(); i++) {
@@ -57,13 +69,31 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
             }
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+            // tx may live in the entry itself, so it must not be used past this point
+            nTotalTxSize -= mi->GetTxSize();
+            mapTx.erase(mi);
             nTransactionsUpdated++;
         }
     }
     return true;
 }
 
+unsigned int CTxMemPool::TrimToSize(uint64_t nSizeLimit)
+{
+    LOCK(cs);
+    unsigned int nEvicted = 0;
+    while (nTotalTxSize > nSizeLimit && !mapTx.empty())
+    {
+        // The fee rate index is sorted best first
+        indexed_transaction_set::index<feerate>::type::iterator it = --mapTx.get<feerate>().end();
+        unsigned int nSizeBefore = mapTx.size();
+        LogPrint("mempool", "TrimToSize : evicting %s (%.0f per kB)\n", it->GetHash().ToString(), it->GetFeePerK());
+        remove(it->GetTx(), true);
+        nEvicted += nSizeBefore - mapTx.size();
+    }
+    return nEvicted;
+}
+
 bool CTxMemPool::removeConflicts(const CTransaction &tx)
 {
     // Remove transactions which depend on inputs of tx, recursively
@@ -84,6 +114,7 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    nTotalTxSize = 0;
     ++nTransactionsUpdated;
 }
 
@@ -93,15 +124,15 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (indexed_transaction_set::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetHash());
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    std::map<uint256, CTransaction>::const_iterator i = mapTx.find(hash);
+    indexed_transaction_set::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second;
+    result = i->GetTx();
     return true;
 }
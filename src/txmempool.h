@@ -8,6 +8,70 @@
 #include "core.h"
 #include "sync.h"
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/mem_fun.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/shared_ptr.hpp>
+
+/** A transaction in the memory pool, with the size and fee it was accepted with */
+class CTxMemPoolEntry
+{
+private:
+    boost::shared_ptr<const CTransaction> ptx; // shared, entries are copied into the index
+    uint256 hash;
+    int64_t nFee;           // Value in minus value out
+    unsigned int nTxSize;   // Serialized size
+    int64_t nTime;          // Local time when entering the pool
+    unsigned int nHeight;   // Chain height when entering the pool
+
+public:
+    CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, unsigned int nTxSizeIn,
+                    int64_t nTimeIn, unsigned int nHeightIn);
+
+    const CTransaction& GetTx() const { return *ptx; }
+    const uint256& GetHash() const { return hash; }
+    int64_t GetFee() const { return nFee; }
+    unsigned int GetTxSize() const { return nTxSize; }
+    int64_t GetTime() const { return nTime; }
+    unsigned int GetHeight() const { return nHeight; }
+    double GetFeePerK() const { return nTxSize ? (double)nFee * 1000 / nTxSize : 0; }
+};
+
+/** Orders entries by fee per kilobyte, highest first, ties broken by txid */
+class CompareTxMemPoolEntryByFeeRate
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        // Cross multiply to avoid the division in GetFeePerK
+        double f1 = (double)a.GetFee() * b.GetTxSize();
+        double f2 = (double)b.GetFee() * a.GetTxSize();
+        if (f1 == f2)
+            return a.GetHash() < b.GetHash();
+        return f1 > f2;
+    }
+};
+
+/** Tag for the fee rate index of CTxMemPool::mapTx */
+struct feerate {};
+
+typedef boost::multi_index_container<
+    CTxMemPoolEntry,
+    boost::multi_index::indexed_by<
+        // sorted by txid, mapTx.find(hash) and friends use this one
+        boost::multi_index::ordered_unique<
+            boost::multi_index::const_mem_fun<CTxMemPoolEntry, const uint256&, &CTxMemPoolEntry::GetHash>
+        >,
+        // sorted by fee rate, mapTx.get<feerate>() iterates best first
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<feerate>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByFeeRate
+        >
+    >
+> indexed_transaction_set;
+
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -17,20 +81,25 @@
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * The pool is bounded: TrimToSize() evicts the transactions paying the
+ * lowest fee per kilobyte, together with everything spending them, until
+ * the serialized size of the pool fits the limit (see -maxmempool).
  */
 class CTxMemPool
 {
 private:
     unsigned int nTransactionsUpdated;
+    uint64_t nTotalTxSize;
 
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
@@ -38,12 +107,23 @@ public:
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
+    /** Evict the lowest fee rate transactions and their descendants until
+     *  the pool is at most nSizeLimit bytes; returns the number evicted */
+    unsigned int TrimToSize(uint64_t nSizeLimit);
+
     unsigned long size() const
     {
         LOCK(cs);
         return mapTx.size();
     }
 
+    /** Sum of the serialized sizes of all transactions in the pool */
+    uint64_t GetTotalTxSize() const
+    {
+        LOCK(cs);
+        return nTotalTxSize;
+    }
+
     bool exists(uint256 hash) const
     {
         LOCK(cs);
@@ -2885,8 +2885,9 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
 
                 // Sign
                 int nIn = 0;
+                CPrecomputedSighash sighashes(txNew);
                 BOOST_FOREACH (const PAIRTYPE(const CWalletTx*, unsigned int) & coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, txNew, nIn++)) {
+                    if (!SignSignature(*this, *coin.first, txNew, nIn++, SIGHASH_ALL, &sighashes)) {
                         strFailReason = _("Signing transaction failed");
                         return false;
                     }
@@ -2978,6 +2979,34 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (GetAdjustedTime() - chainActive.Tip()->GetBlockTime() < 60)
         MilliSleep(10000);
 
+    // Sweep the whole search interval for all plain outputs at once; zRPI
+    // mints have their own kernel and are still tried one by one below
+    CStakeKernelSearch kernelSearch(chainActive.Tip(), nBits);
+    vector<CStakeInput*> vSearchInputs;
+    for (std::unique_ptr<CStakeInput>& stakeInput : listInputs) {
+        if (stakeInput->IsZRPI())
+            continue;
+        CBlockIndex* pindex = stakeInput->GetIndexFrom();
+        CTransaction txFrom;
+        CTxIn in;
+        if (!pindex || pindex->nHeight < 1 || !stakeInput->GetTxFrom(txFrom) || !stakeInput->CreateTxIn(this, in))
+            continue;
+        kernelSearch.Add(in.prevout, txFrom.nTime, stakeInput->GetValue());
+        vSearchInputs.push_back(stakeInput.get());
+    }
+
+    CStakeInput* pSearchKernel = NULL;
+    unsigned int nSearchKernelTime = 0;
+    uint256 hashSearchProof = 0;
+    int64_t nSearchEnd = GetAdjustedTime();
+    int64_t nSearchBegin = min(nSearchEnd - nSearchInterval, nSearchEnd & ~(int64_t)STAKE_TIMESTAMP_MASK);
+    size_t nSearchIndex;
+    uint64_t nSearchHashes = 0;
+    int64_t nSearchStart = GetTimeMicros();
+    if (kernelSearch.Search(nSearchBegin, nSearchEnd, nSearchIndex, nSearchKernelTime, hashSearchProof, nStakeSearchThreads, &nSearchHashes))
+        pSearchKernel = vSearchInputs[nSearchIndex];
+    stakeSearchStats.AddSearch(nSearchBegin, nSearchEnd, nSearchHashes, GetTimeMicros() - nSearchStart, pSearchKernel != NULL);
+
     CAmount nCredit;
     CScript scriptPubKeyKernel;
     bool fKernelFound = false;
@@ -2987,20 +3016,29 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
         if (IsLocked() || ShutdownRequested())
             return false;
 
-        //make sure that enough time has elapsed between
-        CBlockIndex* pindex = stakeInput->GetIndexFrom();
-        if (!pindex || pindex->nHeight < 1) {
-            LogPrintf("*** no pindexfrom\n");
-            continue;
-        }
-
-        // Read block header
-        CBlockHeader block = pindex->GetBlockHeader();
         uint256 hashProofOfStake = 0;
-        nTxNewTime = GetAdjustedTime();
+        bool fStake;
+        if (!stakeInput->IsZRPI()) {
+            if (stakeInput.get() != pSearchKernel)
+                continue;
+            nTxNewTime = nSearchKernelTime;
+            hashProofOfStake = hashSearchProof;
+            fStake = true;
+        } else {
+            //make sure that enough time has elapsed between
+            CBlockIndex* pindex = stakeInput->GetIndexFrom();
+            if (!pindex || pindex->nHeight < 1) {
+                LogPrintf("*** no pindexfrom\n");
+                continue;
+            }
+
+            // Read block header
+            CBlockHeader block = pindex->GetBlockHeader();
+            nTxNewTime = GetAdjustedTime();
+            fStake = Stake(stakeInput.get(), nBits, block.GetBlockTime(), nTxNewTime, hashProofOfStake);
+        }
 
-        //iterates each utxo inside of CheckStakeKernelHash()
-        if (Stake(stakeInput.get(), nBits, block.GetBlockTime(), nTxNewTime, hashProofOfStake)) {
+        if (fStake) {
             LOCK(cs_main);
             //Double check that this will pass time requirements
             if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
@@ -3072,9 +3110,10 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     // Sign for WSP
     int nIn = 0;
     if (!txNew.vin[0].scriptSig.IsZerocoinSpend()) {
+        CPrecomputedSighash sighashes(txNew);
         for (CTxIn txIn : txNew.vin) {
             const CWalletTx *wtx = GetWalletTx(txIn.prevout.hash);
-            if (!SignSignature(*this, *wtx, txNew, nIn++))
+            if (!SignSignature(*this, *wtx, txNew, nIn++, SIGHASH_ALL, &sighashes))
                 return error("CreateCoinStake : failed to sign coinstake");
         }
     } else {
@@ -4571,8 +4610,9 @@ bool CWallet::CreateZerocoinMintTransaction(const CAmount nValue, CMutableTransa
     // Sign if these are RPICoin outputs - NOTE that zRPI outputs are signed later in SoK
     if (!isZCSpendChange) {
         int nIn = 0;
+        CPrecomputedSighash sighashes(txNew);
         for (const std::pair<const CWalletTx*, unsigned int>& coin : setCoins) {
-            if (!SignSignature(*this, *coin.first, txNew, nIn++)) {
+            if (!SignSignature(*this, *coin.first, txNew, nIn++, SIGHASH_ALL, &sighashes)) {
                 strFailReason = _("Signing transaction failed");
                 return false;
             }